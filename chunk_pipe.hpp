@@ -0,0 +1,344 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <streambuf>
+#include <thread>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Lock-free single-producer/single-consumer ring. pop() spins briefly and
+// then sleeps on a futex until the producer publishes something.
+template<typename T, size_t Capacity>
+class SpscRing {
+private:
+    static_assert((Capacity & (Capacity - 1)) == 0, "SpscRing: capacity must be a power of two");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t)
+                  && std::atomic<uint32_t>::is_always_lock_free, "SpscRing: futex needs a plain 32-bit word");
+
+    static constexpr int spin_limit = 64;
+
+    T slots[Capacity];
+    alignas(64) std::atomic<uint32_t> head;     // Next slot to pop, written by the consumer
+    alignas(64) std::atomic<uint32_t> tail;     // Next slot to push, written by the producer
+    alignas(64) std::atomic<uint32_t> sleepers; // Consumers blocked in futex wait on tail
+
+    uint32_t* tailWord() {
+        return reinterpret_cast<uint32_t*>(&tail);
+    }
+
+public:
+    SpscRing() : slots(), head(0), tail(0), sleepers(0) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    bool try_push(const T& value) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        slots[t & (Capacity - 1)] = value;
+        // Sequentially consistent with the sleeper registration in pop():
+        // either the consumer sees the new tail before sleeping, or we see it
+        // registered and wake it
+        tail.store(t + 1, std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst) != 0) {
+            syscall(SYS_futex, tailWord(), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        }
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = slots[h & (Capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only spins when full; callers size their rings so that cannot happen
+    void push(const T& value) {
+        while (!try_push(value)) {
+            std::this_thread::yield();
+        }
+    }
+
+    T pop() {
+        T value;
+        for (int spins = 0; !try_pop(value); ++spins) {
+            if (spins < spin_limit) {
+                std::this_thread::yield();
+                continue;
+            }
+            uint32_t empty_at = head.load(std::memory_order_relaxed);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            if (tail.load(std::memory_order_seq_cst) == empty_at) {
+                syscall(SYS_futex, tailWord(), FUTEX_WAIT_PRIVATE, empty_at, nullptr, nullptr, 0);
+            }
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return value;
+    }
+};
+
+// In-process byte pipe between two threads. The writer fills fixed-size
+// chunks and hands them over whole; the reader gives each chunk back once
+// consumed, so at most max_chunks buffers are ever allocated per pipe.
+class ChunkPipe {
+public:
+    static constexpr size_t chunk_size = 64 * 1024;
+    static constexpr size_t max_chunks = 8;
+
+    struct Chunk {
+        size_t size;
+        char data[chunk_size];
+    };
+
+private:
+    // Each chunk is in at most one ring, plus one nullptr end marker
+    SpscRing<Chunk*, 16> filled;   // Writer -> reader, nullptr marks end of stream
+    SpscRing<Chunk*, 16> recycled; // Reader -> writer, nullptr marks reader gone
+
+    // Writer-side state
+    Chunk* chunks[max_chunks];
+    size_t allocated;
+    bool reader_gone;
+
+public:
+    ChunkPipe() : chunks(), allocated(0), reader_gone(false) {}
+
+    ChunkPipe(const ChunkPipe&) = delete;
+    ChunkPipe& operator=(const ChunkPipe&) = delete;
+
+    ~ChunkPipe() {
+        for (size_t i = 0; i < allocated; ++i) {
+            delete chunks[i];
+        }
+    }
+
+    // Writer: an empty chunk to fill, or nullptr once the reader has gone
+    Chunk* acquire() {
+        if (reader_gone) {
+            return nullptr;
+        }
+        Chunk* chunk;
+        if (!recycled.try_pop(chunk)) {
+            if (allocated < max_chunks) {
+                chunk = new Chunk;
+                chunks[allocated++] = chunk;
+                return chunk;
+            }
+            chunk = recycled.pop();
+        }
+        reader_gone = chunk == nullptr;
+        return chunk;
+    }
+
+    void publish(Chunk* chunk) {
+        filled.push(chunk);
+    }
+
+    void close_writer() {
+        filled.push(nullptr);
+    }
+
+    // Reader: the next filled chunk, or nullptr at end of stream. Must not be
+    // called again after it has returned nullptr.
+    Chunk* receive() {
+        return filled.pop();
+    }
+
+    void release(Chunk* chunk) {
+        recycled.push(chunk);
+    }
+
+    void close_reader() {
+        recycled.push(nullptr);
+    }
+};
+
+// Output side of a ChunkPipe as a streambuf. The put area is the current
+// chunk, so bytes are written once, into the buffer the reader will consume.
+class ChunkPipeWriter : public std::streambuf {
+private:
+    ChunkPipe& pipe;
+    ChunkPipe::Chunk* chunk;
+
+    bool publishChunk() {
+        if (chunk && pptr() > pbase()) {
+            chunk->size = pptr() - pbase();
+            pipe.publish(chunk);
+            chunk = nullptr;
+            setp(nullptr, nullptr);
+        }
+        return true;
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        publishChunk();
+        if (!chunk) {
+            chunk = pipe.acquire();
+            if (!chunk) {
+                errno = EPIPE; // Reader has gone, as a write to a pipe would report
+                return traits_type::eof();
+            }
+            setp(chunk->data, chunk->data + ChunkPipe::chunk_size);
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        return publishChunk() ? 0 : -1;
+    }
+
+public:
+    explicit ChunkPipeWriter(ChunkPipe& pipe) : pipe(pipe), chunk(nullptr) {}
+
+    ~ChunkPipeWriter() override {
+        publishChunk(); // An acquired but empty chunk is simply freed with the pipe
+        pipe.close_writer();
+    }
+};
+
+// Input side of a ChunkPipe as a streambuf. The get area is the received
+// chunk itself, which is returned to the writer when exhausted.
+class ChunkPipeReader : public std::streambuf {
+private:
+    ChunkPipe& pipe;
+    ChunkPipe::Chunk* chunk;
+    bool finished;
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        if (chunk) {
+            pipe.release(chunk);
+            chunk = nullptr;
+        }
+        if (finished || !(chunk = pipe.receive())) {
+            finished = true;
+            setg(nullptr, nullptr, nullptr);
+            return traits_type::eof();
+        }
+        setg(chunk->data, chunk->data, chunk->data + chunk->size);
+        return traits_type::to_int_type(*gptr());
+    }
+
+public:
+    explicit ChunkPipeReader(ChunkPipe& pipe) : pipe(pipe), chunk(nullptr), finished(false) {}
+
+    ~ChunkPipeReader() override {
+        if (chunk) {
+            pipe.release(chunk);
+        }
+        if (!finished) {
+            pipe.close_reader();
+        }
+    }
+};
+
+// Buffered streambuf over a raw file descriptor, optionally owning it
+class FdStreamBuf : public std::streambuf {
+private:
+    static constexpr size_t buffer_size = 64 * 1024;
+
+    int fd;
+    bool owned;
+    std::unique_ptr<char[]> in_buffer;
+    std::unique_ptr<char[]> out_buffer;
+
+    bool writeAll(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool flushBuffer() {
+        if (pptr() == pbase()) {
+            return true;
+        }
+        bool ok = writeAll(pbase(), pptr() - pbase());
+        setp(out_buffer.get(), out_buffer.get() + buffer_size);
+        return ok;
+    }
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        if (!in_buffer) {
+            in_buffer.reset(new char[buffer_size]);
+        }
+        ssize_t n;
+        do {
+            n = ::read(fd, in_buffer.get(), buffer_size);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            return traits_type::eof();
+        }
+        setg(in_buffer.get(), in_buffer.get(), in_buffer.get() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type ch) override {
+        if (!out_buffer) {
+            out_buffer.reset(new char[buffer_size]);
+            setp(out_buffer.get(), out_buffer.get() + buffer_size);
+        } else if (!flushBuffer()) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    // Large writes skip the buffer
+    std::streamsize xsputn(const char* data, std::streamsize size) override {
+        if (static_cast<size_t>(size) < buffer_size) {
+            return std::streambuf::xsputn(data, size);
+        }
+        if (out_buffer && !flushBuffer()) {
+            return 0;
+        }
+        return writeAll(data, size) ? size : 0;
+    }
+
+    int sync() override {
+        return !out_buffer || flushBuffer() ? 0 : -1;
+    }
+
+public:
+    FdStreamBuf(int fd, bool owned) : fd(fd), owned(owned) {}
+
+    ~FdStreamBuf() override {
+        sync();
+        if (owned) {
+            ::close(fd);
+        }
+    }
+};
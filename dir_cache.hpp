@@ -0,0 +1,113 @@
+#pragma once
+#include "map.hpp"
+#include <algorithm>
+#include <climits>
+#include <string>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Sorted directory listings, reread only when a directory's mtime or identity
+// changes. Creating, deleting or renaming an entry updates the directory's
+// mtime, so an unchanged listing costs one stat().
+class DirectoryCache {
+public:
+    struct Entry {
+        bool directory; // Following symbolic links
+        bool link;
+    };
+
+    struct Listing {
+        dev_t device;
+        ino_t inode;
+        struct timespec mtime;
+        Map<std::string, Entry> entries;
+    };
+
+private:
+    // Past this many directories the cache starts over rather than growing
+    static constexpr size_t max_listings = 256;
+
+    Map<std::string, Listing> listings;
+
+    static bool scan(const std::string& dir, Listing& listing) {
+        DIR* handle = opendir(dir.empty() ? "." : dir.c_str());
+        if (handle == nullptr) {
+            return false;
+        }
+
+        std::vector<std::pair<std::string, Entry>> names;
+        dirent* entry;
+        while ((entry = readdir(handle)) != nullptr) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            unsigned char type = entry->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && fstatat(dirfd(handle), name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = IFTODT(st.st_mode);
+            }
+            bool is_dir = type == DT_DIR;
+            if (type == DT_LNK) {
+                is_dir = fstatat(dirfd(handle), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+            names.emplace_back(name, Entry{is_dir, type == DT_LNK});
+        }
+        closedir(handle);
+
+        // Sorted input lets Map link the tree in one pass
+        std::sort(names.begin(), names.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+        listing.entries = Map<std::string, Entry>(names.begin(), names.end());
+        return true;
+    }
+
+public:
+    // Listing of dir ("" means the current directory), or nullptr if it
+    // cannot be read
+    const Listing* get(const std::string& dir) {
+        struct stat st;
+        if (stat(dir.empty() ? "." : dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            return nullptr;
+        }
+
+        // Relative names are cached per working directory
+        std::string key = dir;
+        if (dir.empty() || dir[0] != '/') {
+            char cwd[PATH_MAX];
+            if (getcwd(cwd, sizeof(cwd)) != nullptr) {
+                key = std::string(cwd) + "/" + dir;
+            }
+        }
+
+        auto it = listings.find(key);
+        if (it != listings.end()) {
+            const Listing& cached = it->second;
+            if (cached.device == st.st_dev && cached.inode == st.st_ino
+                && cached.mtime.tv_sec == st.st_mtim.tv_sec && cached.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                return &cached;
+            }
+        } else if (listings.size() >= max_listings) {
+            listings.clear();
+        }
+
+        Listing& listing = listings[key];
+        listing.device = st.st_dev;
+        listing.inode = st.st_ino;
+        listing.mtime = st.st_mtim;
+        if (!scan(dir, listing)) {
+            listings.erase(key);
+            return nullptr;
+        }
+        return &listing;
+    }
+
+    void clear() {
+        listings.clear();
+    }
+};
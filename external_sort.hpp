@@ -0,0 +1,685 @@
+#pragma once
+#include "chunk_pipe.hpp"
+#include "vector.hpp"
+#include "work_pool.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Sorts lines of any total size within a memory budget. Input lines are
+// kept as views into mapped files (or into blocks copied from a stream),
+// sorted in pieces on a thread pool once the budget is reached, and spilled
+// as a sorted run to an unlinked temporary file. finish() merges the runs
+// and the pieces still in memory with a loser tree.
+//
+// Ordering follows sort(1) in the C locale: keys compare as bytes, or as
+// decimal numbers with -n, and lines with equal keys fall back to comparing
+// the whole line unless -u is given, in which case the first of each group
+// of equal keys (in input order) is kept.
+class ExternalSort {
+public:
+    // -k start_field[.start_char][,end_field[.end_char]], 1-based. An end
+    // field of 0 means the end of the line, an end char of 0 the end of the
+    // field.
+    struct Key {
+        size_t start_field = 1;
+        size_t start_char = 1;
+        size_t end_field = 0;
+        size_t end_char = 0;
+        bool numeric = false;
+        bool reverse = false;
+        bool blanks = false;    // Skip leading blanks of the key
+        bool own_order = false; // Had flags of its own, so ignores the global ones
+    };
+
+    struct Options {
+        std::vector<Key> keys; // Empty: the whole line
+        bool numeric = false;
+        bool reverse = false;
+        bool blanks = false;
+        bool unique = false;
+        char separator = 0;    // -t; 0 splits fields at runs of blanks
+        size_t memory = 0;     // -S in bytes; 0 picks a quarter of physical memory
+        size_t threads = 0;    // 0: one per core
+        std::string temp_dir;  // Empty: $TMPDIR or /tmp
+    };
+
+private:
+    struct Line {
+        uint64_t prefix;       // The first key in 8 bytes that order like the key
+        std::string_view text; // Without the newline
+        uint32_t key_start;    // First key within text
+        uint32_t key_length;
+    };
+
+    // One sorted sequence of lines feeding a merge
+    class Run {
+    public:
+        virtual ~Run() {}
+        // Next line, or false at the end; may invalidate the line returned before
+        virtual bool next(Line& line) = 0;
+    };
+
+    class MemoryRun : public Run {
+    private:
+        const Line* at;
+        const Line* end;
+
+    public:
+        MemoryRun(const Line* begin, const Line* end) : at(begin), end(end) {}
+
+        bool next(Line& line) override {
+            if (at == end) {
+                return false;
+            }
+            line = *at++;
+            return true;
+        }
+    };
+
+    // A spilled run read back through a buffer, one line at a time
+    class FileRun : public Run {
+    private:
+        const ExternalSort& sorter;
+        int fd;
+        std::unique_ptr<char[]> buffer;
+        size_t capacity;
+        size_t start;
+        size_t end;
+        bool eof;
+
+    public:
+        FileRun(const ExternalSort& sorter, int fd, size_t capacity)
+            : sorter(sorter), fd(fd), buffer(new char[capacity]), capacity(capacity), start(0), end(0), eof(false) {
+            lseek(fd, 0, SEEK_SET);
+        }
+
+        bool next(Line& line) override {
+            for (;;) {
+                const char* data = buffer.get();
+                const void* newline = memchr(data + start, '\n', end - start);
+                if (newline) {
+                    size_t length = static_cast<const char*>(newline) - (data + start);
+                    line = sorter.makeLine(std::string_view(data + start, length));
+                    start += length + 1;
+                    return true;
+                }
+                if (eof) {
+                    return false; // Runs are written with a newline after every line
+                }
+                // Keep the partial line, growing the buffer if it fills it
+                memmove(buffer.get(), data + start, end - start);
+                end -= start;
+                start = 0;
+                if (end == capacity) {
+                    std::unique_ptr<char[]> larger(new char[capacity * 2]);
+                    memcpy(larger.get(), buffer.get(), end);
+                    buffer = std::move(larger);
+                    capacity *= 2;
+                }
+                ssize_t n;
+                do {
+                    n = ::read(fd, buffer.get() + end, capacity - end);
+                } while (n < 0 && errno == EINTR);
+                if (n <= 0) {
+                    eof = true;
+                } else {
+                    end += n;
+                }
+            }
+        }
+    };
+
+    // Tournament over k runs: each inner node keeps the loser of the match
+    // played there, so replacing the winner replays only its path to the
+    // root, about log2(k) comparisons per line. Ties go to the earlier run,
+    // which keeps the merge stable.
+    class LoserTree {
+    private:
+        const ExternalSort& sorter;
+        std::vector<Run*>& runs;
+        std::vector<Line> current;
+        std::vector<char> live;
+        std::vector<size_t> tree; // tree[0] is the winner, tree[1..k-1] losers
+
+        bool beats(size_t a, size_t b) const {
+            if (!live[a] || !live[b]) {
+                return live[a];
+            }
+            int order = sorter.compare(current[a], current[b]);
+            return order < 0 || (order == 0 && a < b);
+        }
+
+        // Fill tree below node and return the winner there
+        size_t build(size_t node) {
+            size_t k = runs.size();
+            if (node >= k) {
+                return node - k; // A leaf
+            }
+            size_t left = build(2 * node);
+            size_t right = build(2 * node + 1);
+            bool left_wins = beats(left, right);
+            tree[node] = left_wins ? right : left;
+            return left_wins ? left : right;
+        }
+
+    public:
+        LoserTree(const ExternalSort& sorter, std::vector<Run*>& runs)
+            : sorter(sorter), runs(runs), current(runs.size()), live(runs.size()), tree(std::max<size_t>(runs.size(), 1)) {
+            for (size_t i = 0; i < runs.size(); ++i) {
+                live[i] = runs[i]->next(current[i]);
+            }
+            tree[0] = runs.empty() ? 0 : build(1);
+        }
+
+        // The smallest line left, or nullptr when every run is done
+        const Line* top() const {
+            return !runs.empty() && live[tree[0]] ? &current[tree[0]] : nullptr;
+        }
+
+        void pop() {
+            size_t winner = tree[0];
+            live[winner] = runs[winner]->next(current[winner]);
+            for (size_t node = (winner + runs.size()) / 2; node > 0; node /= 2) {
+                if (beats(tree[node], winner)) {
+                    std::swap(tree[node], winner);
+                }
+            }
+            tree[0] = winner;
+        }
+    };
+
+    // Runs merged at once; more spilled runs are first merged into one
+    static constexpr size_t max_merge = 64;
+    // Bytes read at a time from a stream, and buffered per spilled run
+    static constexpr size_t block_size = 1024 * 1024;
+    static constexpr size_t run_buffer_size = 256 * 1024;
+
+    Options options;
+    std::ostream& out;
+    size_t budget;
+    std::unique_ptr<WorkStealingPool> pool;
+    bool failed;
+
+    Vector<Line> lines;     // Read but not yet sorted
+    size_t pending_bytes;   // Their text and records, against the budget
+    std::vector<std::unique_ptr<char[]>> buffers;   // Text of pending lines read from streams
+    std::vector<std::pair<void*, size_t>> mappings; // Mapped input files
+    std::vector<int> spilled;                       // Sorted runs, oldest first
+
+    static bool isBlank(char c) {
+        return c == ' ' || c == '\t';
+    }
+
+    static int compareBytes(std::string_view a, std::string_view b) {
+        int order = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+        return order != 0 ? order : (a.size() < b.size() ? -1 : a.size() > b.size());
+    }
+
+    // The leading number of text in sort -n's syntax: blanks, an optional
+    // '-', digits and an optional fraction. Anything else counts as zero.
+    struct Number {
+        bool negative;
+        std::string_view integer;  // Without leading zeros
+        std::string_view fraction; // Without trailing zeros
+    };
+
+    static Number parseNumber(std::string_view text) {
+        size_t i = 0;
+        while (i < text.size() && isBlank(text[i])) {
+            ++i;
+        }
+        Number number = {false, {}, {}};
+        if (i < text.size() && text[i] == '-') {
+            number.negative = true;
+            ++i;
+        }
+        while (i < text.size() && text[i] == '0') {
+            ++i;
+        }
+        size_t digits = i;
+        while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+            ++i;
+        }
+        number.integer = text.substr(digits, i - digits);
+        if (i < text.size() && text[i] == '.') {
+            size_t fraction = ++i;
+            while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+                ++i;
+            }
+            size_t last = i;
+            while (last > fraction && text[last - 1] == '0') {
+                --last;
+            }
+            number.fraction = text.substr(fraction, last - fraction);
+        }
+        if (number.integer.empty() && number.fraction.empty()) {
+            number.negative = false; // -0 is 0
+        }
+        return number;
+    }
+
+    // Exact comparison of two numbers of any length
+    static int compareNumbers(std::string_view a, std::string_view b) {
+        Number x = parseNumber(a);
+        Number y = parseNumber(b);
+        if (x.negative != y.negative) {
+            return x.negative ? -1 : 1;
+        }
+        int order = x.integer.size() < y.integer.size() ? -1 : x.integer.size() > y.integer.size();
+        if (order == 0) {
+            order = x.integer.compare(y.integer);
+        }
+        if (order == 0) {
+            order = x.fraction.compare(y.fraction);
+        }
+        order = order < 0 ? -1 : order > 0;
+        return x.negative ? -order : order;
+    }
+
+    // The number as a double mapped to an unsigned integer of the same
+    // order. Rounding is monotonic, so different prefixes order their numbers
+    // correctly; equal ones are settled by compareNumbers.
+    static uint64_t numericPrefix(std::string_view key) {
+        Number number = parseNumber(key);
+        double value;
+        if (number.fraction.empty() && number.integer.size() <= 18) {
+            // Exact in 64 bits, and converting rounds the same way strtod does
+            int64_t integer = 0;
+            for (char digit : number.integer) {
+                integer = integer * 10 + (digit - '0');
+            }
+            value = static_cast<double>(number.negative ? -integer : integer);
+        } else {
+            std::string text;
+            text.reserve(number.integer.size() + number.fraction.size() + 3);
+            text += number.negative ? "-0" : "0";
+            text += number.integer;
+            text += '.';
+            text += number.fraction;
+            value = strtod(text.c_str(), nullptr);
+        }
+        value += 0.0; // No -0
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits >> 63 ? ~bits : bits | uint64_t(1) << 63;
+    }
+
+    // The first 8 bytes, big-endian, so integer order is byte order
+    static uint64_t bytePrefix(std::string_view key) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            prefix = prefix << 8 | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0);
+        }
+        return prefix;
+    }
+
+    // Start of field (1-based) within text
+    size_t fieldStart(std::string_view text, size_t field) const {
+        size_t i = 0;
+        for (size_t n = 1; n < field && i < text.size(); ++n) {
+            if (options.separator) {
+                size_t next = text.find(options.separator, i);
+                i = next == std::string_view::npos ? text.size() : next + 1;
+            } else {
+                while (i < text.size() && isBlank(text[i])) {
+                    ++i;
+                }
+                while (i < text.size() && !isBlank(text[i])) {
+                    ++i;
+                }
+            }
+        }
+        return i;
+    }
+
+    std::string_view extract(std::string_view text, const Key& key) const {
+        if (key.start_field == 1 && key.start_char == 1 && key.end_field == 0 && !key.blanks) {
+            return text;
+        }
+        size_t begin = fieldStart(text, key.start_field);
+        if (key.blanks) {
+            while (begin < text.size() && isBlank(text[begin])) {
+                ++begin;
+            }
+        }
+        begin = std::min(text.size(), begin + key.start_char - 1);
+
+        size_t end = text.size();
+        if (key.end_field != 0) {
+            end = fieldStart(text, key.end_field);
+            if (key.end_char != 0) {
+                end = std::min(text.size(), end + key.end_char);
+            } else if (options.separator) {
+                size_t next = text.find(options.separator, end);
+                end = next == std::string_view::npos ? text.size() : next;
+            } else {
+                while (end < text.size() && isBlank(text[end])) {
+                    ++end;
+                }
+                while (end < text.size() && !isBlank(text[end])) {
+                    ++end;
+                }
+            }
+        }
+        return text.substr(begin, std::max(begin, end) - begin);
+    }
+
+    Line makeLine(std::string_view text) const {
+        std::string_view key = extract(text, options.keys[0]);
+        Line line;
+        line.text = text;
+        line.key_start = key.data() - text.data();
+        line.key_length = key.size();
+        line.prefix = options.keys[0].numeric ? numericPrefix(key) : bytePrefix(key);
+        return line;
+    }
+
+    int compare(const Line& a, const Line& b) const {
+        const Key& first = options.keys[0];
+        int order;
+        if (a.prefix != b.prefix) {
+            order = a.prefix < b.prefix ? -1 : 1;
+        } else {
+            std::string_view x = a.text.substr(a.key_start, a.key_length);
+            std::string_view y = b.text.substr(b.key_start, b.key_length);
+            order = first.numeric ? compareNumbers(x, y) : compareBytes(x, y);
+        }
+        if (first.reverse) {
+            order = -order;
+        }
+        for (size_t i = 1; i < options.keys.size() && order == 0; ++i) {
+            const Key& key = options.keys[i];
+            std::string_view x = extract(a.text, key);
+            std::string_view y = extract(b.text, key);
+            order = key.numeric ? compareNumbers(x, y) : compareBytes(x, y);
+            if (key.reverse) {
+                order = -order;
+            }
+        }
+        if (order == 0 && !options.unique) {
+            order = compareBytes(a.text, b.text);
+            if (options.reverse) {
+                order = -order;
+            }
+        }
+        return order;
+    }
+
+    // Sort the pending lines in pieces, in parallel when there is a pool.
+    // Returns the pieces as runs, in input order.
+    std::vector<std::unique_ptr<Run>> sortPending() {
+        std::vector<std::unique_ptr<Run>> pieces;
+        size_t count = lines.size();
+        if (count == 0) {
+            return pieces;
+        }
+        size_t piece_count = pool ? std::min(pool->size() * 2, count) : 1;
+        auto less = [this](const Line& a, const Line& b) {
+            return compare(a, b) < 0;
+        };
+        for (size_t i = 0; i < piece_count; ++i) {
+            Line* begin = lines.begin() + count * i / piece_count;
+            Line* end = lines.begin() + count * (i + 1) / piece_count;
+            auto sort_piece = [this, begin, end, less] {
+                // Stable under -u, so the first of equal keys stays first
+                if (options.unique) {
+                    std::stable_sort(begin, end, less);
+                } else {
+                    std::sort(begin, end, less);
+                }
+            };
+            if (pool) {
+                pool->submit(sort_piece);
+            } else {
+                sort_piece();
+            }
+            pieces.emplace_back(new MemoryRun(begin, end));
+        }
+        if (pool) {
+            pool->wait();
+        }
+        return pieces;
+    }
+
+    // Merge runs, handing each line in order to emit
+    template<typename Emit>
+    void merge(std::vector<Run*>& runs, Emit emit) {
+        LoserTree tree(*this, runs);
+        while (const Line* line = tree.top()) {
+            emit(*line);
+            tree.pop();
+        }
+    }
+
+    // Unlinked file in the temporary directory, or -1 after reporting why not
+    int createTemporary() {
+        std::string dir = options.temp_dir;
+        if (dir.empty()) {
+            const char* tmpdir = getenv("TMPDIR");
+            dir = tmpdir && *tmpdir ? tmpdir : "/tmp";
+        }
+        std::string path = dir + "/sortXXXXXX";
+        int fd = mkostemp(&path[0], O_CLOEXEC);
+        if (fd == -1) {
+            std::cerr << "sort: cannot create temporary file in '" << dir << "': " << strerror(errno) << std::endl;
+            return -1;
+        }
+        unlink(path.c_str());
+        return fd;
+    }
+
+    // Merge runs into a new temporary file; -1 if it could not be written
+    int writeRun(std::vector<Run*>& runs) {
+        int fd = createTemporary();
+        if (fd == -1) {
+            return -1;
+        }
+        FdStreamBuf buffer(fd, false);
+        std::ostream file(&buffer);
+        merge(runs, [&file](const Line& line) {
+            file.write(line.text.data(), line.text.size());
+            file.put('\n');
+        });
+        if (!file.flush()) {
+            std::cerr << "sort: write failed: " << strerror(errno) << std::endl;
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Sort what is pending into a spilled run and drop its text. If the run
+    // cannot be written, everything stays in memory instead.
+    void spill() {
+        std::vector<std::unique_ptr<Run>> pieces = sortPending();
+        std::vector<Run*> runs;
+        for (auto& piece : pieces) {
+            runs.push_back(piece.get());
+        }
+        int fd = writeRun(runs);
+        if (fd == -1) {
+            budget = SIZE_MAX;
+            return;
+        }
+        spilled.push_back(fd);
+        lines.clear();
+        buffers.clear();
+        pending_bytes = 0;
+    }
+
+    void addLine(std::string_view text) {
+        lines.push_back(makeLine(text));
+        pending_bytes += text.size() + sizeof(Line);
+    }
+
+public:
+    ExternalSort(std::ostream& out, Options opts)
+        : options(std::move(opts)), out(out), failed(false), pending_bytes(0) {
+        if (options.keys.empty()) {
+            options.keys.push_back(Key());
+        }
+        for (Key& key : options.keys) {
+            if (!key.own_order) {
+                key.numeric = options.numeric;
+                key.reverse = options.reverse;
+                key.blanks = key.blanks || options.blanks;
+            }
+        }
+        budget = options.memory;
+        if (budget == 0) {
+            long pages = sysconf(_SC_PHYS_PAGES);
+            budget = pages > 0 ? static_cast<size_t>(pages) * sysconf(_SC_PAGESIZE) / 4 : 256 * 1024 * 1024;
+        }
+        budget = std::max<size_t>(budget, 2 * block_size);
+        size_t threads = options.threads ? options.threads : std::max<size_t>(1, std::thread::hardware_concurrency());
+        if (threads > 1) {
+            pool.reset(new WorkStealingPool(threads));
+        }
+    }
+
+    ~ExternalSort() {
+        for (int fd : spilled) {
+            close(fd);
+        }
+        for (auto& mapping : mappings) {
+            munmap(mapping.first, mapping.second);
+        }
+    }
+
+    ExternalSort(const ExternalSort&) = delete;
+    ExternalSort& operator=(const ExternalSort&) = delete;
+
+    // Add the lines of a stream, copied into blocks as they are read
+    void add(std::streambuf& in) {
+        std::string carry; // A line cut off at the end of the last block
+        for (;;) {
+            size_t size = std::max(block_size, carry.size() * 2);
+            std::unique_ptr<char[]> block(new char[size]);
+            memcpy(block.get(), carry.data(), carry.size());
+            size_t used = carry.size() + in.sgetn(block.get() + carry.size(), size - carry.size());
+            bool done = used < size;
+            size_t start = 0;
+            while (const void* newline = memchr(block.get() + start, '\n', used - start)) {
+                size_t end = static_cast<const char*>(newline) - block.get();
+                addLine(std::string_view(block.get() + start, end - start));
+                start = end + 1;
+            }
+            if (done && start < used) {
+                addLine(std::string_view(block.get() + start, used - start)); // No final newline
+                start = used;
+            }
+            carry.assign(block.get() + start, used - start);
+            if (start > 0) {
+                buffers.push_back(std::move(block));
+            }
+            if (pending_bytes >= budget) {
+                spill();
+            }
+            if (done) {
+                return;
+            }
+        }
+    }
+
+    // Add the lines of a file. Regular files are mapped and their lines
+    // used in place; anything else is read as a stream.
+    void add(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size_t size = st.st_size;
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, size, MADV_SEQUENTIAL);
+                mappings.emplace_back(mapped, size);
+                const char* data = static_cast<const char*>(mapped);
+                size_t start = 0;
+                while (start < size) {
+                    const void* newline = memchr(data + start, '\n', size - start);
+                    size_t end = newline ? static_cast<const char*>(newline) - data : size;
+                    addLine(std::string_view(data + start, end - start));
+                    start = end + 1;
+                    if (pending_bytes >= budget) {
+                        spill();
+                    }
+                }
+                return;
+            }
+        }
+        FdStreamBuf buffer(fd, false);
+        add(buffer);
+    }
+
+    // Merge everything added and write it out. Returns false if the output
+    // could not be written.
+    bool finish() {
+        // Too many spilled runs to open at once: merge the oldest together
+        while (spilled.size() > max_merge) {
+            std::vector<std::unique_ptr<Run>> files;
+            std::vector<Run*> runs;
+            for (size_t i = 0; i < max_merge; ++i) {
+                files.emplace_back(new FileRun(*this, spilled[i], run_buffer_size));
+                runs.push_back(files.back().get());
+            }
+            int fd = writeRun(runs);
+            if (fd == -1) {
+                failed = true;
+                break;
+            }
+            for (size_t i = 0; i < max_merge; ++i) {
+                close(spilled[i]);
+            }
+            spilled.erase(spilled.begin() + 1, spilled.begin() + max_merge);
+            spilled[0] = fd;
+        }
+
+        std::vector<std::unique_ptr<Run>> sources;
+        for (int fd : spilled) {
+            sources.emplace_back(new FileRun(*this, fd, run_buffer_size));
+        }
+        for (auto& piece : sortPending()) {
+            sources.push_back(std::move(piece));
+        }
+        std::vector<Run*> runs;
+        for (auto& source : sources) {
+            runs.push_back(source.get());
+        }
+
+        // Under -u the last line written is copied, as a run's buffer may move
+        std::string last_text;
+        Line last;
+        bool have_last = false;
+        merge(runs, [&](const Line& line) {
+            if (options.unique) {
+                if (have_last && compare(last, line) == 0) {
+                    return;
+                }
+                if (!spilled.empty()) {
+                    last_text.assign(line.text.data(), line.text.size());
+                    last = makeLine(last_text);
+                } else {
+                    last = line;
+                }
+                have_last = true;
+            }
+            out.write(line.text.data(), line.text.size());
+            out.put('\n');
+        });
+        out.flush();
+        return !failed && out.good();
+    }
+};
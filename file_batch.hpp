@@ -0,0 +1,518 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Minimal io_uring over the raw system calls: one submission queue and one
+// completion queue, each mapped from the kernel.
+class IoUring {
+private:
+    int fd;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    unsigned pending_submit; // SQEs queued since the last enter()
+
+    void unmap() {
+        if (sqes) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_map && cq_map != sq_map) {
+            munmap(cq_map, cq_map_size);
+        }
+        if (sq_map) {
+            munmap(sq_map, sq_map_size);
+        }
+        sqes = nullptr;
+        sq_map = cq_map = nullptr;
+    }
+
+    template<typename T>
+    static T* at(void* base, uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+public:
+    explicit IoUring(unsigned entries)
+        : fd(-1), sq_map(nullptr), sq_map_size(0), cq_map(nullptr), cq_map_size(0),
+          sqes(nullptr), sqes_size(0), sq_entries(0), pending_submit(0) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            fd = -1;
+            return;
+        }
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_map) {
+            sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+        }
+        sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_map = single_map ? sq_map
+            : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqe_map == MAP_FAILED) {
+            sq_map = sq_map == MAP_FAILED ? nullptr : sq_map;
+            cq_map = cq_map == MAP_FAILED ? nullptr : cq_map;
+            sqes = sqe_map == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqe_map);
+            unmap();
+            ::close(fd);
+            fd = -1;
+            return;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqe_map);
+
+        sq_head = at<unsigned>(sq_map, params.sq_off.head);
+        sq_tail = at<unsigned>(sq_map, params.sq_off.tail);
+        sq_mask = at<unsigned>(sq_map, params.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_map, params.sq_off.array);
+        sq_entries = params.sq_entries;
+        cq_head = at<unsigned>(cq_map, params.cq_off.head);
+        cq_tail = at<unsigned>(cq_map, params.cq_off.tail);
+        cq_mask = at<unsigned>(cq_map, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cq_map, params.cq_off.cqes);
+    }
+
+    ~IoUring() {
+        unmap();
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool is_open() const {
+        return fd != -1;
+    }
+
+    unsigned capacity() const {
+        return sq_entries;
+    }
+
+    // True if the kernel implements every opcode in ops
+    bool supports(std::initializer_list<int> ops) const {
+        size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        std::unique_ptr<char[]> buffer(new char[size]());
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.get());
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            return false;
+        }
+        for (int op : ops) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A cleared SQE to fill in, or nullptr if the submission queue is full
+    io_uring_sqe* next_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *sq_tail;
+        if (tail - head >= sq_entries) {
+            return nullptr;
+        }
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++pending_submit;
+        return sqe;
+    }
+
+    // Submit queued SQEs and wait until at least wait_for completions are
+    // available. Returns false with errno set on failure.
+    bool submit(unsigned wait_for) {
+        unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+        for (;;) {
+            long submitted = syscall(__NR_io_uring_enter, fd, pending_submit, wait_for, flags, nullptr, 0);
+            if (submitted >= 0) {
+                pending_submit -= submitted;
+                return true;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // Take back the SQEs the kernel has not consumed yet, passing each to
+    // withdrawn. For recovering after submit() fails: those requests never
+    // reached the kernel and can safely be run another way.
+    template<typename Withdrawn>
+    void withdraw(Withdrawn withdrawn) {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *sq_tail;
+        for (unsigned i = head; i != tail; ++i) {
+            withdrawn(sqes[sq_array[i & *sq_mask]]);
+        }
+        __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+        pending_submit = 0;
+    }
+
+    // Take the next completion, if there is one
+    bool pop(uint64_t& user_data, int& result) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+// A list of independent path operations run as one batch. With io_uring the
+// requests are submitted many at a time and complete in any order;
+// otherwise they run one by one. Either way each request's result is stored
+// with it, so callers report errors in argument order.
+//
+// Requests that touch the same path, or a path inside another request's
+// path (mkdir a a/b, rm a/b a), are ordered: the batch waits for everything
+// in flight before submitting the later one.
+class FileBatch {
+public:
+    enum Kind {
+        CREATE, // openat(O_CREAT), then close
+        MKDIR,
+        UNLINK,
+        RMDIR,
+        RENAME
+    };
+
+    struct Request {
+        Kind kind;
+        std::string path;
+        std::string target; // RENAME only
+        mode_t mode;
+        int error;          // 0 or an errno value once run
+    };
+
+private:
+    // Fewer requests than this run synchronously: setting up a ring costs
+    // about as much as a handful of system calls
+    static constexpr size_t ring_threshold = 16;
+    static constexpr unsigned ring_entries = 256;
+    static constexpr uint64_t close_flag = 1ull << 63; // Tags a close, with the fd below it
+    static constexpr int create_flags = O_CREAT | O_WRONLY | O_NOCTTY | O_CLOEXEC;
+
+    std::vector<Request> requests;
+
+    static int runOne(const Request& request) {
+        int result = 0;
+        switch (request.kind) {
+        case CREATE: {
+            int fd = openat(AT_FDCWD, request.path.c_str(), create_flags, request.mode);
+            result = fd;
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            break;
+        }
+        case MKDIR:
+            result = mkdirat(AT_FDCWD, request.path.c_str(), request.mode);
+            break;
+        case UNLINK:
+            result = unlinkat(AT_FDCWD, request.path.c_str(), 0);
+            break;
+        case RMDIR:
+            result = unlinkat(AT_FDCWD, request.path.c_str(), AT_REMOVEDIR);
+            break;
+        case RENAME:
+            result = renameat(AT_FDCWD, request.path.c_str(), AT_FDCWD, request.target.c_str());
+            break;
+        }
+        return result < 0 ? errno : 0;
+    }
+
+    static void prepare(io_uring_sqe* sqe, const Request& request, uint64_t index) {
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(request.path.c_str());
+        sqe->user_data = index;
+        switch (request.kind) {
+        case CREATE:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->len = request.mode;
+            sqe->open_flags = create_flags;
+            break;
+        case MKDIR:
+            sqe->opcode = IORING_OP_MKDIRAT;
+            sqe->len = request.mode;
+            break;
+        case UNLINK:
+        case RMDIR:
+            sqe->opcode = IORING_OP_UNLINKAT;
+            sqe->unlink_flags = request.kind == RMDIR ? AT_REMOVEDIR : 0;
+            break;
+        case RENAME:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = reinterpret_cast<uint64_t>(request.target.c_str());
+            break;
+        }
+    }
+
+    // Lexically normalized absolute form of path, or "" if it cannot be
+    // compared lexically (contains ".."), which orders it against everything
+    static std::string normalize(const std::string& path, const std::string& cwd) {
+        std::string full = !path.empty() && path[0] == '/' ? path : cwd + "/" + path;
+        std::string result;
+        size_t start = 0;
+        while (start < full.size()) {
+            size_t end = full.find('/', start);
+            if (end == std::string::npos) {
+                end = full.size();
+            }
+            std::string component = full.substr(start, end - start);
+            start = end + 1;
+            if (component.empty() || component == ".") {
+                continue;
+            }
+            if (component == "..") {
+                return "";
+            }
+            result += "/" + component;
+        }
+        return result.empty() ? "/" : result;
+    }
+
+    // Tracks the paths of in-flight requests to find ones that must wait
+    class Conflicts {
+    private:
+        std::unordered_set<std::string> paths;     // Touched by an in-flight request
+        std::unordered_set<std::string> ancestors; // Directories above those paths
+
+    public:
+        bool empty() const {
+            return paths.empty();
+        }
+
+        void clear() {
+            paths.clear();
+            ancestors.clear();
+        }
+
+        bool conflicts(const std::string& path) const {
+            if (path.empty() || paths.count("") || paths.count(path) || ancestors.count(path)) {
+                return true;
+            }
+            for (size_t slash = path.rfind('/'); slash != 0 && slash != std::string::npos;
+                 slash = path.rfind('/', slash - 1)) {
+                if (paths.count(path.substr(0, slash))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void add(const std::string& path) {
+            paths.insert(path);
+            for (size_t slash = path.rfind('/'); slash != 0 && slash != std::string::npos;
+                 slash = path.rfind('/', slash - 1)) {
+                if (!ancestors.insert(path.substr(0, slash)).second) {
+                    break; // Everything above is already there
+                }
+            }
+        }
+    };
+
+    // Returns false if the ring failed. Requests that never reached the
+    // kernel are then left for the synchronous path; ones that did may have
+    // run, so they are not run again but get the ring's error if they did
+    // not complete.
+    bool runRing(IoUring& ring, std::vector<bool>& done) {
+        char cwd_buffer[PATH_MAX];
+        std::string cwd = getcwd(cwd_buffer, sizeof(cwd_buffer)) ? cwd_buffer : "";
+        Conflicts in_flight;
+        std::vector<bool> submitted(requests.size(), false);
+        size_t inflight = 0;
+        size_t next = 0;
+
+        // Reap whatever has completed, queueing closes for created files
+        auto reap = [&]() {
+            uint64_t tag;
+            int result;
+            while (ring.pop(tag, result)) {
+                --inflight;
+                if (tag & close_flag) {
+                    continue;
+                }
+                Request& request = requests[tag];
+                if (request.kind == CREATE && result >= 0) {
+                    io_uring_sqe* sqe = ring.next_sqe();
+                    if (sqe) {
+                        sqe->opcode = IORING_OP_CLOSE;
+                        sqe->fd = result;
+                        sqe->user_data = close_flag | static_cast<uint64_t>(result);
+                        ++inflight;
+                    } else {
+                        ::close(result);
+                    }
+                    result = 0;
+                }
+                request.error = result < 0 ? -result : 0;
+                done[tag] = true;
+            }
+        };
+
+        // After a failed submit: withdraw what the kernel never saw, wait for
+        // what it did while the ring still answers, and give whatever is left
+        // the error rather than risk running it twice
+        auto fail = [&]() {
+            int error = errno;
+            reap();
+            ring.withdraw([&](const io_uring_sqe& sqe) {
+                if (sqe.user_data & close_flag) {
+                    ::close(sqe.fd);
+                } else {
+                    submitted[sqe.user_data] = false;
+                }
+                --inflight;
+            });
+            while (inflight > 0 && ring.submit(static_cast<unsigned>(inflight))) {
+                reap();
+            }
+            for (size_t i = 0; i < requests.size(); ++i) {
+                if (submitted[i] && !done[i]) {
+                    requests[i].error = error;
+                    done[i] = true;
+                }
+            }
+            return false;
+        };
+
+        while (next < requests.size() || inflight > 0) {
+            // Queue as much as fits, stopping at a request that must wait
+            // for earlier ones. Half the ring is kept for closes.
+            bool blocked = false;
+            while (next < requests.size() && inflight < ring.capacity() / 2) {
+                const Request& request = requests[next];
+                std::string path = normalize(request.path, cwd);
+                std::string target = request.kind == RENAME ? normalize(request.target, cwd) : std::string();
+                if (!in_flight.empty() && (in_flight.conflicts(path)
+                                           || (request.kind == RENAME && in_flight.conflicts(target)))) {
+                    blocked = true;
+                    break;
+                }
+                io_uring_sqe* sqe = ring.next_sqe();
+                if (!sqe) {
+                    break;
+                }
+                prepare(sqe, request, next);
+                submitted[next] = true;
+                in_flight.add(path);
+                if (request.kind == RENAME) {
+                    in_flight.add(target);
+                }
+                ++inflight;
+                ++next;
+            }
+
+            // Wait for at least one completion, or for everything when the
+            // next request depends on what is in flight
+            unsigned wait_for = blocked ? static_cast<unsigned>(inflight) : (inflight > 0 ? 1 : 0);
+            if (!ring.submit(wait_for)) {
+                return fail();
+            }
+            reap();
+            if (blocked) {
+                while (inflight > 0) {
+                    if (!ring.submit(static_cast<unsigned>(inflight))) {
+                        return fail();
+                    }
+                    reap();
+                }
+                in_flight.clear();
+            }
+        }
+        return true;
+    }
+
+public:
+    void add_create(const std::string& path, mode_t mode = 0666) {
+        requests.push_back(Request{CREATE, path, std::string(), mode, 0});
+    }
+
+    void add_mkdir(const std::string& path, mode_t mode = 0777) {
+        requests.push_back(Request{MKDIR, path, std::string(), mode, 0});
+    }
+
+    void add_unlink(const std::string& path) {
+        requests.push_back(Request{UNLINK, path, std::string(), 0, 0});
+    }
+
+    void add_rmdir(const std::string& path) {
+        requests.push_back(Request{RMDIR, path, std::string(), 0, 0});
+    }
+
+    void add_rename(const std::string& from, const std::string& to) {
+        requests.push_back(Request{RENAME, from, to, 0, 0});
+    }
+
+    size_t size() const {
+        return requests.size();
+    }
+
+    const Request& operator[](size_t index) const {
+        return requests[index];
+    }
+
+    void clear() {
+        requests.clear();
+    }
+
+    // Run every request, filling in its error
+    void run() {
+        std::vector<bool> done(requests.size(), false);
+        if (requests.size() >= ring_threshold) {
+            IoUring ring(ring_entries);
+            if (ring.is_open() && ring.supports({IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_MKDIRAT,
+                                                 IORING_OP_UNLINKAT, IORING_OP_RENAMEAT})) {
+                runRing(ring, done);
+            }
+        }
+        // No ring (unsupported, not permitted, or a small batch), or the
+        // requests a failed ring never submitted
+        for (size_t i = 0; i < requests.size(); ++i) {
+            if (!done[i]) {
+                requests[i].error = runOne(requests[i]);
+            }
+        }
+    }
+};
@@ -0,0 +1,332 @@
+#pragma once
+#include "dir_cache.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Matcher for one path component of a glob: *, ?, [...] (with ranges, ! or ^
+// negation and [:class:] names) and backslash escapes. Compiled once into
+// tokens; matching keeps only the position after the last * to resume from,
+// so it never backtracks further than that and runs in O(pattern * name) at
+// worst, linear in practice.
+class GlobMatcher {
+private:
+    enum Kind : unsigned char { LITERAL, ANY, STAR, SET };
+
+    struct Token {
+        Kind kind;
+        unsigned char literal;
+        uint32_t set; // Index into sets for SET
+    };
+
+    // One bit per byte value
+    struct CharSet {
+        uint64_t bits[4];
+
+        bool has(unsigned char c) const {
+            return bits[c >> 6] >> (c & 63) & 1;
+        }
+
+        void add(unsigned char c) {
+            bits[c >> 6] |= uint64_t(1) << (c & 63);
+        }
+    };
+
+    std::vector<Token> tokens;
+    std::vector<CharSet> sets;
+    std::string prefix; // Literal text every match starts with
+    std::string suffix; // Literal text every match ends with, after the last *
+    bool has_star;
+
+    bool matchToken(const Token& token, unsigned char c) const {
+        switch (token.kind) {
+        case LITERAL:
+            return c == token.literal;
+        case ANY:
+            return true;
+        case SET:
+            return sets[token.set].has(c);
+        default:
+            return false;
+        }
+    }
+
+    // Parse [...] starting at pattern[i] == '['. Returns false, leaving i
+    // alone, if there is no closing bracket (the '[' is then literal).
+    bool parseSet(const std::string& pattern, size_t& i) {
+        size_t j = i + 1;
+        bool negate = j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^');
+        if (negate) {
+            ++j;
+        }
+        CharSet set = {};
+        bool first = true;
+        while (j < pattern.size() && (pattern[j] != ']' || first)) {
+            first = false;
+            if (pattern.compare(j, 2, "[:") == 0) {
+                size_t close = pattern.find(":]", j + 2);
+                if (close != std::string::npos) {
+                    std::string name = pattern.substr(j + 2, close - j - 2);
+                    int (*test)(int) = name == "alpha" ? isalpha : name == "digit" ? isdigit
+                        : name == "alnum" ? isalnum : name == "upper" ? isupper : name == "lower" ? islower
+                        : name == "space" ? isspace : name == "punct" ? ispunct : name == "xdigit" ? isxdigit
+                        : nullptr;
+                    if (test) {
+                        for (int c = 0; c < 256; ++c) {
+                            if (test(c)) {
+                                set.add(c);
+                            }
+                        }
+                        j = close + 2;
+                        continue;
+                    }
+                }
+            }
+            unsigned char low = pattern[j] == '\\' && j + 1 < pattern.size() ? pattern[++j] : pattern[j];
+            ++j;
+            unsigned char high = low;
+            if (j + 1 < pattern.size() && pattern[j] == '-' && pattern[j + 1] != ']') {
+                high = pattern[j + 1] == '\\' && j + 2 < pattern.size() ? pattern[j + 2] : pattern[j + 1];
+                j += pattern[j + 1] == '\\' ? 3 : 2;
+            }
+            for (unsigned c = low; c <= high; ++c) {
+                set.add(c);
+            }
+        }
+        if (j >= pattern.size()) {
+            return false;
+        }
+        if (negate) {
+            for (uint64_t& word : set.bits) {
+                word = ~word;
+            }
+        }
+        tokens.push_back(Token{SET, 0, static_cast<uint32_t>(sets.size())});
+        sets.push_back(set);
+        i = j + 1;
+        return true;
+    }
+
+public:
+    explicit GlobMatcher(const std::string& pattern) : has_star(false) {
+        for (size_t i = 0; i < pattern.size();) {
+            char c = pattern[i];
+            if (c == '*') {
+                if (tokens.empty() || tokens.back().kind != STAR) {
+                    tokens.push_back(Token{STAR, 0, 0});
+                }
+                has_star = true;
+                ++i;
+            } else if (c == '?') {
+                tokens.push_back(Token{ANY, 0, 0});
+                ++i;
+            } else if (c == '[' && parseSet(pattern, i)) {
+                continue;
+            } else {
+                if (c == '\\' && i + 1 < pattern.size()) {
+                    c = pattern[++i];
+                }
+                tokens.push_back(Token{LITERAL, static_cast<unsigned char>(c), 0});
+                ++i;
+            }
+        }
+
+        for (const Token& token : tokens) {
+            if (token.kind != LITERAL) {
+                break;
+            }
+            prefix += token.literal;
+        }
+        if (has_star) {
+            for (size_t i = tokens.size(); i > 0 && tokens[i - 1].kind == LITERAL; --i) {
+                suffix.insert(suffix.begin(), tokens[i - 1].literal);
+            }
+        }
+    }
+
+    // True if any character would be special in a glob
+    static bool has_magic(const std::string& text) {
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '\\') {
+                ++i;
+            } else if (text[i] == '*' || text[i] == '?' || text[i] == '[') {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Remove backslash escapes from a component without magic characters
+    static std::string unescape(const std::string& text) {
+        std::string result;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '\\' && i + 1 < text.size()) {
+                ++i;
+            }
+            result += text[i];
+        }
+        return result;
+    }
+
+    // True if the pattern explicitly starts with a dot, so hidden names match
+    bool matches_hidden() const {
+        return !prefix.empty() && prefix[0] == '.';
+    }
+
+    bool matches(const std::string& name) const {
+        // Cheap literal checks first (e.g. the ".log" of "*.log")
+        if (name.size() < prefix.size() + suffix.size()
+            || name.compare(0, prefix.size(), prefix) != 0
+            || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            return false;
+        }
+
+        size_t t = 0, s = 0;
+        size_t star_t = std::string::npos, star_s = 0;
+        while (s < name.size()) {
+            if (t < tokens.size() && tokens[t].kind == STAR) {
+                star_t = t++;
+                star_s = s;
+            } else if (t < tokens.size() && matchToken(tokens[t], name[s])) {
+                ++t;
+                ++s;
+            } else if (star_t != std::string::npos) {
+                // Let the last * absorb one more character and retry from there
+                t = star_t + 1;
+                s = ++star_s;
+            } else {
+                return false;
+            }
+        }
+        while (t < tokens.size() && tokens[t].kind == STAR) {
+            ++t;
+        }
+        return t == tokens.size();
+    }
+};
+
+// A whole glob pattern such as "src/**/*.cpp", split into components and
+// compiled once. A component of just ** matches any number of directories
+// (not following symbolic links, and skipping hidden ones). Directories are
+// read through a DirectoryCache, so patterns expanded with the same cache
+// read each directory once.
+class Glob {
+private:
+    struct Component {
+        bool literal;   // No magic characters: used as is, no directory read
+        bool recursive; // **
+        std::string text;
+        GlobMatcher matcher;
+    };
+
+    bool absolute;
+    bool directories_only; // Pattern ends in '/'
+    std::vector<Component> components;
+
+    bool exists(const std::string& path) const {
+        return faccessat(AT_FDCWD, path.c_str(), F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    bool isDirectory(const std::string& path) const {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    // Match components[index...] below prefix ("" or ending in '/')
+    void expand(DirectoryCache& cache, const std::string& prefix, size_t index, std::vector<std::string>& out) const {
+        if (index == components.size()) {
+            if (directories_only) {
+                if (isDirectory(prefix)) {
+                    out.push_back(prefix);
+                }
+            } else if (!prefix.empty()) {
+                out.push_back(prefix.substr(0, prefix.size() - 1));
+            }
+            return;
+        }
+
+        const Component& component = components[index];
+        bool last = index + 1 == components.size();
+        if (component.literal) {
+            std::string path = prefix + component.text;
+            if (!last) {
+                expand(cache, path + "/", index + 1, out);
+            } else if (directories_only ? isDirectory(path) : exists(path)) {
+                out.push_back(directories_only ? path + "/" : path);
+            }
+            return;
+        }
+
+        const DirectoryCache::Listing* listing = cache.get(prefix);
+        if (listing == nullptr) {
+            return;
+        }
+        // Copy what is needed first: reading subdirectories may evict this listing
+        std::vector<std::string> matched;
+        std::vector<std::string> subdirectories;
+        bool hidden = component.matcher.matches_hidden();
+        for (const auto& entry : listing->entries) {
+            if (entry.first[0] == '.' && !hidden) {
+                continue;
+            }
+            if (component.recursive) {
+                if (entry.second.directory && !entry.second.link) {
+                    subdirectories.push_back(entry.first);
+                }
+            } else if (component.matcher.matches(entry.first)
+                       && ((last && !directories_only) || entry.second.directory)) {
+                matched.push_back(entry.first);
+            }
+        }
+
+        if (component.recursive) {
+            // ** matches nothing here, or descends one level and stays
+            expand(cache, prefix, index + 1, out);
+            for (const auto& name : subdirectories) {
+                expand(cache, prefix + name + "/", index, out);
+            }
+            return;
+        }
+        for (const auto& name : matched) {
+            if (last && !directories_only) {
+                out.push_back(prefix + name);
+            } else {
+                expand(cache, prefix + name + "/", index + 1, out);
+            }
+        }
+    }
+
+public:
+    explicit Glob(const std::string& pattern) : absolute(!pattern.empty() && pattern[0] == '/'), directories_only(false) {
+        size_t start = absolute ? 1 : 0;
+        while (start <= pattern.size()) {
+            size_t end = pattern.find('/', start);
+            if (end == std::string::npos) {
+                end = pattern.size();
+            }
+            std::string text = pattern.substr(start, end - start);
+            start = end + 1;
+            if (text.empty()) {
+                directories_only = end == pattern.size() && !components.empty();
+                continue; // "a//b" is "a/b"
+            }
+            bool literal = !GlobMatcher::has_magic(text);
+            // ** is recursive only as a directory component; a final ** is *
+            bool recursive = text == "**" && end != pattern.size();
+            components.push_back(Component{literal, recursive, literal ? GlobMatcher::unescape(text) : text,
+                                           GlobMatcher(text)});
+        }
+    }
+
+    // Append every existing path matching the pattern to out, sorted
+    void expand(DirectoryCache& cache, std::vector<std::string>& out) const {
+        size_t first = out.size();
+        expand(cache, absolute ? "/" : "", 0, out);
+        std::sort(out.begin() + first, out.end());
+    }
+};
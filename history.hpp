@@ -0,0 +1,347 @@
+#pragma once
+#include "map.hpp"
+#include "map_snapshot.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Command history kept as an append-only log of newline-terminated entries.
+//
+// Every session appends with a single O_APPEND write per entry, so concurrent
+// shells interleave whole entries and never corrupt each other. Reads go
+// through a read-only mmap of the log that is extended when the file grows.
+// An entry is identified by the byte offset where it starts.
+//
+// A prefix index (entry text -> offset of its latest occurrence) is persisted
+// as a Map snapshot covering the first `stamp` bytes of the log; entries
+// after that are indexed incrementally in an in-memory Map. Nothing is read
+// until the first query, so startup cost does not depend on history size.
+class History {
+public:
+    static constexpr uint64_t npos = ~0ull;
+
+private:
+    // Rebuild the persisted index once this many entries are only in memory
+    static constexpr size_t recent_limit = 4096;
+    // Prefix lookups visiting more index candidates than this scan the log
+    // backwards instead, since a match is then almost certainly recent
+    static constexpr size_t candidate_limit = 64;
+
+    std::string log_path;
+    std::string index_path;
+    int append_fd;
+
+    const char* data;   // Mapping of the log
+    size_t mapped;      // Bytes mapped
+    size_t usable;      // Bytes up to and including the last newline
+    bool loaded;
+    bool in_memory;     // The index could not be persisted and lives in recent
+
+    MapView<std::string, uint64_t> snapshot;
+    Map<std::string, uint64_t, std::less<>> recent;
+    uint64_t indexed;   // Log bytes covered by snapshot + recent
+
+    // End of the entry starting at offset, excluding its newline
+    uint64_t entryEnd(uint64_t offset) const {
+        const void* newline = memchr(data + offset, '\n', usable - offset);
+        return static_cast<const char*>(newline) - data;
+    }
+
+    bool startsWith(uint64_t offset, std::string_view prefix) const {
+        return entryEnd(offset) - offset >= prefix.size()
+            && memcmp(data + offset, prefix.data(), prefix.size()) == 0;
+    }
+
+    // Latest entry before `before` starting with prefix, by walking the log
+    uint64_t scanWithPrefix(std::string_view prefix, uint64_t before) const {
+        for (uint64_t offset = previous(before); offset != npos; offset = previous(offset)) {
+            if (startsWith(offset, prefix)) {
+                return offset;
+            }
+        }
+        return npos;
+    }
+
+    // Map any growth of the log and index the entries it added
+    void refresh() {
+        if (!loaded) {
+            loaded = true;
+            snapshot.open(index_path);
+        }
+
+        struct stat st;
+        int fd = ::open(log_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            if (fd != -1) {
+                ::close(fd);
+            }
+            return;
+        }
+        size_t size = st.st_size;
+        if (size != mapped) {
+            if (data) {
+                munmap(const_cast<char*>(data), mapped);
+            }
+            data = nullptr;
+            mapped = 0;
+            usable = 0;
+            if (size > 0) {
+                void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    data = static_cast<const char*>(mapping);
+                    mapped = size;
+                    const void* last = memrchr(data, '\n', size);
+                    usable = last ? static_cast<const char*>(last) - data + 1 : 0;
+                }
+            }
+        }
+        ::close(fd);
+
+        bool snapshot_valid = snapshot.is_open() && snapshot.stamp() <= usable
+            && (snapshot.stamp() == 0 || data[snapshot.stamp() - 1] == '\n');
+        if (indexed > usable || (!in_memory && !snapshot_valid)) {
+            // Missing, stale or the log was truncated
+            rebuild();
+            return;
+        }
+        if (snapshot_valid && indexed < snapshot.stamp()) {
+            indexed = snapshot.stamp();
+        }
+        for (uint64_t offset = indexed; offset < usable;) {
+            uint64_t end = entryEnd(offset);
+            recent.insert_or_assign(std::string(data + offset, end - offset), offset);
+            offset = end + 1;
+        }
+        indexed = usable;
+        if (!in_memory && recent.size() > recent_limit) {
+            compact();
+        }
+    }
+
+    // Fold recent into the persisted index with one linear merge of the two
+    // sorted sequences; on equal text the recent (newer) offset wins
+    void compact() {
+        std::vector<std::pair<std::string_view, uint64_t>> merged;
+        merged.reserve(snapshot.size() + recent.size());
+        auto old_it = snapshot.begin();
+        auto new_it = recent.begin();
+        while (old_it != snapshot.end() || new_it != recent.end()) {
+            if (new_it == recent.end()) {
+                merged.push_back(*old_it++);
+                continue;
+            }
+            std::string_view text = new_it->first;
+            if (old_it != snapshot.end()) {
+                auto old_entry = *old_it;
+                if (old_entry.first < text) {
+                    merged.push_back(old_entry);
+                    ++old_it;
+                    continue;
+                }
+                if (old_entry.first == text) {
+                    ++old_it;
+                }
+            }
+            merged.emplace_back(text, new_it->second);
+            ++new_it;
+        }
+
+        bool saved = save_snapshot<std::string_view, uint64_t>(merged.begin(), merged.end(), merged.size(),
+                                                               index_path, indexed);
+        merged.clear(); // Views into the old mapping die with it
+        if (saved && snapshot.open(index_path)) {
+            recent.clear();
+        } else {
+            rebuild();
+        }
+    }
+
+    // Index the whole log from scratch and persist it
+    void rebuild() {
+        std::vector<std::pair<std::string_view, uint64_t>> entries;
+        for (uint64_t offset = 0; offset < usable;) {
+            uint64_t end = entryEnd(offset);
+            entries.emplace_back(std::string_view(data + offset, end - offset), offset);
+            offset = end + 1;
+        }
+
+        // Sort by text, newest first within equal text, and keep one of each
+        std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first < b.first : a.second > b.second;
+        });
+        entries.erase(std::unique(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+            return a.first == b.first;
+        }), entries.end());
+
+        recent.clear();
+        indexed = usable;
+        in_memory = false;
+        if (!save_snapshot<std::string_view, uint64_t>(entries.begin(), entries.end(), entries.size(), index_path, usable)
+            || !snapshot.open(index_path)) {
+            // Cannot persist: keep the whole index in memory instead
+            snapshot.close();
+            in_memory = true;
+            recent = Map<std::string, uint64_t, std::less<>>(entries.begin(), entries.end());
+        }
+    }
+
+public:
+    History(std::string log_path, std::string index_path)
+        : log_path(std::move(log_path)), index_path(std::move(index_path)), append_fd(-1),
+          data(nullptr), mapped(0), usable(0), loaded(false), in_memory(false), indexed(0) {}
+
+    ~History() {
+        if (data) {
+            munmap(const_cast<char*>(data), mapped);
+        }
+        if (append_fd != -1) {
+            ::close(append_fd);
+        }
+    }
+
+    History(const History&) = delete;
+    History& operator=(const History&) = delete;
+
+    // Append an entry. Entries cannot contain newlines; empty ones are skipped.
+    void add(std::string_view line) {
+        if (line.empty() || line.find('\n') != std::string_view::npos) {
+            return;
+        }
+        if (append_fd == -1) {
+            append_fd = ::open(log_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+            if (append_fd == -1) {
+                return;
+            }
+        }
+        std::string record(line);
+        record.push_back('\n');
+        ssize_t written = ::write(append_fd, record.data(), record.size()); // One write keeps it atomic
+        (void)written;
+    }
+
+    // Text of the entry starting at offset
+    std::string_view at(uint64_t offset) const {
+        return std::string_view(data + offset, entryEnd(offset) - offset);
+    }
+
+    // Newest entry, or npos if the history is empty
+    uint64_t last() {
+        refresh();
+        return previous(usable);
+    }
+
+    // Entry before the one at offset (pass the log size to get the newest)
+    uint64_t previous(uint64_t offset) const {
+        if (offset == 0 || offset > usable) {
+            return npos;
+        }
+        const void* newline = offset >= 2 ? memrchr(data, '\n', offset - 1) : nullptr;
+        return newline ? static_cast<const char*>(newline) - data + 1 : 0;
+    }
+
+    // Entry after the one at offset, or npos at the end
+    uint64_t next(uint64_t offset) const {
+        uint64_t following = entryEnd(offset) + 1;
+        return following < usable ? following : npos;
+    }
+
+    // Latest entry before `before` starting with prefix (up-arrow after
+    // typing). Served from the index, which holds the latest offset of each
+    // text: stepping back from end() visits every matching text once, newest
+    // first, and a prefix nothing starts with costs one lookup. A prefix with
+    // many candidates walks the log instead, since a match is then close by.
+    uint64_t previous_with_prefix(std::string_view prefix, uint64_t before) const {
+        if (indexed != usable || before > usable) {
+            return scanWithPrefix(prefix, before); // Not refreshed since the log grew
+        }
+        uint64_t best = npos;
+        size_t candidates = 0;
+        for (auto it = recent.lower_bound(prefix);
+             it != recent.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            if (++candidates > candidate_limit) {
+                return scanWithPrefix(prefix, before);
+            }
+            if (it->second < before && (best == npos || it->second > best)) {
+                best = it->second;
+            }
+        }
+        // Everything in recent is newer than anything in the snapshot
+        if (best == npos && !in_memory) {
+            for (auto it = snapshot.lower_bound(prefix); it != snapshot.end(); ++it) {
+                auto entry = *it;
+                if (entry.first.compare(0, prefix.size(), prefix) != 0) {
+                    break;
+                }
+                if (++candidates > candidate_limit) {
+                    return scanWithPrefix(prefix, before);
+                }
+                // Texts in recent were already stepped past at a newer offset
+                if (entry.second < before && (best == npos || entry.second > best) && !recent.count(entry.first)) {
+                    best = entry.second;
+                }
+            }
+        }
+        if (best != npos && !startsWith(best, prefix)) {
+            // Index no longer matches the log; fall back to a scan
+            return scanWithPrefix(prefix, before);
+        }
+        return best;
+    }
+
+    // Latest entry starting with prefix, used by `!prefix`
+    uint64_t latest_with_prefix(std::string_view prefix) {
+        refresh();
+        return previous_with_prefix(prefix, usable);
+    }
+
+    // Latest entry before `before` containing needle (incremental Ctrl-R).
+    // A substring can start anywhere in an entry, so this walks the log.
+    uint64_t search(std::string_view needle, uint64_t before) const {
+        for (uint64_t offset = previous(before); offset != npos; offset = previous(offset)) {
+            if (at(offset).find(needle) != std::string_view::npos) {
+                return offset;
+            }
+        }
+        return npos;
+    }
+
+    // 1-based position of the entry at offset
+    size_t number(uint64_t offset) const {
+        size_t count = 1;
+        const char* end = data + offset;
+        for (const char* p = data; p < end; ++count) {
+            const void* newline = memchr(p, '\n', end - p);
+            if (!newline) {
+                break;
+            }
+            p = static_cast<const char*>(newline) + 1;
+        }
+        return count;
+    }
+
+    // Entry with the given 1-based number, or npos
+    uint64_t nth(size_t n) {
+        if (n == 0) {
+            return npos;
+        }
+        refresh();
+        uint64_t offset = usable > 0 ? 0 : npos;
+        while (offset != npos && --n > 0) {
+            offset = next(offset);
+        }
+        return offset;
+    }
+
+    // End of the log as of the last refresh; `previous(end())` is the newest entry
+    uint64_t end() const {
+        return usable;
+    }
+};
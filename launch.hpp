@@ -0,0 +1,187 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sched.h>
+#include <sys/resource.h>
+
+// Scheduling and resource controls for a launched command: a niceness
+// increment, a CPU affinity mask and rlimits. They are applied by the
+// command's own process between fork and exec, so the shell keeps its own.
+class LaunchSettings {
+public:
+    // Resources ulimit knows, by option letter; unit is the size in bytes
+    // of one unit of the value ulimit reads and prints
+    struct Resource {
+        char option;
+        int resource;
+        rlim_t unit;
+        const char* description;
+    };
+
+    static constexpr Resource resources[] = {
+        {'c', RLIMIT_CORE, 1024, "core file size (kbytes)"},
+        {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+        {'f', RLIMIT_FSIZE, 1024, "file size (kbytes)"},
+        {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)"},
+        {'n', RLIMIT_NOFILE, 1, "open files"},
+        {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+        {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+        {'u', RLIMIT_NPROC, 1, "max user processes"},
+        {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"}
+    };
+
+    // Values are in bytes, or RLIM_INFINITY
+    struct Limit {
+        int resource;
+        bool soft_set;
+        bool hard_set;
+        rlim_t soft;
+        rlim_t hard;
+    };
+
+private:
+    int niceness = 0;
+    bool pinned = false;
+    cpu_set_t cpus;
+    std::vector<Limit> limits;
+
+public:
+    bool empty() const {
+        return niceness == 0 && !pinned && limits.empty();
+    }
+
+    int nice_increment() const {
+        return niceness;
+    }
+
+    void set_niceness(int increment) {
+        niceness = increment;
+    }
+
+    void add_niceness(int increment) {
+        niceness += increment;
+    }
+
+    // The CPUs to pin to, or nullptr if the command keeps the shell's mask
+    const cpu_set_t* affinity() const {
+        return pinned ? &cpus : nullptr;
+    }
+
+    void set_affinity(const cpu_set_t& set) {
+        cpus = set;
+        pinned = true;
+    }
+
+    // The limit set on resource, or nullptr if it is inherited
+    const Limit* limit(int resource) const {
+        for (const auto& entry : limits) {
+            if (entry.resource == resource) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Set the soft limit, the hard limit or both
+    void set_limit(int resource, rlim_t value, bool soft, bool hard) {
+        Limit* entry = nullptr;
+        for (auto& existing : limits) {
+            entry = existing.resource == resource ? &existing : entry;
+        }
+        if (entry == nullptr) {
+            limits.push_back(Limit{resource, false, false, 0, 0});
+            entry = &limits.back();
+        }
+        if (soft) {
+            entry->soft_set = true;
+            entry->soft = value;
+        }
+        if (hard) {
+            entry->hard_set = true;
+            entry->hard = value;
+        }
+    }
+
+    // Apply to the calling process, a child about to run the command. Not
+    // being allowed to lower the niceness only warns, as nice(1) does.
+    bool apply() const {
+        if (niceness != 0) {
+            errno = 0;
+            int current = getpriority(PRIO_PROCESS, 0);
+            if (errno == 0 && setpriority(PRIO_PROCESS, 0, current + niceness) != 0) {
+                perror("nice: cannot set niceness");
+            }
+        }
+        if (pinned && sched_setaffinity(0, sizeof cpus, &cpus) != 0) {
+            perror("affinity");
+            return false;
+        }
+        for (const auto& entry : limits) {
+            struct rlimit current;
+            if (getrlimit(entry.resource, &current) != 0) {
+                perror("ulimit");
+                return false;
+            }
+            if (entry.soft_set) {
+                current.rlim_cur = entry.soft;
+            }
+            if (entry.hard_set) {
+                current.rlim_max = entry.hard;
+            }
+            if (setrlimit(entry.resource, &current) != 0) {
+                perror("ulimit");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Parse a CPU list such as "0-3,6"
+    static bool parse_cpus(const std::string& text, cpu_set_t& set) {
+        CPU_ZERO(&set);
+        size_t start = 0;
+        while (start <= text.size()) {
+            size_t end = std::min(text.find(',', start), text.size());
+            std::string range = text.substr(start, end - start);
+            size_t dash = range.find('-');
+            std::string first = range.substr(0, dash);
+            std::string last = dash == std::string::npos ? first : range.substr(dash + 1);
+            if (first.empty() || last.empty() || first.size() > 5 || last.size() > 5
+                || (first + last).find_first_not_of("0123456789") != std::string::npos) {
+                return false;
+            }
+            unsigned long low = std::stoul(first), high = std::stoul(last);
+            if (low > high || high >= CPU_SETSIZE) {
+                return false;
+            }
+            for (unsigned long cpu = low; cpu <= high; ++cpu) {
+                CPU_SET(cpu, &set);
+            }
+            start = end + 1;
+        }
+        return true;
+    }
+
+    // The inverse of parse_cpus, with runs of CPUs as ranges
+    static std::string format_cpus(const cpu_set_t& set) {
+        std::string text;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &set)) {
+                continue;
+            }
+            int last = cpu;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) {
+                ++last;
+            }
+            text += (text.empty() ? "" : ",") + std::to_string(cpu);
+            if (last > cpu) {
+                text += "-" + std::to_string(last);
+            }
+            cpu = last;
+        }
+        return text;
+    }
+};
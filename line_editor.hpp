@@ -0,0 +1,416 @@
+#pragma once
+#include "history.hpp"
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Single-line raw-mode editor for interactive input.
+//
+// Keys: arrows, Home/End, Ctrl-A/E/B/F, Backspace/Delete, Ctrl-K/U/W, Ctrl-L,
+// Tab (completion), Up/Down (history entries starting with the text typed
+// before the first Up), Ctrl-R (incremental reverse search), Ctrl-C (discard
+// the line) and Ctrl-D (end of input on an empty line).
+class LineEditor {
+public:
+    // Appends completions for the word line[word_start, cursor) to out.
+    // Candidates naming a directory end in '/'.
+    typedef std::function<void(const std::string& line, size_t word_start, size_t cursor,
+                               std::vector<std::string>& out)> Completer;
+
+private:
+    History& history;
+    Completer completer;
+    struct termios saved;
+
+    // Up/Down through the history for the line being edited
+    struct HistoryWalk {
+        std::string typed;                      // The line before the first Up
+        std::vector<uint64_t> shown;            // Entries Up has shown, newest first
+        std::unordered_set<std::string> texts;  // Their texts
+        uint64_t from;                          // Where Up searches on from
+        size_t current;                         // Entries of shown stepped through
+    };
+
+    std::string prompt;
+    std::string line;
+    size_t cursor;
+    bool last_was_tab;
+
+    // Restores the terminal however read() exits
+    struct RawMode {
+        int fd;
+        const struct termios& original;
+
+        RawMode(int fd, const struct termios& original) : fd(fd), original(original) {
+            struct termios raw = original;
+            raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+            raw.c_cflag |= CS8;
+            raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            tcsetattr(fd, TCSAFLUSH, &raw);
+        }
+
+        ~RawMode() {
+            tcsetattr(fd, TCSAFLUSH, &original);
+        }
+    };
+
+    static void emit(const std::string& text) {
+        const char* data = text.data();
+        size_t size = text.size();
+        while (size > 0) {
+            ssize_t written = ::write(STDOUT_FILENO, data, size);
+            if (written <= 0) {
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    static int readKey() {
+        unsigned char c;
+        ssize_t n;
+        do {
+            n = ::read(STDIN_FILENO, &c, 1);
+        } while (n < 0 && errno == EINTR);
+        return n == 1 ? c : -1;
+    }
+
+    void redraw(const std::string& shown_prompt, const std::string& text, size_t position) {
+        std::string frame = "\r" + shown_prompt + text + "\x1b[K\r";
+        size_t column = shown_prompt.size() + position;
+        if (column > 0) {
+            frame += "\x1b[" + std::to_string(column) + "C";
+        }
+        emit(frame);
+    }
+
+    void refresh() {
+        redraw(prompt, line, cursor);
+    }
+
+    void insert(const std::string& text) {
+        line.insert(cursor, text);
+        cursor += text.size();
+    }
+
+    // Tab: complete a unique match, extend to the longest common prefix, or
+    // on a second Tab with nothing to add, list the candidates
+    void complete() {
+        size_t word_start = line.rfind(' ', cursor == 0 ? 0 : cursor - 1);
+        word_start = word_start == std::string::npos || cursor == 0 ? 0 : word_start + 1;
+        if (word_start > cursor) {
+            word_start = cursor;
+        }
+
+        std::vector<std::string> candidates;
+        if (completer) {
+            completer(line, word_start, cursor, candidates);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        if (candidates.empty()) {
+            emit("\a");
+            return;
+        }
+
+        std::string common = candidates[0];
+        for (const auto& candidate : candidates) {
+            size_t n = 0;
+            while (n < common.size() && n < candidate.size() && common[n] == candidate[n]) {
+                ++n;
+            }
+            common.resize(n);
+        }
+
+        size_t typed = cursor - word_start;
+        if (candidates.size() == 1) {
+            std::string rest = common.substr(typed);
+            if (common.empty() || common.back() != '/') {
+                rest += ' ';
+            }
+            insert(rest);
+            refresh();
+            return;
+        }
+        if (common.size() > typed) {
+            insert(common.substr(typed));
+            refresh();
+            return;
+        }
+        if (!last_was_tab) {
+            emit("\a");
+            return;
+        }
+
+        // List candidates in columns below the line, then redraw it
+        struct winsize ws;
+        size_t width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+        size_t longest = 0;
+        for (const auto& candidate : candidates) {
+            longest = std::max(longest, candidate.size());
+        }
+        size_t columns = std::max<size_t>(1, width / (longest + 2));
+        std::string listing = "\r\n";
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            listing += candidates[i];
+            bool row_end = (i + 1) % columns == 0 || i + 1 == candidates.size();
+            listing += row_end ? "\r\n" : std::string(longest + 2 - candidates[i].size(), ' ');
+        }
+        emit(listing);
+        refresh();
+    }
+
+    // Up/Down: step through entries starting with what was typed before the
+    // first Up, newest first and each text once. Up records what it shows, so
+    // Down retraces exactly those entries back to the typed line.
+    void stepHistory(bool older, HistoryWalk& walk) {
+        if (older) {
+            if (walk.current == 0) {
+                history.last(); // Pick up entries from other sessions
+                walk = HistoryWalk{line, {}, {}, history.end(), 0};
+            }
+            if (walk.current == walk.shown.size()) {
+                uint64_t found = history.previous_with_prefix(walk.typed, walk.from);
+                while (found != History::npos && (history.at(found) == walk.typed
+                                                  || !walk.texts.insert(std::string(history.at(found))).second)) {
+                    found = history.previous_with_prefix(walk.typed, found);
+                }
+                if (found == History::npos) {
+                    emit("\a");
+                    return;
+                }
+                walk.shown.push_back(found);
+                walk.from = found;
+            }
+            line = std::string(history.at(walk.shown[walk.current++]));
+        } else {
+            if (walk.current == 0) {
+                emit("\a");
+                return;
+            }
+            --walk.current;
+            line = walk.current == 0 ? walk.typed : std::string(history.at(walk.shown[walk.current - 1]));
+        }
+        cursor = line.size();
+    }
+
+    // Ctrl-R: returns true if Enter accepted the match and the line should run
+    bool reverseSearch() {
+        history.last();
+        std::string query;
+        uint64_t match = History::npos;
+        bool failed = false;
+
+        for (;;) {
+            std::string shown = match == History::npos ? std::string() : std::string(history.at(match));
+            size_t at = match == History::npos ? 0 : shown.find(query);
+            redraw(std::string(failed ? "(failed " : "(") + "reverse-i-search)`" + query + "': ",
+                   shown, at == std::string::npos ? 0 : at);
+
+            int key = readKey();
+            if (key == -1 || key == 3 || key == 7) { // EOF, Ctrl-C, Ctrl-G: cancel
+                refresh();
+                return false;
+            }
+            if (key == '\r' || key == '\n' || key == 27) {
+                if (match != History::npos) {
+                    line = shown;
+                    cursor = line.size();
+                }
+                if (key == 27) {
+                    readKey(); // Drop the rest of an escape sequence
+                    readKey();
+                    refresh();
+                    return false;
+                }
+                return true;
+            }
+
+            uint64_t from;
+            if (key == 18) { // Ctrl-R again: next older match
+                from = match == History::npos ? history.end() : match;
+            } else if (key == 127 || key == 8) {
+                if (!query.empty()) {
+                    query.pop_back();
+                }
+                from = history.end();
+            } else if (key >= 32) {
+                query += static_cast<char>(key);
+                // Keep the current match if it still contains the longer query
+                uint64_t after = match == History::npos ? History::npos : history.next(match);
+                from = after == History::npos ? history.end() : after;
+            } else {
+                continue;
+            }
+            uint64_t found = query.empty() ? History::npos : history.search(query, from);
+            failed = found == History::npos && !query.empty();
+            if (!failed) {
+                match = found;
+            }
+        }
+    }
+
+public:
+    LineEditor(History& history, Completer completer)
+        : history(history), completer(std::move(completer)), saved(), cursor(0), last_was_tab(false) {}
+
+    // True when stdin and stdout are both terminals
+    static bool interactive() {
+        return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    }
+
+    // Read one line. Returns false at end of input.
+    bool read(const std::string& prompt_text, std::string& result) {
+        if (tcgetattr(STDIN_FILENO, &saved) != 0) {
+            return false;
+        }
+        RawMode raw(STDIN_FILENO, saved);
+
+        prompt = prompt_text;
+        line.clear();
+        cursor = 0;
+        last_was_tab = false;
+        HistoryWalk walk{std::string(), {}, {}, History::npos, 0};
+        refresh();
+
+        for (;;) {
+            int key = readKey();
+            bool tab = false;
+            switch (key) {
+            case -1:
+                return false;
+            case 4: // Ctrl-D
+                if (line.empty()) {
+                    return false;
+                }
+                if (cursor < line.size()) {
+                    line.erase(cursor, 1);
+                }
+                break;
+            case '\r':
+            case '\n':
+                emit("\r\n");
+                result = line;
+                return true;
+            case 3: // Ctrl-C
+                emit("^C\r\n");
+                line.clear();
+                cursor = 0;
+                walk.current = 0;
+                break;
+            case '\t':
+                complete();
+                tab = true;
+                break;
+            case 18: // Ctrl-R
+                if (reverseSearch()) {
+                    emit("\r\n");
+                    result = line;
+                    return true;
+                }
+                break;
+            case 127:
+            case 8:
+                if (cursor > 0) {
+                    line.erase(--cursor, 1);
+                }
+                break;
+            case 1: // Ctrl-A
+                cursor = 0;
+                break;
+            case 5: // Ctrl-E
+                cursor = line.size();
+                break;
+            case 2: // Ctrl-B
+                cursor -= cursor > 0;
+                break;
+            case 6: // Ctrl-F
+                cursor += cursor < line.size();
+                break;
+            case 11: // Ctrl-K
+                line.erase(cursor);
+                break;
+            case 21: // Ctrl-U
+                line.erase(0, cursor);
+                cursor = 0;
+                break;
+            case 23: { // Ctrl-W
+                size_t start = cursor;
+                while (start > 0 && line[start - 1] == ' ') {
+                    --start;
+                }
+                while (start > 0 && line[start - 1] != ' ') {
+                    --start;
+                }
+                line.erase(start, cursor - start);
+                cursor = start;
+                break;
+            }
+            case 12: // Ctrl-L
+                emit("\x1b[H\x1b[2J");
+                break;
+            case 16: // Ctrl-P
+                stepHistory(true, walk);
+                break;
+            case 14: // Ctrl-N
+                stepHistory(false, walk);
+                break;
+            case 27: { // Escape sequences: ESC [ x or ESC [ n ~ or ESC O x
+                int first = readKey();
+                int second = readKey();
+                if (first == '[' && second >= '0' && second <= '9') {
+                    int tilde = readKey();
+                    if (tilde == '~') {
+                        if (second == '3' && cursor < line.size()) {
+                            line.erase(cursor, 1);
+                        } else if (second == '1' || second == '7') {
+                            cursor = 0;
+                        } else if (second == '4' || second == '8') {
+                            cursor = line.size();
+                        }
+                    }
+                } else if (first == '[' || first == 'O') {
+                    switch (second) {
+                    case 'A':
+                        stepHistory(true, walk);
+                        break;
+                    case 'B':
+                        stepHistory(false, walk);
+                        break;
+                    case 'C':
+                        cursor += cursor < line.size();
+                        break;
+                    case 'D':
+                        cursor -= cursor > 0;
+                        break;
+                    case 'H':
+                        cursor = 0;
+                        break;
+                    case 'F':
+                        cursor = line.size();
+                        break;
+                    }
+                }
+                break;
+            }
+            default:
+                if (key >= 32) {
+                    insert(std::string(1, static_cast<char>(key)));
+                }
+                break;
+            }
+            last_was_tab = tab;
+            if (!tab) {
+                refresh();
+            }
+        }
+    }
+};
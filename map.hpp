@@ -1,9 +1,11 @@
+#pragma once
 #include <utility>
 #include <functional>
 #include <stdexcept>
 #include <string>
 #include "vector.hpp"
 #include <initializer_list>
+#include <tuple>
 
 template<typename Key, typename Value, typename Compare = std::less<Key>>
 class Map {
@@ -23,6 +25,11 @@ private:
         Node(P&& pair, Node* parent = nullptr)
             : data(std::forward<P>(pair)), 
               left(nullptr), right(nullptr), parent(parent) {}
+            
+        template<typename... KArgs, typename... VArgs>
+        Node(std::piecewise_construct_t, std::tuple<KArgs...> key, std::tuple<VArgs...> value)
+            : data(std::piecewise_construct, std::move(key), std::move(value)),
+              left(nullptr), right(nullptr), parent(nullptr) {}
     };
     
     Node* root;
@@ -94,15 +101,77 @@ public:
         friend class Map;
     };
     
+    // Owns a node detached from a map by extract(); it can be re-inserted into
+    // any map of the same type without reallocating the entry
+    class NodeHandle {
+    private:
+        Node* node;
+        
+        explicit NodeHandle(Node* node) : node(node) {}
+        
+    public:
+        NodeHandle() : node(nullptr) {}
+        
+        NodeHandle(NodeHandle&& other) noexcept : node(other.node) {
+            other.node = nullptr;
+        }
+        
+        NodeHandle& operator=(NodeHandle&& other) noexcept {
+            if (this != &other) {
+                delete node;
+                node = other.node;
+                other.node = nullptr;
+            }
+            return *this;
+        }
+        
+        NodeHandle(const NodeHandle&) = delete;
+        NodeHandle& operator=(const NodeHandle&) = delete;
+        
+        ~NodeHandle() {
+            delete node;
+        }
+        
+        bool empty() const {
+            return node == nullptr;
+        }
+        
+        explicit operator bool() const {
+            return node != nullptr;
+        }
+        
+        // The key may be changed while the node is outside any map
+        Key& key() const {
+            return const_cast<Key&>(node->data.first);
+        }
+        
+        Value& mapped() const {
+            return node->data.second;
+        }
+        
+        friend class Map;
+    };
+    
+    struct InsertReturn {
+        Iterator position;
+        bool inserted;
+        NodeHandle node;
+    };
+    
     // Default constructor
     Map() : root(nullptr), node_count(0), comp(Compare()) {}
     
     // Initializer list constructor
     Map(std::initializer_list<std::pair<const Key, Value>> init) 
         : root(nullptr), node_count(0), comp(Compare()) {
-        for (const auto& pair : init) {
-            insert(pair);
-        }
+        assignRange(init.begin(), init.end());
+    }
+    
+    // Range constructor: linear time when the range is sorted by key
+    template<typename InputIt>
+    Map(InputIt first, InputIt last)
+        : root(nullptr), node_count(0), comp(Compare()) {
+        assignRange(first, last);
     }
     
     // Destructor
@@ -112,9 +181,7 @@ public:
     
     // Copy constructor
     Map(const Map& other) : root(nullptr), node_count(0), comp(other.comp) {
-        for (auto it = other.begin(); it != other.end(); ++it) {
-            insert(*it);
-        }
+        assignRange(other.begin(), other.end());
     }
     
     // Move constructor
@@ -128,9 +195,7 @@ public:
         if (this != &other) {
             clear();
             comp = other.comp;
-            for (auto it = other.begin(); it != other.end(); ++it) {
-                insert(*it);
-            }
+            assignRange(other.begin(), other.end());
         }
         return *this;
     }
@@ -152,9 +217,7 @@ public:
     // Initializer list assignment
     Map& operator=(std::initializer_list<std::pair<const Key, Value>> ilist) {
         clear();
-        for (const auto& pair : ilist) {
-            insert(pair);
-        }
+        assignRange(ilist.begin(), ilist.end());
         return *this;
     }
     
@@ -181,17 +244,42 @@ public:
     }
     
     Iterator find(const Key& key) const {
-        Node* node = root;
-        while (node) {
-            if (comp(key, node->data.first)) {
-                node = node->left;
-            } else if (comp(node->data.first, key)) {
-                node = node->right;
-            } else {
-                return Iterator(node);
-            }
-        }
-        return end();
+        return Iterator(findNode(key));
+    }
+    
+    // Heterogeneous lookup, available when Compare declares is_transparent
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator find(const K& key) const {
+        return Iterator(findNode(key));
+    }
+    
+    // First element whose key is not less than key
+    Iterator lower_bound(const Key& key) const {
+        return Iterator(lowerBoundNode(key));
+    }
+    
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator lower_bound(const K& key) const {
+        return Iterator(lowerBoundNode(key));
+    }
+    
+    // First element whose key is greater than key
+    Iterator upper_bound(const Key& key) const {
+        return Iterator(upperBoundNode(key));
+    }
+    
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator upper_bound(const K& key) const {
+        return Iterator(upperBoundNode(key));
+    }
+    
+    std::pair<Iterator, Iterator> equal_range(const Key& key) const {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+    
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<Iterator, Iterator> equal_range(const K& key) const {
+        return std::make_pair(lower_bound(key), upper_bound(key));
     }
     
     // Perfect forwarding insert for pair
@@ -206,32 +294,72 @@ public:
         return insertInternal(std::make_pair(std::forward<K>(key), std::forward<V>(value)));
     }
     
+    // Hinted insert: constant time when the key belongs right next to hint
+    template<typename P>
+    Iterator insert(Iterator hint, P&& pair) {
+        Node* parent;
+        bool left;
+        if (Node* existing = findHintSlot(hint.current, pair.first, parent, left)) {
+            return Iterator(existing);
+        }
+        return linkNode(new Node(std::forward<P>(pair)), parent, left);
+    }
+    
+    // Re-link a node previously detached with extract()
+    InsertReturn insert(NodeHandle&& handle) {
+        if (handle.empty()) {
+            return InsertReturn{end(), false, NodeHandle()};
+        }
+        Node* parent;
+        bool left;
+        if (Node* existing = findSlot(handle.node->data.first, parent, left)) {
+            return InsertReturn{Iterator(existing), false, std::move(handle)};
+        }
+        Iterator position = linkNode(handle.node, parent, left);
+        handle.node = nullptr;
+        return InsertReturn{position, true, NodeHandle()};
+    }
+    
     // Emplace implementation using perfect forwarding
     template<typename... Args>
     std::pair<Iterator, bool> emplace(Args&&... args) {
         return insertInternal(std::pair<const Key, Value>(std::forward<Args>(args)...));
     }
     
+    template<typename... Args>
+    Iterator emplace_hint(Iterator hint, Args&&... args) {
+        return insert(hint, std::pair<const Key, Value>(std::forward<Args>(args)...));
+    }
+    
+    // Constructs the value in place only if key is absent, in a single descent
+    template<typename... Args>
+    std::pair<Iterator, bool> try_emplace(const Key& key, Args&&... args) {
+        return tryEmplaceInternal(key, std::forward<Args>(args)...);
+    }
+    
+    template<typename... Args>
+    std::pair<Iterator, bool> try_emplace(Key&& key, Args&&... args) {
+        return tryEmplaceInternal(std::move(key), std::forward<Args>(args)...);
+    }
+    
+    template<typename M>
+    std::pair<Iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+        return insertOrAssignInternal(key, std::forward<M>(obj));
+    }
+    
+    template<typename M>
+    std::pair<Iterator, bool> insert_or_assign(Key&& key, M&& obj) {
+        return insertOrAssignInternal(std::move(key), std::forward<M>(obj));
+    }
+    
     // Subscript operator for lvalue keys
     Value& operator[](const Key& key) {
-        Iterator it = find(key);
-        if (it != end()) {
-            return it->second;
-        }
-        
-        auto result = insert(key, Value());
-        return result.first->second;
+        return try_emplace(key).first->second;
     }
     
     // Subscript operator for rvalue keys
     Value& operator[](Key&& key) {
-        Iterator it = find(key);
-        if (it != end()) {
-            return it->second;
-        }
-        
-        auto result = insert(std::move(key), Value());
-        return result.first->second;
+        return try_emplace(std::move(key)).first->second;
     }
     
     Value& at(const Key& key) {
@@ -251,30 +379,141 @@ public:
     }
     
     size_t erase(const Key& key) {
-        Node* current = root;
+        Node* node = findNode(key);
+        if (!node) {
+            return 0; // Key not found
+        }
         
-        // Find the node to remove
-        while (current) {
-            if (comp(key, current->data.first)) {
-                current = current->left;
-            } else if (comp(current->data.first, key)) {
-                current = current->right;
+        unlinkNode(node);
+        delete node;
+        return 1;
+    }
+    
+    // Erase the element at pos and return the one after it
+    Iterator erase(Iterator pos) {
+        Node* next = successor(pos.current);
+        unlinkNode(pos.current);
+        delete pos.current;
+        return Iterator(next);
+    }
+    
+    Iterator erase(Iterator first, Iterator last) {
+        while (first != last) {
+            first = erase(first);
+        }
+        return last;
+    }
+    
+    // Detach the node at pos without destroying its entry
+    NodeHandle extract(Iterator pos) {
+        unlinkNode(pos.current);
+        return NodeHandle(pos.current);
+    }
+    
+    NodeHandle extract(const Key& key) {
+        Node* node = findNode(key);
+        if (node) {
+            unlinkNode(node);
+        }
+        return NodeHandle(node);
+    }
+
+    // Move every entry of other whose key is absent here into this map.
+    // Entries with duplicate keys stay in other. Nodes are spliced, not
+    // copied, and both trees are rebuilt in O(size() + other.size()).
+    void merge(Map& other) {
+        if (this == &other || other.empty()) {
+            return;
+        }
+        
+        Vector<Node*> mine, theirs, merged, rejected;
+        collectNodes(mine);
+        other.collectNodes(theirs);
+        merged.reserve(mine.size() + theirs.size());
+        
+        size_t i = 0, j = 0;
+        while (i < mine.size() && j < theirs.size()) {
+            if (comp(mine[i]->data.first, theirs[j]->data.first)) {
+                merged.push_back(mine[i++]);
+            } else if (comp(theirs[j]->data.first, mine[i]->data.first)) {
+                merged.push_back(theirs[j++]);
             } else {
-                break;
+                merged.push_back(mine[i++]);
+                rejected.push_back(theirs[j++]);
             }
         }
+        while (i < mine.size()) {
+            merged.push_back(mine[i++]);
+        }
+        while (j < theirs.size()) {
+            merged.push_back(theirs[j++]);
+        }
         
-        if (!current) {
-            return 0; // Key not found
+        root = buildBalanced(merged.data_ptr(), merged.size(), nullptr);
+        node_count = merged.size();
+        other.root = buildBalanced(rejected.data_ptr(), rejected.size(), nullptr);
+        other.node_count = rejected.size();
+    }
+    
+    void merge(Map&& other) {
+        merge(other);
+    }
+    
+    // Keep only the keys also present in other, in O(size() + other.size())
+    void intersect(const Map& other) {
+        Vector<Node*> mine, kept;
+        collectNodes(mine);
+        kept.reserve(mine.size());
+        
+        Iterator it = other.begin();
+        for (size_t i = 0; i < mine.size(); ++i) {
+            while (it != other.end() && comp(it->first, mine[i]->data.first)) {
+                ++it;
+            }
+            if (it != other.end() && !comp(mine[i]->data.first, it->first)) {
+                kept.push_back(mine[i]);
+            } else {
+                delete mine[i];
+            }
         }
         
-        eraseNode(current);
-        --node_count;
-        return 1;
+        root = buildBalanced(kept.data_ptr(), kept.size(), nullptr);
+        node_count = kept.size();
     }
-
+    
+    // Half-open iterator range usable in range-based for loops
+    struct Range {
+        Iterator first;
+        Iterator last;
+        
+        Iterator begin() const {
+            return first;
+        }
+        
+        Iterator end() const {
+            return last;
+        }
+    };
+    
+    // Ordered scan of every key in [from, to)
+    template<typename K>
+    Range range(const K& from, const K& to) const {
+        return Range{lower_bound(from), lower_bound(to)};
+    }
+    
+    // Ordered scan of every key not less than from
+    template<typename K>
+    Range range_from(const K& from) const {
+        return Range{lower_bound(from), end()};
+    }
+    
     size_t count(const Key& key) const {
-        return find(key) != end() ? 1 : 0;
+        return findNode(key) ? 1 : 0;
+    }
+    
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t count(const K& key) const {
+        return findNode(key) ? 1 : 0;
     }
     
 private:
@@ -294,109 +533,291 @@ private:
         delete node;
     }
     
-    // Internal insertion helper with perfect forwarding
-    template<typename P>
-    std::pair<Iterator, bool> insertInternal(P&& pair) {
-        if (!root) {
-            root = new Node(std::forward<P>(pair));
-            node_count = 1;
-            return std::make_pair(Iterator(root), true);
+    // Append every node to out in key order
+    void collectNodes(Vector<Node*>& out) const {
+        out.reserve(node_count);
+        for (Node* node = findMin(root); node; node = successor(node)) {
+            out.push_back(node);
+        }
+    }
+    
+    // Link count sorted nodes into a height-balanced subtree
+    static Node* buildBalanced(Node** nodes, size_t count, Node* parent) {
+        if (count == 0) {
+            return nullptr;
+        }
+        size_t mid = count / 2;
+        Node* node = nodes[mid];
+        node->parent = parent;
+        node->left = buildBalanced(nodes, mid, node);
+        node->right = buildBalanced(nodes + mid + 1, count - mid - 1, node);
+        return node;
+    }
+    
+    // Fill an empty map. Nodes are collected while the input is strictly
+    // increasing and linked into a balanced tree in one pass; anything after
+    // the first out-of-order key is inserted normally.
+    template<typename InputIt>
+    void assignRange(InputIt first, InputIt last) {
+        Vector<Node*> sorted;
+        for (; first != last; ++first) {
+            if (!sorted.empty()) {
+                const Key& prev = sorted.back()->data.first;
+                if (!comp(prev, first->first)) {
+                    if (!comp(first->first, prev)) {
+                        continue; // Duplicate key: the first one wins, as with insert
+                    }
+                    break;
+                }
+            }
+            sorted.push_back(new Node(*first));
         }
         
-        Node* current = root;
-        Node* parent = nullptr;
+        root = buildBalanced(sorted.data_ptr(), sorted.size(), nullptr);
+        node_count = sorted.size();
         
-        // Use the first element of the pair for comparison
-        const Key& key = pair.first;
+        for (; first != last; ++first) {
+            insert(*first);
+        }
+    }
+    
+    Node* findMax(Node* node) const {
+        if (!node) return nullptr;
+        while (node->right) {
+            node = node->right;
+        }
+        return node;
+    }
+    
+    // In-order neighbours of a node, nullptr at either end
+    Node* predecessor(Node* node) const {
+        if (node->left) {
+            return findMax(node->left);
+        }
+        Node* parent = node->parent;
+        while (parent && node == parent->left) {
+            node = parent;
+            parent = parent->parent;
+        }
+        return parent;
+    }
+    
+    Node* successor(Node* node) const {
+        if (node->right) {
+            return findMin(node->right);
+        }
+        Node* parent = node->parent;
+        while (parent && node == parent->right) {
+            node = parent;
+            parent = parent->parent;
+        }
+        return parent;
+    }
+    
+    template<typename K>
+    Node* findNode(const K& key) const {
+        Node* node = root;
+        while (node) {
+            if (comp(key, node->data.first)) {
+                node = node->left;
+            } else if (comp(node->data.first, key)) {
+                node = node->right;
+            } else {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+    
+    template<typename K>
+    Node* lowerBoundNode(const K& key) const {
+        Node* node = root;
+        Node* result = nullptr;
+        while (node) {
+            if (comp(node->data.first, key)) {
+                node = node->right;
+            } else {
+                result = node;
+                node = node->left;
+            }
+        }
+        return result;
+    }
+    
+    template<typename K>
+    Node* upperBoundNode(const K& key) const {
+        Node* node = root;
+        Node* result = nullptr;
+        while (node) {
+            if (comp(key, node->data.first)) {
+                result = node;
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        return result;
+    }
+    
+    // Descend once looking for key. Returns the matching node if there is one;
+    // otherwise returns nullptr and sets parent/left to where key would be linked.
+    template<typename K>
+    Node* findSlot(const K& key, Node*& parent, bool& left) const {
+        Node* current = root;
+        parent = nullptr;
+        left = false;
         
         while (current) {
-            parent = current;
-            
             if (comp(key, current->data.first)) {
+                parent = current;
+                left = true;
                 current = current->left;
             } else if (comp(current->data.first, key)) {
+                parent = current;
+                left = false;
                 current = current->right;
             } else {
-                // Key already exists
-                return std::make_pair(Iterator(current), false);
+                return current;
             }
         }
-        
-        Node* new_node = new Node(std::forward<P>(pair), parent);
-        
-        if (comp(key, parent->data.first)) {
-            parent->left = new_node;
-        } else {
-            parent->right = new_node;
-        }
-        
-        node_count++;
-        return std::make_pair(Iterator(new_node), true);
+        return nullptr;
     }
     
-    void eraseNode(Node* node) {
-        // Case 1: Node has no children
-        if (!node->left && !node->right) {
-            if (node == root) {
-                root = nullptr;
-            } else {
-                Node* parent = node->parent;
-                if (parent->left == node) {
-                    parent->left = nullptr;
-                } else {
-                    parent->right = nullptr;
-                }
-            }
-            delete node;
+    // Like findSlot, but first checks whether key sits between hint and its
+    // in-order neighbour, which needs no descent from the root
+    Node* findHintSlot(Node* hint, const Key& key, Node*& parent, bool& left) const {
+        if (!root) {
+            parent = nullptr;
+            left = false;
+            return nullptr;
         }
-        // Case 2: Node has one child
-        else if (!node->left) {
-            Node* right = node->right;
-            right->parent = node->parent;
-            
-            if (node == root) {
-                root = right;
-            } else {
-                Node* parent = node->parent;
-                if (parent->left == node) {
-                    parent->left = right;
+        
+        if (!hint) {
+            // Hint is end(): appending after the current maximum
+            Node* last = findMax(root);
+            if (comp(last->data.first, key)) {
+                parent = last;
+                left = false;
+                return nullptr;
+            }
+        } else if (comp(key, hint->data.first)) {
+            Node* prev = predecessor(hint);
+            if (!prev || comp(prev->data.first, key)) {
+                // Either hint has no left child, or prev is the rightmost node
+                // of that subtree and has no right child
+                if (!hint->left) {
+                    parent = hint;
+                    left = true;
                 } else {
-                    parent->right = right;
+                    parent = prev;
+                    left = false;
                 }
+                return nullptr;
             }
-            delete node;
-        }
-        else if (!node->right) {
-            Node* left = node->left;
-            left->parent = node->parent;
-            
-            if (node == root) {
-                root = left;
-            } else {
-                Node* parent = node->parent;
-                if (parent->left == node) {
-                    parent->left = left;
+        } else if (comp(hint->data.first, key)) {
+            Node* next = successor(hint);
+            if (!next || comp(key, next->data.first)) {
+                if (!hint->right) {
+                    parent = hint;
+                    left = false;
                 } else {
-                    parent->right = left;
+                    parent = next;
+                    left = true;
                 }
+                return nullptr;
             }
-            delete node;
+        } else {
+            return hint;
         }
-        // Case 3: Node has two children
-        else {
-            // Find the successor (minimum value in right subtree)
-            Node* successor = findMin(node->right);
-            
-            // Copy successor's key (const_cast is safe here since we're replacing the node anyway)
-            const_cast<Key&>(node->data.first) = successor->data.first;
-            
-            // Copy successor's value using assignment
-            node->data.second = successor->data.second;
-            
-            // Recursively delete the successor
-            eraseNode(successor);
-            // Adjust the node count to avoid double-counting
-            ++node_count;
+        
+        return findSlot(key, parent, left);
+    }
+    
+    Iterator linkNode(Node* node, Node* parent, bool left) {
+        node->parent = parent;
+        if (!parent) {
+            root = node;
+        } else if (left) {
+            parent->left = node;
+        } else {
+            parent->right = node;
+        }
+        ++node_count;
+        return Iterator(node);
+    }
+    
+    // Internal insertion helper with perfect forwarding
+    template<typename P>
+    std::pair<Iterator, bool> insertInternal(P&& pair) {
+        Node* parent;
+        bool left;
+        if (Node* existing = findSlot(pair.first, parent, left)) {
+            // Key already exists
+            return std::make_pair(Iterator(existing), false);
+        }
+        return std::make_pair(linkNode(new Node(std::forward<P>(pair)), parent, left), true);
+    }
+    
+    template<typename K, typename... Args>
+    std::pair<Iterator, bool> tryEmplaceInternal(K&& key, Args&&... args) {
+        Node* parent;
+        bool left;
+        if (Node* existing = findSlot(key, parent, left)) {
+            return std::make_pair(Iterator(existing), false);
         }
+        Node* node = new Node(std::piecewise_construct,
+                              std::forward_as_tuple(std::forward<K>(key)),
+                              std::forward_as_tuple(std::forward<Args>(args)...));
+        return std::make_pair(linkNode(node, parent, left), true);
+    }
+    
+    template<typename K, typename M>
+    std::pair<Iterator, bool> insertOrAssignInternal(K&& key, M&& obj) {
+        Node* parent;
+        bool left;
+        if (Node* existing = findSlot(key, parent, left)) {
+            existing->data.second = std::forward<M>(obj);
+            return std::make_pair(Iterator(existing), false);
+        }
+        Node* node = new Node(std::forward<K>(key), std::forward<M>(obj));
+        return std::make_pair(linkNode(node, parent, left), true);
+    }
+    
+    // Put child in node's place under node's parent
+    void replaceChild(Node* node, Node* child) {
+        if (child) {
+            child->parent = node->parent;
+        }
+        if (!node->parent) {
+            root = child;
+        } else if (node->parent->left == node) {
+            node->parent->left = child;
+        } else {
+            node->parent->right = child;
+        }
+    }
+    
+    // Detach node from the tree by relinking pointers, so iterators to every
+    // other element stay valid and the node itself can be reused
+    void unlinkNode(Node* node) {
+        if (node->left && node->right) {
+            // Move the in-order successor into node's position
+            Node* next = findMin(node->right);
+            if (next != node->right) {
+                replaceChild(next, next->right);
+                next->right = node->right;
+                next->right->parent = next;
+            }
+            replaceChild(node, next);
+            next->left = node->left;
+            next->left->parent = next;
+        } else {
+            replaceChild(node, node->left ? node->left : node->right);
+        }
+        
+        node->left = nullptr;
+        node->right = nullptr;
+        node->parent = nullptr;
+        --node_count;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,376 @@
+#pragma once
+#include "map.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk snapshot of a Map, read in place through mmap.
+//
+// Layout: a SnapshotHeader, then `count` fixed-size records sorted by key
+// (key field followed by value field), then a pool holding the bytes of every
+// string field. Records refer to the pool by offset, never by pointer, so a
+// file can be mapped at any address and searched without deserializing.
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t key_size;      // Bytes per key field
+    uint32_t value_size;    // Bytes per value field
+    uint64_t count;         // Number of records
+    uint64_t stamp;         // Caller-defined tag used to detect stale files
+    uint64_t pool_offset;
+    uint64_t pool_size;
+};
+
+static constexpr char snapshot_magic[8] = {'M', 'A', 'P', 'S', 'N', 'A', 'P', '1'};
+
+// How a key or value type is encoded in a record
+template<typename T, typename Enable = void>
+struct SnapshotField;
+
+// Trivially copyable types are stored inline, byte for byte
+template<typename T>
+struct SnapshotField<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+    typedef T view_type;
+    static constexpr size_t size = sizeof(T);
+
+    static void write(char* field, const T& value, std::string& pool) {
+        (void)pool;
+        memcpy(field, &value, sizeof(T));
+    }
+
+    static T read(const char* field, const char* pool, uint64_t pool_size) {
+        (void)pool;
+        (void)pool_size;
+        T value;
+        memcpy(&value, field, sizeof(T)); // Records are not aligned
+        return value;
+    }
+};
+
+// Strings are stored as (offset, length) into the pool. Each string is
+// followed by a NUL in the pool so views can be handed straight to C APIs.
+template<>
+struct SnapshotField<std::string> {
+    typedef std::string_view view_type;
+    static constexpr size_t size = 2 * sizeof(uint64_t);
+
+    static void write(char* field, std::string_view value, std::string& pool) {
+        uint64_t location[2] = {pool.size(), value.size()};
+        memcpy(field, location, sizeof(location));
+        pool.append(value);
+        pool.push_back('\0');
+    }
+
+    static std::string_view read(const char* field, const char* pool, uint64_t pool_size) {
+        uint64_t location[2];
+        memcpy(location, field, sizeof(location));
+        if (location[0] > pool_size || location[1] >= pool_size - location[0]) {
+            return std::string_view(); // Corrupt offset, treat as empty
+        }
+        return std::string_view(pool + location[0], location[1]);
+    }
+};
+
+// A string_view is written exactly like a string, so a snapshot can be built
+// from views into other storage and read back as MapView<std::string, ...>
+template<>
+struct SnapshotField<std::string_view> : SnapshotField<std::string> {};
+
+// Write count key/value pairs from [first, last), which must be sorted by
+// key without duplicates, to path as a snapshot. The file is written under a
+// temporary name and renamed into place, so concurrent readers never see a
+// partial file.
+template<typename Key, typename Value, typename ForwardIt>
+bool save_snapshot(ForwardIt first, ForwardIt last, size_t count, const std::string& path, uint64_t stamp = 0) {
+    typedef SnapshotField<Key> KeyField;
+    typedef SnapshotField<Value> ValueField;
+    const size_t record_size = KeyField::size + ValueField::size;
+
+    std::string records(count * record_size, '\0');
+    std::string pool;
+    size_t offset = 0;
+    for (; first != last && offset < records.size(); ++first) {
+        KeyField::write(&records[offset], first->first, pool);
+        ValueField::write(&records[offset + KeyField::size], first->second, pool);
+        offset += record_size;
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.key_size = KeyField::size;
+    header.value_size = ValueField::size;
+    header.count = count;
+    header.stamp = stamp;
+    header.pool_offset = sizeof(header) + records.size();
+    header.pool_size = pool.size();
+
+    std::string temp = path + ".tmp." + std::to_string(getpid());
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool ok = true;
+    const std::pair<const void*, size_t> parts[] = {
+        {&header, sizeof(header)}, {records.data(), records.size()}, {pool.data(), pool.size()}
+    };
+    for (const auto& part : parts) {
+        const char* data = static_cast<const char*>(part.first);
+        size_t remaining = part.second;
+        while (ok && remaining > 0) {
+            ssize_t written = ::write(fd, data, remaining);
+            if (written < 0) {
+                ok = false;
+            } else {
+                data += written;
+                remaining -= written;
+            }
+        }
+    }
+
+    if (::close(fd) != 0 || !ok || rename(temp.c_str(), path.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+template<typename Key, typename Value, typename Compare>
+bool save_snapshot(const Map<Key, Value, Compare>& map, const std::string& path, uint64_t stamp = 0) {
+    return save_snapshot<Key, Value>(map.begin(), map.end(), map.size(), path, stamp);
+}
+
+// Read-only view of a snapshot written by save_snapshot. Lookups binary
+// search the mapped records directly; string fields come back as
+// string_views into the mapping and stay valid until the view is closed.
+template<typename Key, typename Value>
+class MapView {
+public:
+    typedef typename SnapshotField<Key>::view_type key_type;
+    typedef typename SnapshotField<Value>::view_type mapped_type;
+    typedef std::pair<key_type, mapped_type> value_type;
+
+private:
+    typedef SnapshotField<Key> KeyField;
+    typedef SnapshotField<Value> ValueField;
+    static constexpr size_t record_size = KeyField::size + ValueField::size;
+
+    const char* base;
+    size_t length;
+    const char* records;
+    const char* pool;
+    uint64_t pool_size;
+    uint64_t count_;
+    uint64_t stamp_;
+
+    const char* record(size_t index) const {
+        return records + index * record_size;
+    }
+
+public:
+    class Iterator {
+    private:
+        const MapView* view;
+        size_t index;
+
+    public:
+        // operator-> needs somewhere to hold the decoded pair
+        struct Arrow {
+            value_type entry;
+
+            const value_type* operator->() const {
+                return &entry;
+            }
+        };
+
+        Iterator(const MapView* view = nullptr, size_t index = 0) : view(view), index(index) {}
+
+        value_type operator*() const {
+            return value_type(view->key(index), view->value(index));
+        }
+
+        Arrow operator->() const {
+            return Arrow{**this};
+        }
+
+        Iterator& operator++() {
+            ++index;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator tmp = *this;
+            ++index;
+            return tmp;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return index == other.index;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return !(*this == other);
+        }
+
+        friend class MapView;
+    };
+
+    MapView() : base(nullptr), length(0), records(nullptr), pool(nullptr),
+                pool_size(0), count_(0), stamp_(0) {}
+
+    explicit MapView(const std::string& path) : MapView() {
+        open(path);
+    }
+
+    ~MapView() {
+        close();
+    }
+
+    MapView(const MapView&) = delete;
+    MapView& operator=(const MapView&) = delete;
+
+    MapView(MapView&& other) noexcept : MapView() {
+        *this = std::move(other);
+    }
+
+    MapView& operator=(MapView&& other) noexcept {
+        if (this != &other) {
+            close();
+            base = other.base;
+            length = other.length;
+            records = other.records;
+            pool = other.pool;
+            pool_size = other.pool_size;
+            count_ = other.count_;
+            stamp_ = other.stamp_;
+            other.base = nullptr;
+            other.length = 0;
+            other.count_ = 0;
+        }
+        return *this;
+    }
+
+    // Map the snapshot at path. Returns false, leaving the view empty, if the
+    // file is missing, truncated or was written for different field types.
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+            ::close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+
+        SnapshotHeader header;
+        memcpy(&header, mapping, sizeof(header));
+        uint64_t size = st.st_size;
+        bool valid = memcmp(header.magic, snapshot_magic, sizeof(header.magic)) == 0
+            && header.key_size == KeyField::size
+            && header.value_size == ValueField::size
+            && header.count <= (size - sizeof(header)) / record_size
+            && header.pool_offset == sizeof(header) + header.count * record_size
+            && header.pool_size <= size - header.pool_offset;
+        if (!valid) {
+            munmap(mapping, st.st_size);
+            return false;
+        }
+
+        base = static_cast<const char*>(mapping);
+        length = st.st_size;
+        records = base + sizeof(header);
+        pool = base + header.pool_offset;
+        pool_size = header.pool_size;
+        count_ = header.count;
+        stamp_ = header.stamp;
+        return true;
+    }
+
+    void close() {
+        if (base) {
+            munmap(const_cast<char*>(base), length);
+        }
+        base = nullptr;
+        length = 0;
+        records = nullptr;
+        pool = nullptr;
+        pool_size = 0;
+        count_ = 0;
+        stamp_ = 0;
+    }
+
+    bool is_open() const {
+        return base != nullptr;
+    }
+
+    size_t size() const {
+        return count_;
+    }
+
+    bool empty() const {
+        return count_ == 0;
+    }
+
+    uint64_t stamp() const {
+        return stamp_;
+    }
+
+    key_type key(size_t index) const {
+        return KeyField::read(record(index), pool, pool_size);
+    }
+
+    mapped_type value(size_t index) const {
+        return ValueField::read(record(index) + KeyField::size, pool, pool_size);
+    }
+
+    Iterator begin() const {
+        return Iterator(this, 0);
+    }
+
+    Iterator end() const {
+        return Iterator(this, count_);
+    }
+
+    // First record whose key is not less than key
+    Iterator lower_bound(const key_type& key) const {
+        size_t low = 0, high = count_;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (this->key(mid) < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return Iterator(this, low);
+    }
+
+    Iterator find(const key_type& key) const {
+        Iterator it = lower_bound(key);
+        if (it.index < count_ && !(key < this->key(it.index))) {
+            return it;
+        }
+        return end();
+    }
+
+    size_t count(const key_type& key) const {
+        return find(key) != end() ? 1 : 0;
+    }
+};
@@ -0,0 +1,660 @@
+#pragma once
+#include "map.hpp"
+#include "variables.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum RedirectKind {
+    REDIRECT_IN,          // [n]<file
+    REDIRECT_OUT,         // [n]>file
+    REDIRECT_CLOBBER,     // [n]>|file, ignores noclobber
+    REDIRECT_APPEND,      // [n]>>file
+    REDIRECT_DUP,         // [n]>&m or [n]<&m
+    REDIRECT_HERE_STRING  // [n]<<<word
+};
+
+// A word as typed. Quotes and $ references are kept so that every run of the
+// command expands them afresh; a literal word is used as it is.
+struct Word {
+    std::string text;
+    bool literal; // No quotes, backslashes, $ or glob characters
+};
+
+struct RedirectionNode {
+    int fd;
+    RedirectKind kind;
+    Word target; // File name, here-string text or source descriptor
+};
+
+// A node of a parsed command line. Nodes are immutable once parsed, so one
+// tree can be shared by the parse cache, function definitions and runs that
+// are still executing it.
+struct Node {
+    enum Kind {
+        SIMPLE,    // words, assignments and redirections
+        PIPELINE,  // children joined by |
+        AND,       // children[0] && children[1]
+        OR,        // children[0] || children[1]
+        NOT,       // ! children[0]
+        SEQUENCE,  // children run in turn
+        GROUP,     // { children[0]; }
+        SUBSHELL,  // ( children[0] ), run in a forked shell
+        IF,        // condition, branch pairs, then an optional else branch
+        WHILE,     // children[0] is the condition, children[1] the body
+        UNTIL,
+        FOR,       // name takes each of words in turn for children[0]
+        FUNCTION,  // name() children[0]
+        BACKGROUND // children[0] &, with its source text as name
+    };
+
+    Kind kind;
+    std::string name;
+    std::vector<Word> words;
+    std::vector<std::pair<std::string, Word>> assignments;
+    std::vector<RedirectionNode> redirections; // Of a simple or compound command
+    std::vector<std::shared_ptr<const Node>> children;
+
+    explicit Node(Kind kind) : kind(kind) {}
+};
+
+// Recursive-descent parser for the shell's grammar: lists separated by ;, &
+// or newlines, && and ||, pipelines, simple commands with assignments and
+// redirections, { } and ( ) groups, if, while, until, for and function
+// definitions. The first word of a simple command is replaced by its alias.
+class Parser {
+public:
+    enum Status {
+        OK,
+        INCOMPLETE, // Input ended inside a construct; more lines may finish it
+        ERROR
+    };
+
+    struct Result {
+        Status status;
+        std::shared_ptr<const Node> node; // Null for a line without commands
+        std::string error;
+    };
+
+private:
+    struct Token {
+        enum Type { WORD, REDIRECT, AND_IF, OR_IF, PIPE, SEMI, AMP, LPAREN, RPAREN, NEWLINE, END };
+        Type type;
+        Word word;         // WORD, and the operator text of the others
+        int fd;            // REDIRECT
+        RedirectKind kind; // REDIRECT
+        size_t begin = 0;  // Where the token is in the source
+        size_t end = 0;
+    };
+
+    // Alias expansion stops after this many replacements of one word
+    static constexpr int max_alias_depth = 16;
+
+    const std::string& source;
+    const Map<std::string, std::string>& aliases;
+    std::vector<Token> tokens;
+    size_t pos = 0;
+    Status status = OK;
+    std::string error;
+
+    static bool isOperator(char c) {
+        return c == '|' || c == '&' || c == ';' || c == '<' || c == '>' || c == '(' || c == ')';
+    }
+
+    static Status lex(const std::string& source, std::vector<Token>& out, std::string& message) {
+        size_t i = 0;
+        for (;;) {
+            while (i < source.size() && (source[i] == ' ' || source[i] == '\t'
+                                         || (source[i] == '\\' && i + 1 < source.size() && source[i + 1] == '\n'))) {
+                i += source[i] == '\\' ? 2 : 1;
+            }
+            if (i == source.size()) {
+                out.push_back(Token{Token::END, {"end of input", true}, 0, REDIRECT_IN, i, i});
+                return OK;
+            }
+
+            char c = source[i];
+            if (c == '#') {
+                while (i < source.size() && source[i] != '\n') {
+                    ++i;
+                }
+                continue;
+            }
+            if (c == '\n') {
+                out.push_back(Token{Token::NEWLINE, {"newline", true}, 0, REDIRECT_IN, i, i + 1});
+                ++i;
+                continue;
+            }
+
+            // [n]< and [n]> operators
+            size_t digits = i;
+            while (digits < source.size() && isdigit(static_cast<unsigned char>(source[digits]))) {
+                ++digits;
+            }
+            if (digits < source.size() && (source[digits] == '<' || source[digits] == '>')) {
+                bool input = source[digits] == '<';
+                Token token{Token::REDIRECT, {}, input ? 0 : 1, input ? REDIRECT_IN : REDIRECT_OUT};
+                if (digits > i) {
+                    std::string number = source.substr(i, digits - i);
+                    errno = 0;
+                    long fd = strtol(number.c_str(), nullptr, 10);
+                    if (errno == ERANGE || fd > INT_MAX) {
+                        message = "bad file descriptor '" + number + "'";
+                        return ERROR;
+                    }
+                    token.fd = static_cast<int>(fd);
+                }
+                size_t length = 1;
+                if (source.compare(digits, 3, "<<<") == 0) {
+                    token.kind = REDIRECT_HERE_STRING;
+                    length = 3;
+                } else if (source.compare(digits, 2, "<<") == 0) {
+                    message = "here-documents are not supported";
+                    return ERROR;
+                } else if (source.compare(digits, 2, ">>") == 0) {
+                    token.kind = REDIRECT_APPEND;
+                    length = 2;
+                } else if (source.compare(digits, 2, ">|") == 0) {
+                    token.kind = REDIRECT_CLOBBER;
+                    length = 2;
+                } else if (source.compare(digits, 2, ">&") == 0 || source.compare(digits, 2, "<&") == 0) {
+                    token.kind = REDIRECT_DUP;
+                    length = 2;
+                }
+                token.word = Word{source.substr(i, digits + length - i), true};
+                token.begin = i;
+                token.end = digits + length;
+                out.push_back(std::move(token));
+                i = digits + length;
+                continue;
+            }
+
+            if (isOperator(c)) {
+                bool doubled = i + 1 < source.size() && source[i + 1] == c;
+                Token::Type type = Token::END;
+                switch (c) {
+                case '&': type = doubled ? Token::AND_IF : Token::AMP; break;
+                case '|': type = doubled ? Token::OR_IF : Token::PIPE; break;
+                case ';': type = Token::SEMI; doubled = false; break;
+                case '(': type = Token::LPAREN; doubled = false; break;
+                case ')': type = Token::RPAREN; doubled = false; break;
+                }
+                size_t length = doubled ? 2 : 1;
+                out.push_back(Token{type, {source.substr(i, length), true}, 0, REDIRECT_IN, i, i + length});
+                i += length;
+                continue;
+            }
+
+            size_t start = i;
+            bool literal = true;
+            while (i < source.size()) {
+                c = source[i];
+                if (c == ' ' || c == '\t' || c == '\n' || isOperator(c)) {
+                    break;
+                }
+                if (c == '\'') {
+                    size_t close = source.find('\'', i + 1);
+                    if (close == std::string::npos) {
+                        return INCOMPLETE;
+                    }
+                    i = close + 1;
+                    literal = false;
+                } else if (c == '"') {
+                    for (++i; i < source.size() && source[i] != '"'; ++i) {
+                        i += source[i] == '\\' ? 1 : 0;
+                    }
+                    if (i >= source.size()) {
+                        return INCOMPLETE;
+                    }
+                    ++i;
+                    literal = false;
+                } else if (c == '\\') {
+                    if (i + 1 == source.size()) {
+                        return INCOMPLETE; // Continued on the next line
+                    }
+                    i += 2;
+                    literal = false;
+                } else if (c == '$' && i + 1 < source.size() && source[i + 1] == '{') {
+                    size_t close = source.find('}', i);
+                    i = close == std::string::npos ? source.size() : close + 1;
+                    literal = false;
+                } else {
+                    literal = literal && c != '$' && c != '*' && c != '?' && c != '[';
+                    ++i;
+                }
+            }
+            out.push_back(Token{Token::WORD, {source.substr(start, i - start), literal}, 0, REDIRECT_IN, start, i});
+        }
+    }
+
+    const Token& peek() const {
+        return tokens[pos];
+    }
+
+    bool isReserved(const char* word) const {
+        const Token& token = tokens[pos];
+        return token.type == Token::WORD && token.word.literal && token.word.text == word;
+    }
+
+    // A list ends before these words, which close the construct around it
+    bool atListEnd() const {
+        static const char* const closers[] = {"}", "then", "elif", "else", "fi", "do", "done"};
+        for (const char* closer : closers) {
+            if (isReserved(closer)) {
+                return true;
+            }
+        }
+        return peek().type == Token::RPAREN || peek().type == Token::END;
+    }
+
+    void skipNewlines() {
+        while (peek().type == Token::NEWLINE) {
+            ++pos;
+        }
+    }
+
+    std::shared_ptr<Node> fail(const std::string& message) {
+        if (status == OK) {
+            // Running out of input is not an error while a line may follow
+            status = peek().type == Token::END ? INCOMPLETE : ERROR;
+            error = message;
+        }
+        return nullptr;
+    }
+
+    std::shared_ptr<Node> unexpected() {
+        return fail("syntax error near unexpected token '" + peek().word.text + "'");
+    }
+
+    bool expect(const char* word) {
+        skipNewlines();
+        if (!isReserved(word)) {
+            unexpected();
+            return false;
+        }
+        ++pos;
+        return true;
+    }
+
+    // and_or ((; | newline) and_or)*; empty only where allowed
+    std::shared_ptr<Node> parseList(bool allow_empty) {
+        auto sequence = std::make_shared<Node>(Node::SEQUENCE);
+        for (;;) {
+            if (peek().type == Token::SEMI && !sequence->children.empty()) {
+                ++pos;
+            }
+            skipNewlines();
+            if (atListEnd()) {
+                break;
+            }
+            size_t first = pos;
+            auto command = parseAndOr();
+            if (!command) {
+                return nullptr;
+            }
+            if (peek().type == Token::AMP) {
+                auto job = std::make_shared<Node>(Node::BACKGROUND);
+                job->name = source.substr(tokens[first].begin, tokens[pos - 1].end - tokens[first].begin);
+                job->children.push_back(std::move(command));
+                sequence->children.push_back(std::move(job));
+                ++pos;
+                continue;
+            }
+            sequence->children.push_back(std::move(command));
+            if (peek().type != Token::SEMI && peek().type != Token::NEWLINE && !atListEnd()) {
+                return unexpected();
+            }
+        }
+        if (sequence->children.empty()) {
+            return allow_empty ? nullptr : unexpected();
+        }
+        if (sequence->children.size() == 1) {
+            return std::const_pointer_cast<Node>(sequence->children[0]);
+        }
+        return sequence;
+    }
+
+    std::shared_ptr<Node> parseAndOr() {
+        auto left = parsePipeline();
+        while (left && (peek().type == Token::AND_IF || peek().type == Token::OR_IF)) {
+            auto node = std::make_shared<Node>(peek().type == Token::AND_IF ? Node::AND : Node::OR);
+            ++pos;
+            skipNewlines();
+            auto right = parsePipeline();
+            if (!right) {
+                return nullptr;
+            }
+            node->children = {std::move(left), std::move(right)};
+            left = std::move(node);
+        }
+        return left;
+    }
+
+    std::shared_ptr<Node> parsePipeline() {
+        bool negated = isReserved("!");
+        pos += negated ? 1 : 0;
+        auto command = parseCommand();
+        if (command && peek().type == Token::PIPE) {
+            auto pipeline = std::make_shared<Node>(Node::PIPELINE);
+            pipeline->children.push_back(std::move(command));
+            while (peek().type == Token::PIPE) {
+                ++pos;
+                skipNewlines();
+                auto next = parseCommand();
+                if (!next) {
+                    return nullptr;
+                }
+                pipeline->children.push_back(std::move(next));
+            }
+            command = std::move(pipeline);
+        }
+        if (command && negated) {
+            auto node = std::make_shared<Node>(Node::NOT);
+            node->children.push_back(std::move(command));
+            command = std::move(node);
+        }
+        return command;
+    }
+
+    bool parseRedirection(std::vector<RedirectionNode>& redirections) {
+        const Token& op = peek();
+        ++pos;
+        if (peek().type != Token::WORD) {
+            fail("syntax error: missing redirection target");
+            return false;
+        }
+        const Word& target = peek().word;
+        if (op.kind == REDIRECT_DUP && target.literal && target.text != "-"
+            && target.text.find_first_not_of("0123456789") != std::string::npos) {
+            fail("syntax error: bad file descriptor '" + target.text + "'");
+            return false;
+        }
+        redirections.push_back(RedirectionNode{op.fd, op.kind, target});
+        ++pos;
+        return true;
+    }
+
+    // Redirections after a compound command
+    bool parseRedirections(Node& node) {
+        while (peek().type == Token::REDIRECT) {
+            if (!parseRedirection(node.redirections)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::shared_ptr<Node> parseCommand() {
+        std::shared_ptr<Node> node;
+        if (isReserved("{")) {
+            ++pos;
+            node = std::make_shared<Node>(Node::GROUP);
+            auto body = parseList(false);
+            if (!body || !expect("}")) {
+                return nullptr;
+            }
+            node->children.push_back(std::move(body));
+        } else if (peek().type == Token::LPAREN) {
+            ++pos;
+            node = std::make_shared<Node>(Node::SUBSHELL);
+            auto body = parseList(false);
+            if (!body) {
+                return nullptr;
+            }
+            if (peek().type != Token::RPAREN) {
+                return unexpected();
+            }
+            ++pos;
+            node->children.push_back(std::move(body));
+        } else if (isReserved("if")) {
+            node = parseIf();
+        } else if (isReserved("while") || isReserved("until")) {
+            node = parseWhile();
+        } else if (isReserved("for")) {
+            node = parseFor();
+        } else if (peek().type == Token::WORD && peek().word.literal && tokens[pos + 1].type == Token::LPAREN) {
+            return parseFunction();
+        } else {
+            return parseSimple();
+        }
+        return node && parseRedirections(*node) ? node : nullptr;
+    }
+
+    std::shared_ptr<Node> parseIf() {
+        auto node = std::make_shared<Node>(Node::IF);
+        do {
+            ++pos; // if or elif
+            auto condition = parseList(false);
+            if (!condition || !expect("then")) {
+                return nullptr;
+            }
+            auto branch = parseList(false);
+            if (!branch) {
+                return nullptr;
+            }
+            node->children.push_back(std::move(condition));
+            node->children.push_back(std::move(branch));
+        } while (isReserved("elif"));
+        if (isReserved("else")) {
+            ++pos;
+            auto branch = parseList(false);
+            if (!branch) {
+                return nullptr;
+            }
+            node->children.push_back(std::move(branch));
+        }
+        return expect("fi") ? node : nullptr;
+    }
+
+    std::shared_ptr<Node> parseWhile() {
+        auto node = std::make_shared<Node>(isReserved("while") ? Node::WHILE : Node::UNTIL);
+        ++pos;
+        auto condition = parseList(false);
+        if (!condition || !expect("do")) {
+            return nullptr;
+        }
+        auto body = parseList(false);
+        if (!body || !expect("done")) {
+            return nullptr;
+        }
+        node->children = {std::move(condition), std::move(body)};
+        return node;
+    }
+
+    // for NAME [in word...] (; | newline) do list done
+    std::shared_ptr<Node> parseFor() {
+        auto node = std::make_shared<Node>(Node::FOR);
+        ++pos;
+        if (peek().type != Token::WORD || !peek().word.literal || !Variables::valid_name(peek().word.text)) {
+            return peek().type == Token::END ? fail("for: missing name") : unexpected();
+        }
+        node->name = peek().word.text;
+        ++pos;
+        skipNewlines();
+        if (isReserved("in")) {
+            for (++pos; peek().type == Token::WORD; ++pos) {
+                node->words.push_back(peek().word);
+            }
+            if (peek().type != Token::SEMI && peek().type != Token::NEWLINE) {
+                return unexpected();
+            }
+            ++pos;
+        } else {
+            node->words.push_back(Word{"\"$@\"", false}); // The positional parameters
+            pos += peek().type == Token::SEMI ? 1 : 0;
+        }
+        if (!expect("do")) {
+            return nullptr;
+        }
+        auto body = parseList(false);
+        if (!body || !expect("done")) {
+            return nullptr;
+        }
+        node->children.push_back(std::move(body));
+        return node;
+    }
+
+    // NAME ( ) compound-command
+    std::shared_ptr<Node> parseFunction() {
+        auto node = std::make_shared<Node>(Node::FUNCTION);
+        node->name = peek().word.text;
+        if (!Variables::valid_name(node->name)) {
+            return fail("'" + node->name + "': not a valid function name");
+        }
+        pos += 2;
+        if (peek().type != Token::RPAREN) {
+            return unexpected();
+        }
+        ++pos;
+        skipNewlines();
+        if (!isReserved("{") && !isReserved("if") && !isReserved("while") && !isReserved("until")
+            && !isReserved("for") && peek().type != Token::LPAREN) {
+            return peek().type == Token::END ? fail("missing function body") : unexpected();
+        }
+        auto body = parseCommand();
+        if (!body) {
+            return nullptr;
+        }
+        node->children.push_back(std::move(body));
+        return node;
+    }
+
+    // Replace the word at pos by the tokens of its alias, then the first of
+    // those by its own alias, and so on; no alias is used twice
+    bool expandAlias() {
+        std::vector<std::string> used;
+        while (peek().type == Token::WORD && peek().word.literal && used.size() < max_alias_depth) {
+            auto alias = aliases.find(peek().word.text);
+            if (alias == aliases.end()
+                || std::find(used.begin(), used.end(), alias->first) != used.end()) {
+                break;
+            }
+            std::vector<Token> replacement;
+            if (lex(alias->second, replacement, error) != OK) {
+                fail("alias " + alias->first + ": cannot parse '" + alias->second + "'");
+                return false;
+            }
+            replacement.pop_back(); // END
+            for (auto& token : replacement) {
+                token.begin = peek().begin;
+                token.end = peek().end;
+            }
+            used.push_back(alias->first);
+            tokens.erase(tokens.begin() + pos);
+            tokens.insert(tokens.begin() + pos, replacement.begin(), replacement.end());
+        }
+        return true;
+    }
+
+    std::shared_ptr<Node> parseSimple() {
+        if (!aliases.empty() && !expandAlias()) {
+            return nullptr;
+        }
+        if (peek().type != Token::WORD && peek().type != Token::REDIRECT) {
+            return unexpected();
+        }
+        // An alias may stand for a compound command
+        if (peek().type == Token::WORD && peek().word.literal
+            && (isReserved("{") || isReserved("if") || isReserved("while") || isReserved("until")
+                || isReserved("for"))) {
+            return parseCommand();
+        }
+
+        auto node = std::make_shared<Node>(Node::SIMPLE);
+        for (;;) {
+            const Token& token = peek();
+            if (token.type == Token::REDIRECT) {
+                if (!parseRedirection(node->redirections)) {
+                    return nullptr;
+                }
+                continue;
+            }
+            if (token.type != Token::WORD) {
+                break;
+            }
+            size_t equals = token.word.text.find('=');
+            if (node->words.empty() && equals != std::string::npos
+                && Variables::valid_name(std::string_view(token.word.text).substr(0, equals))) {
+                std::string value = token.word.text.substr(equals + 1);
+                node->assignments.emplace_back(token.word.text.substr(0, equals),
+                                               Word{value, token.word.literal});
+            } else {
+                node->words.push_back(token.word);
+            }
+            ++pos;
+        }
+        return node;
+    }
+
+public:
+    Parser(const std::string& source, const Map<std::string, std::string>& aliases)
+        : source(source), aliases(aliases) {
+        status = lex(source, tokens, error);
+    }
+
+    Result parse() {
+        if (status != OK) {
+            return Result{status, nullptr, error};
+        }
+        auto node = parseList(true);
+        if (status == OK && peek().type != Token::END) {
+            unexpected();
+        }
+        if (status != OK) {
+            return Result{status, nullptr, error};
+        }
+        return Result{OK, std::move(node), std::string()};
+    }
+};
+
+// Parsed trees by source text, so a line or script body that comes round
+// again is executed without being lexed and parsed a second time. Aliases
+// are expanded while parsing, so the cache is dropped when they change.
+class ParseCache {
+private:
+    // Past this many distinct sources the cache starts over
+    static constexpr size_t max_entries = 1024;
+
+    Map<std::string, std::shared_ptr<const Node>> entries;
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+
+public:
+    Parser::Result parse(const std::string& source, const Map<std::string, std::string>& aliases) {
+        auto it = entries.find(source);
+        if (it != entries.end()) {
+            ++hit_count;
+            return Parser::Result{Parser::OK, it->second, std::string()};
+        }
+        ++miss_count;
+        Parser::Result result = Parser(source, aliases).parse();
+        if (result.status == Parser::OK) {
+            if (entries.size() >= max_entries) {
+                entries.clear();
+            }
+            entries.try_emplace(source, result.node);
+        }
+        return result;
+    }
+
+    void clear() {
+        entries.clear();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    size_t hits() const {
+        return hit_count;
+    }
+
+    size_t misses() const {
+        return miss_count;
+    }
+};
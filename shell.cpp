@@ -1,4 +1,18 @@
 #include "map.hpp"
+#include "static_map.hpp"
+#include "chunk_pipe.hpp"
+#include "history.hpp"
+#include "line_editor.hpp"
+#include "dir_cache.hpp"
+#include "glob.hpp"
+#include "tree_ops.hpp"
+#include "text_ops.hpp"
+#include "external_sort.hpp"
+#include "file_batch.hpp"
+#include "map_snapshot.hpp"
+#include "variables.hpp"
+#include "parser.hpp"
+#include "launch.hpp"
 #include "vector.hpp"
 #include <fstream>
 #include <unistd.h>
@@ -8,290 +22,3110 @@
 #include <dirent.h>
 #include <cstring>
 #include <fcntl.h> 
+#include <sys/mman.h>
 #include <unistd.h> 
 #include <bits/stdc++.h>
 
 using namespace std;
 
+// Standard input and output of a running builtin. Builtins that run as
+// pipeline threads get their own streams; otherwise these are the shell's.
+// Diagnostics still go to cerr/perror, and a builtin that fails sets status.
+struct BuiltinIO {
+    istream& in;
+    ostream& out;
+    int status = 0; // Exit status of the builtin
+};
+
 // Function declarations for all built-in commands
-int shell_cd(vector<string> args);
-int shell_ls(vector<string> args);
-int shell_mkdir(vector<string> args);
-int shell_touch(vector<string> args);
-int shell_rm(vector<string> args);
-int shell_cp(vector<string> args);
-int shell_mv(vector<string> args);
-int shell_echo(vector<string> args);
-int shell_cat(vector<string> args);
-int shell_grep(vector<string> args);
-int shell_help(vector<string> args);
-int shell_exit(vector<string> args);
-int shell_wait(vector<string> args);
-int shell_clear(vector<string> args);
-
-// Map to associate command strings with function calls
-Map<string, int (*)(vector<string>)> command_Map = {
+int shell_cd(const vector<string>& args, BuiltinIO& io);
+int shell_alias(const vector<string>& args, BuiltinIO& io);
+int shell_unalias(const vector<string>& args, BuiltinIO& io);
+int shell_break(const vector<string>& args, BuiltinIO& io);
+int shell_return(const vector<string>& args, BuiltinIO& io);
+int shell_true(const vector<string>& args, BuiltinIO& io);
+int shell_false(const vector<string>& args, BuiltinIO& io);
+int shell_cachestats(const vector<string>& args, BuiltinIO& io);
+int shell_nice(const vector<string>& args, BuiltinIO& io);
+int shell_affinity(const vector<string>& args, BuiltinIO& io);
+int shell_ulimit(const vector<string>& args, BuiltinIO& io);
+int shell_jobs(const vector<string>& args, BuiltinIO& io);
+int shell_ls(const vector<string>& args, BuiltinIO& io);
+int shell_mkdir(const vector<string>& args, BuiltinIO& io);
+int shell_touch(const vector<string>& args, BuiltinIO& io);
+int shell_rm(const vector<string>& args, BuiltinIO& io);
+int shell_set(const vector<string>& args, BuiltinIO& io);
+int shell_export(const vector<string>& args, BuiltinIO& io);
+int shell_unset(const vector<string>& args, BuiltinIO& io);
+int shell_env(const vector<string>& args, BuiltinIO& io);
+int shell_cp(const vector<string>& args, BuiltinIO& io);
+int shell_mv(const vector<string>& args, BuiltinIO& io);
+int shell_du(const vector<string>& args, BuiltinIO& io);
+int shell_find(const vector<string>& args, BuiltinIO& io);
+int shell_echo(const vector<string>& args, BuiltinIO& io);
+int shell_cat(const vector<string>& args, BuiltinIO& io);
+int shell_head(const vector<string>& args, BuiltinIO& io);
+int shell_tail(const vector<string>& args, BuiltinIO& io);
+int shell_wc(const vector<string>& args, BuiltinIO& io);
+int shell_sort(const vector<string>& args, BuiltinIO& io);
+int shell_grep(const vector<string>& args, BuiltinIO& io);
+int shell_hash(const vector<string>& args, BuiltinIO& io);
+int shell_help(const vector<string>& args, BuiltinIO& io);
+int shell_history(const vector<string>& args, BuiltinIO& io);
+int shell_exit(const vector<string>& args, BuiltinIO& io);
+int shell_wait(const vector<string>& args, BuiltinIO& io);
+int shell_clear(const vector<string>& args, BuiltinIO& io);
+
+typedef int (*builtin_fn)(const vector<string>&, BuiltinIO&);
+
+// Built-in commands in the order `help` lists them. Each handler receives the
+// full argument vector, with the command name in args[0], and the streams to
+// use for standard input and output. Handlers return 0 only to exit the shell.
+constexpr pair<string_view, builtin_fn> builtin_list[] = {
+    {"affinity", shell_affinity},
+    {"alias", shell_alias},
+    {"break", shell_break},
+    {"cachestats", shell_cachestats},
+    {"cat", shell_cat},
     {"cd", shell_cd},
-    {"ls", shell_ls},
-    {"mkdir", shell_mkdir},
-    {"touch", shell_touch},
-    {"rm", shell_rm},
+    {"clear", shell_clear},
+    {"continue", shell_break},
     {"cp", shell_cp},
-    {"mv", shell_mv},
+    {"du", shell_du},
     {"echo", shell_echo},
-    {"cat", shell_cat},
+    {"env", shell_env},
+    {"exit", shell_exit},
+    {"export", shell_export},
+    {"false", shell_false},
+    {"find", shell_find},
     {"grep", shell_grep},
+    {"hash", shell_hash},
+    {"head", shell_head},
     {"help", shell_help},
-    {"exit", shell_exit},
+    {"history", shell_history},
+    {"jobs", shell_jobs},
+    {"ls", shell_ls},
+    {"mkdir", shell_mkdir},
+    {"mv", shell_mv},
+    {"nice", shell_nice},
+    {"return", shell_return},
+    {"rm", shell_rm},
+    {"set", shell_set},
+    {"sort", shell_sort},
+    {"tail", shell_tail},
+    {"touch", shell_touch},
+    {"true", shell_true},
+    {"ulimit", shell_ulimit},
+    {"unalias", shell_unalias},
+    {"unset", shell_unset},
     {"wait", shell_wait},
-    {"clear", shell_clear}
+    {"wc", shell_wc}
+};
+
+// Perfect-hash dispatch table built at compile time from builtin_list
+constexpr auto command_Map = make_static_map(builtin_list);
+
+// Builtins that leave the shell's own state alone and so may run as threads
+// of the shell in a pipeline. The others (cd, export, alias, history, wait,
+// ...) are forked, so that like a bash pipeline stage they cannot change the
+// shell.
+constexpr pair<string_view, bool> threadable_list[] = {
+    {"cachestats", true},
+    {"cat", true},
+    {"clear", true},
+    {"cp", true},
+    {"du", true},
+    {"echo", true},
+    {"env", true},
+    {"false", true},
+    {"find", true},
+    {"grep", true},
+    {"head", true},
+    {"help", true},
+    {"ls", true},
+    {"mkdir", true},
+    {"mv", true},
+    {"rm", true},
+    {"sort", true},
+    {"tail", true},
+    {"touch", true},
+    {"true", true},
+    {"wc", true}
+};
+constexpr auto threadable_builtins = make_static_map(threadable_list);
+
+// Options toggled with `set -o name` / `set +o name`
+Map<string, bool> shell_options = {
+    {"noclobber", false}, // `>` refuses to truncate an existing regular file
+    {"nofollow", false}   // Redirections refuse to open a symbolic link
+};
+
+// Shell variables; the exported ones are the environment of commands
+Variables shell_variables(environ);
+
+// Aliases by name; the parser replaces the first word of a command by its alias
+Map<string, string> shell_aliases;
+
+// Shell functions by name, each the parsed body it runs
+Map<string, shared_ptr<const Node>> shell_functions;
+size_t function_calls = 0;
+
+// Parsed command lines by source text
+ParseCache parse_cache;
+
+// Directory listings for pathname expansion, shared by every pattern of one
+// command line and cleared once the line has run
+DirectoryCache glob_dirs;
+
+// How far break, continue, return and exit unwind the commands being run.
+// Lists and loops check it after every command.
+enum Unwind { UNWIND_NONE, UNWIND_BREAK, UNWIND_CONTINUE, UNWIND_RETURN, UNWIND_EXIT };
+Unwind unwinding = UNWIND_NONE;
+unsigned long unwind_loops = 0; // Loops break or continue has yet to leave
+unsigned long loop_depth = 0;
+unsigned long function_depth = 0;
+
+// Calls nested deeper than this fail rather than exhaust the stack
+constexpr unsigned long max_function_depth = 1000;
+
+// Niceness, CPUs and limits every launched process gets, set by nice,
+// affinity and ulimit without a command
+LaunchSettings launch_defaults;
+
+// A command started with &
+struct Job {
+    int id;
+    pid_t pid;
+    string command;
+    bool done;
+    int status;
+};
+
+vector<Job> background_jobs;
+size_t jobs_max = 0; // Background jobs allowed to run at once; 0 for no cap
+
+// A redirection with its target expanded for one run of a command
+struct Redirection {
+    int fd;         // Descriptor being redirected
+    RedirectKind kind;
+    string target;  // File name, here-string text or source descriptor
+};
+
+// Open the file or buffer a redirection reads from or writes to
+int open_redirection(const Redirection& redirection) {
+    int nofollow = shell_options["nofollow"] ? O_NOFOLLOW : 0;
+    const char* path = redirection.target.c_str();
+    int fd = -1;
+
+    switch (redirection.kind) {
+    case REDIRECT_IN:
+        fd = open(path, O_RDONLY | O_CLOEXEC | nofollow);
+        break;
+    case REDIRECT_APPEND:
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | nofollow, 0666);
+        break;
+    case REDIRECT_CLOBBER:
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | nofollow, 0666);
+        break;
+    case REDIRECT_OUT:
+        if (!shell_options["noclobber"]) {
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | nofollow, 0666);
+            break;
+        }
+        // O_EXCL never follows a symlink, so only an existing non-regular
+        // file such as /dev/null can be opened without creating it
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd == -1 && errno == EEXIST) {
+            struct stat st;
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+                cerr << redirection.target << ": cannot overwrite existing file" << endl;
+                return -1;
+            }
+            fd = open(path, O_WRONLY | O_CLOEXEC | nofollow);
+        }
+        break;
+    case REDIRECT_HERE_STRING: {
+        fd = memfd_create("here-string", MFD_CLOEXEC);
+        string text = redirection.target + "\n";
+        if (fd != -1 && (write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size())
+                         || lseek(fd, 0, SEEK_SET) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+        break;
+    }
+    case REDIRECT_DUP:
+        return -1; // Handled by apply_redirections
+    }
+
+    if (fd == -1) {
+        perror(path);
+    }
+    return fd;
+}
+
+// Apply redirections to the current process. If saved is non-null, each
+// descriptor's original is stashed there first so restore_redirections can
+// undo the change; builtins use this to write straight to the target fd.
+bool apply_redirections(const vector<Redirection>& redirections, vector<pair<int, int>>* saved) {
+    for (const auto& redirection : redirections) {
+        if (saved) {
+            bool stashed = false;
+            for (const auto& entry : *saved) {
+                stashed = stashed || entry.first == redirection.fd;
+            }
+            if (!stashed) {
+                saved->push_back({redirection.fd, fcntl(redirection.fd, F_DUPFD_CLOEXEC, 10)});
+            }
+        }
+
+        if (redirection.kind == REDIRECT_DUP) {
+            if (redirection.target == "-") {
+                close(redirection.fd);
+                continue;
+            }
+            errno = 0;
+            char* end;
+            long target = strtol(redirection.target.c_str(), &end, 10);
+            if (errno == ERANGE || *end != '\0' || end == redirection.target.c_str()
+                || target < 0 || target > INT_MAX) {
+                cerr << redirection.target << ": bad file descriptor" << endl;
+                return false;
+            }
+            if (dup2(static_cast<int>(target), redirection.fd) == -1) {
+                perror(redirection.target.c_str());
+                return false;
+            }
+            continue;
+        }
+
+        int fd = open_redirection(redirection);
+        if (fd == -1) {
+            return false;
+        }
+        if (fd != redirection.fd) {
+            int result = dup2(fd, redirection.fd);
+            close(fd);
+            if (result == -1) {
+                perror("dup2");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void restore_redirections(vector<pair<int, int>>& saved) {
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+        if (it->second == -1) {
+            close(it->first); // Was closed before the redirection
+        } else {
+            dup2(it->second, it->first);
+            close(it->second);
+        }
+    }
+    saved.clear();
+    // A write that failed on the redirected descriptor must not leave the
+    // streams failed for the shell's own output
+    cout.clear();
+    cerr.clear();
+    clearerr(stdout);
+    clearerr(stderr);
+}
+
+// Path of a file under the shell's cache directory, creating the directory
+// on first use
+string state_file(const string& name) {
+    const char* cache = shell_variables.get("XDG_CACHE_HOME");
+    const char* home = shell_variables.get("HOME");
+    string dir;
+    if (cache && *cache) {
+        dir = cache;
+    } else if (home && *home) {
+        dir = string(home) + "/.cache";
+        mkdir(dir.c_str(), 0755);
+    } else {
+        dir = "/tmp";
+    }
+    dir += "/custom-shell";
+    mkdir(dir.c_str(), 0755);
+    return dir + "/" + name;
+}
+
+// Persisted PATH hash: command name -> full path of the first matching
+// executable on PATH. Each PATH directory has a snapshot of its own
+// executables, stamped with the directory's identity and mtime, so a change
+// to one directory rescans only that directory. Their merge in PATH order is
+// kept per PATH value, so sessions with different PATHs do not overwrite
+// each other's, and is what lookups read.
+MapView<string, string> path_index;
+
+// FNV-1a, for the stamps and file names of the PATH index
+struct PathHash {
+    uint64_t value = 1469598103934665603ull;
+
+    void mix(uint64_t bits) {
+        value ^= bits;
+        value *= 1099511628211ull;
+    }
+
+    void mix(const string& text) {
+        for (char c : text) {
+            mix(static_cast<unsigned char>(c));
+        }
+    }
+
+    string name() const {
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(value));
+        return hex;
+    }
+};
+
+// The directories of PATH in order, with "." for empty entries
+vector<string> path_directories() {
+    const char* path = shell_variables.get("PATH");
+    string dirs = path ? path : "";
+    vector<string> result;
+    for (size_t start = 0; start <= dirs.size();) {
+        size_t end = min(dirs.find(':', start), dirs.size());
+        result.push_back(end == start ? "." : dirs.substr(start, end - start));
+        start = end + 1;
+    }
+    return result;
+}
+
+// Fingerprint of a directory's inode and mtime, or 0 if it cannot be read
+uint64_t directory_stamp(const string& dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0) {
+        return 0;
+    }
+    PathHash hash;
+    hash.mix(st.st_dev);
+    hash.mix(st.st_ino);
+    hash.mix(st.st_mtim.tv_sec);
+    hash.mix(st.st_mtim.tv_nsec);
+    return hash.value | 1; // Never 0
+}
+
+// Fingerprint of PATH and each of its directories
+uint64_t path_stamp() {
+    PathHash hash;
+    const char* path = shell_variables.get("PATH");
+    hash.mix(string(path ? path : ""));
+    for (const auto& dir : path_directories()) {
+        hash.mix(directory_stamp(dir));
+    }
+    return hash.value;
+}
+
+string path_index_file() {
+    PathHash hash;
+    const char* path = shell_variables.get("PATH");
+    hash.mix(string(path ? path : ""));
+    return state_file("path-" + hash.name() + ".snap");
+}
+
+// Open the snapshot of dir's executables, scanning the directory only if
+// the snapshot is missing, stale or force is set
+bool open_directory_index(const string& dir, uint64_t stamp, bool force, MapView<string, string>& view) {
+    PathHash hash;
+    hash.mix(dir);
+    string file = state_file("pathdir-" + hash.name() + ".snap");
+    if (!force && view.open(file) && view.stamp() == stamp) {
+        return true;
+    }
+
+    Map<string, string> commands;
+    DIR* handle = opendir(dir.c_str());
+    if (handle != nullptr) {
+        dirent* entry;
+        while ((entry = readdir(handle)) != nullptr) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            string full = dir + "/" + entry->d_name;
+            struct stat st;
+            if (stat(full.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+                commands.try_emplace(entry->d_name, std::move(full));
+            }
+        }
+        closedir(handle);
+    }
+    return save_snapshot(commands, file, stamp) && view.open(file);
+}
+
+// Merge the PATH directories' snapshots, rescanning those that changed (or
+// all of them with force), and write the merged index
+void rebuild_path_index(uint64_t stamp, bool force = false) {
+    vector<MapView<string, string>> views;
+    for (const auto& dir : path_directories()) {
+        uint64_t dir_stamp = directory_stamp(dir);
+        if (dir_stamp == 0) {
+            continue;
+        }
+        views.emplace_back();
+        if (!open_directory_index(dir, dir_stamp, force, views.back())) {
+            path_index.close();
+            return;
+        }
+    }
+
+    // Earlier PATH entries win, as with execvp: a stable sort keeps equal
+    // names in PATH order and unique keeps the first
+    vector<pair<string_view, string_view>> commands;
+    for (const auto& view : views) {
+        for (const auto& entry : view) {
+            commands.push_back(entry);
+        }
+    }
+    stable_sort(commands.begin(), commands.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    commands.erase(unique(commands.begin(), commands.end(), [](const auto& a, const auto& b) {
+        return a.first == b.first;
+    }), commands.end());
+
+    string file = path_index_file();
+    if (!save_snapshot<string_view, string_view>(commands.begin(), commands.end(), commands.size(), file, stamp)
+        || !path_index.open(file)) {
+        path_index.close();
+    }
+}
+
+// Open the PATH hash, rebuilding it if PATH has changed. Cheap to call again:
+// an open index whose stamp still matches is kept as is.
+void load_path_index() {
+    uint64_t stamp = path_stamp();
+    if (path_index.is_open() && path_index.stamp() == stamp) {
+        return;
+    }
+    if (!path_index.open(path_index_file()) || path_index.stamp() != stamp) {
+        rebuild_path_index(stamp);
+    }
+}
+
+// One command of a pipeline: its expanded words and its redirections, or a
+// compound command to run in a forked shell
+struct Command {
+    vector<pair<string, string>> assignments; // NAME=value words; only external commands see them
+    vector<string> args;
+    vector<Redirection> redirections;
+    LaunchSettings launch; // From nice, affinity and ulimit prefixes
+    const Node* body = nullptr;
+};
+
+// Called after a variable is set, exported or unset
+void variable_changed(const string& name) {
+    if (name == "PATH") {
+        load_path_index();
+    }
+}
+
+bool is_assignment(const string& word) {
+    size_t equals = word.find('=');
+    return equals != string::npos && Variables::valid_name(string_view(word).substr(0, equals));
+}
+
+// nice [-n N | -N] at args[at]: returns the index after its options, or 0
+// after an error. given tells whether an adjustment was given.
+size_t parse_nice(const vector<string>& args, size_t at, int& adjustment, bool& given) {
+    size_t next = at + 1;
+    string value;
+    given = next < args.size() && args[next].size() > 1 && args[next][0] == '-'
+            && (args[next][1] == 'n' || isdigit(static_cast<unsigned char>(args[next][1])));
+    if (given && args[next] == "-n") {
+        if (next + 1 == args.size()) {
+            cerr << "nice: option requires an argument -- 'n'" << endl;
+            return 0;
+        }
+        value = args[next + 1];
+        next += 2;
+    } else if (given) {
+        value = args[next].substr(args[next][1] == 'n' ? 2 : 1);
+        ++next;
+    }
+    if (next < args.size() && args[next] == "--") {
+        ++next;
+    }
+    if (given) {
+        char* end;
+        errno = 0;
+        long number = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || errno != 0) {
+            cerr << "nice: invalid adjustment '" << value << "'" << endl;
+            return 0;
+        }
+        adjustment = static_cast<int>(max(-40L, min(40L, number)));
+    }
+    return next;
+}
+
+// affinity CPUS at args[at], the CPU list being required
+size_t parse_affinity(const vector<string>& args, size_t at, cpu_set_t& cpus) {
+    if (at + 1 == args.size()) {
+        cerr << "affinity: missing CPU list" << endl;
+        return 0;
+    }
+    if (!LaunchSettings::parse_cpus(args[at + 1], cpus)) {
+        cerr << "affinity: invalid CPU list '" << args[at + 1] << "'" << endl;
+        return 0;
+    }
+    return at + 2;
+}
+
+struct UlimitRequest {
+    const LaunchSettings::Resource* resource = &LaunchSettings::resources[2]; // -f
+    bool soft = false;
+    bool hard = false;
+    bool all = false;
+    bool has_value = false;
+    rlim_t value = 0; // In bytes
 };
 
-// Read a line from standard input
-string read_line() {
-    string input;
-    getline(cin, input);
-    return input;
+// ulimit [-H|-S] [-a | -c|-d|-f|-l|-n|-s|-t|-u|-v] [limit] at args[at]
+size_t parse_ulimit(const vector<string>& args, size_t at, UlimitRequest& request) {
+    size_t next = at + 1;
+    for (; next < args.size() && args[next].size() > 1 && args[next][0] == '-'; ++next) {
+        if (args[next] == "--") {
+            ++next;
+            break;
+        }
+        for (size_t j = 1; j < args[next].size(); ++j) {
+            char flag = args[next][j];
+            auto resource = find_if(begin(LaunchSettings::resources), end(LaunchSettings::resources),
+                                    [flag](const LaunchSettings::Resource& entry) { return entry.option == flag; });
+            if (flag == 'H' || flag == 'S') {
+                (flag == 'H' ? request.hard : request.soft) = true;
+            } else if (flag == 'a') {
+                request.all = true;
+            } else if (resource != end(LaunchSettings::resources)) {
+                request.resource = resource;
+            } else {
+                cerr << "ulimit: invalid option -- '" << flag << "'" << endl;
+                return 0;
+            }
+        }
+    }
+    if (next == args.size() || request.all) {
+        return next;
+    }
+
+    const string& value = args[next];
+    rlim_t unit = request.resource->unit;
+    if (value == "unlimited") {
+        request.value = RLIM_INFINITY;
+    } else if (!value.empty() && value.size() < 16 && value.find_first_not_of("0123456789") == string::npos) {
+        request.value = stoull(value) * unit;
+    } else {
+        cerr << "ulimit: " << value << ": invalid number" << endl;
+        return 0;
+    }
+    struct rlimit current;
+    if (getrlimit(request.resource->resource, &current) == 0 && geteuid() != 0
+        && request.value > current.rlim_max) {
+        cerr << "ulimit: " << value << ": cannot raise the limit above the hard limit" << endl;
+        return 0;
+    }
+    request.has_value = true;
+    return next + 1;
+}
+
+// Take the words that prefix a command out of args: `env NAME=value...`
+// adds assignments, and `nice [-n N]`, `affinity CPUS` and `ulimit -X LIMIT`
+// launch controls. The same builtins with no command after them are left to
+// run. False if a prefix is malformed.
+bool take_prefixes(Command& command) {
+    vector<string>& args = command.args;
+    size_t at = 0;
+    while (at < args.size()) {
+        const string& word = args[at];
+        size_t next = at + 1;
+        if (word == "env") {
+            while (next < args.size() && is_assignment(args[next])) {
+                ++next;
+            }
+            for (size_t i = at + 1; next < args.size() && i < next; ++i) {
+                size_t equals = args[i].find('=');
+                command.assignments.emplace_back(args[i].substr(0, equals), args[i].substr(equals + 1));
+            }
+        } else if (word == "nice") {
+            int adjustment = 10;
+            bool given;
+            if ((next = parse_nice(args, at, adjustment, given)) == 0) {
+                return false;
+            }
+            if (next < args.size()) {
+                command.launch.add_niceness(adjustment);
+            }
+        } else if (word == "affinity" && next < args.size()) {
+            cpu_set_t cpus;
+            if ((next = parse_affinity(args, at, cpus)) == 0) {
+                return false;
+            }
+            if (next < args.size()) {
+                command.launch.set_affinity(cpus);
+            }
+        } else if (word == "ulimit") {
+            UlimitRequest request;
+            if ((next = parse_ulimit(args, at, request)) == 0) {
+                return false;
+            }
+            if (next < args.size() && !request.has_value) {
+                cerr << "ulimit: a limit must come before the command" << endl;
+                return false;
+            }
+            if (next < args.size()) {
+                bool both = request.soft == request.hard;
+                command.launch.set_limit(request.resource->resource, request.value, request.soft || both,
+                                         request.hard || both);
+            }
+        } else {
+            break;
+        }
+        if (next == args.size()) {
+            break; // No command: the builtin itself runs
+        }
+        at = next;
+    }
+    args.erase(args.begin(), args.begin() + at);
+    return true;
+}
+
+// In a child about to exec: put a command's assignments in its environment
+void export_assignments(const Command& command) {
+    for (const auto& assignment : command.assignments) {
+        shell_variables.set(assignment.first, assignment.second, true);
+    }
+}
+
+// Replace the current (child) process with an external command
+[[noreturn]] void exec_command(const vector<string>& args) {
+    signal(SIGPIPE, SIG_DFL); // The shell ignores SIGPIPE; commands should not
+
+    vector<char*> c_args(args.size() + 1);
+    for (size_t i = 0; i < args.size(); i++) {
+        c_args[i] = const_cast<char*>(args[i].c_str());
+    }
+    c_args[args.size()] = NULL;
+
+    char* const* envp = shell_variables.envp();
+    if (args[0].find('/') != string::npos) {
+        execve(c_args[0], c_args.data(), envp);
+    } else {
+        auto cached = path_index.find(args[0]);
+        if (cached != path_index.end()) {
+            execve(cached->second.data(), c_args.data(), envp);
+        }
+        // Not indexed, or the index is out of date: search $PATH as execvp would
+        const char* path = shell_variables.get("PATH");
+        string dirs = path ? path : "/bin:/usr/bin";
+        for (size_t start = 0; start <= dirs.size();) {
+            size_t end = min(dirs.find(':', start), dirs.size());
+            string dir = end == start ? "." : dirs.substr(start, end - start);
+            execve((dir + "/" + args[0]).c_str(), c_args.data(), envp);
+            start = end + 1;
+        }
+    }
+    cerr << "Command not found" << endl;
+    _exit(127);
+}
+
+// Run a builtin against the current process's stdin and stdout and return
+// its status
+int run_builtin(builtin_fn builtin, const vector<string>& args) {
+    FdStreamBuf stdin_buf(STDIN_FILENO, false);
+    istream input(&stdin_buf);
+    BuiltinIO io{input, cout};
+    if (builtin(args, io) == 0) {
+        unwinding = UNWIND_EXIT;
+    }
+    // Output that could not be written (a full disk, a closed pipe) fails
+    // the builtin, as it would an external command
+    if (!cout.flush()) {
+        cerr << args[0] << ": write error: " << strerror(errno) << endl;
+        io.status = io.status != 0 ? io.status : 1;
+        cout.clear();
+        clearerr(stdout);
+    }
+    return io.status;
+}
+
+// A child's exit status, or 128 + the signal that killed it
+int exit_status(int status) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// Status of a child once it ends
+int wait_status(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        return 1;
+    }
+    return exit_status(status);
+}
+
+// In a process forked to run commands: apply the launch defaults, unless a
+// parent process already did, and then a command's own controls
+bool apply_launch(const LaunchSettings& settings) {
+    static bool defaults_applied = false;
+    if (!defaults_applied) {
+        defaults_applied = true;
+        if (!launch_defaults.apply()) {
+            return false;
+        }
+    }
+    return settings.apply();
+}
+
+int execute_node(const Node& node);
+
+// Run a shell function with the command's arguments as $1, $2...
+int call_function(const Node& body, const Command& command) {
+    if (function_depth >= max_function_depth) {
+        cerr << command.args[0] << ": maximum function nesting level exceeded" << endl;
+        return 1;
+    }
+    vector<pair<int, int>> saved;
+    cout.flush();
+    cerr.flush();
+    int status = 1;
+    if (apply_redirections(command.redirections, &saved)) {
+        vector<string> outer = shell_variables.swap_arguments(vector<string>(command.args.begin() + 1, command.args.end()));
+        ++function_depth;
+        ++function_calls;
+        status = execute_node(body);
+        --function_depth;
+        if (unwinding == UNWIND_RETURN) {
+            unwinding = UNWIND_NONE;
+        }
+        shell_variables.swap_arguments(std::move(outer));
+    }
+    cout.flush();
+    cerr.flush();
+    restore_redirections(saved);
+    return status;
+}
+
+// Execute a single function, shell built-in or external command. With
+// replace, the calling process was forked for the command: its launch
+// controls apply to the process itself, and an external command is exec'd
+// in place.
+int execute_command(Command& command, bool replace = false) {
+    const vector<string>& args = command.args;
+    const vector<Redirection>& redirections = command.redirections;
+
+    if (!command.launch.empty() && !replace) {
+        // The controls need a process of their own, even for a builtin
+        cout.flush();
+        cerr.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = execute_command(command, true);
+            cout.flush();
+            _exit(status);
+        } else if (pid < 0) {
+            cerr << "Failed to fork" << endl;
+            return 1;
+        }
+        return wait_status(pid);
+    }
+    if (replace && !apply_launch(command.launch)) {
+        return EXIT_FAILURE;
+    }
+
+    auto function = shell_functions.find(args[0]);
+    if (function != shell_functions.end()) {
+        shared_ptr<const Node> body = function->second; // Kept if the function redefines itself
+        return call_function(*body, command);
+    }
+    if (const builtin_fn* builtin = command_Map.find(args[0])) {
+        if (redirections.empty()) {
+            return run_builtin(*builtin, args);
+        }
+        vector<pair<int, int>> saved;
+        cout.flush();
+        cerr.flush();
+        int status = 1;
+        if (apply_redirections(redirections, &saved)) {
+            status = run_builtin(*builtin, args);
+        }
+        cout.flush();
+        cerr.flush();
+        restore_redirections(saved);
+        return status;
+    }
+
+    if (replace) {
+        if (!apply_redirections(redirections, nullptr)) {
+            return EXIT_FAILURE;
+        }
+        export_assignments(command);
+        exec_command(args);
+    }
+
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!apply_redirections(redirections, nullptr) || !apply_launch(command.launch)) {
+            _exit(EXIT_FAILURE);
+        }
+        export_assignments(command);
+        exec_command(args);
+    } else if (pid < 0) {
+        cerr << "Failed to fork" << endl;
+        return 1;
+    }
+    return wait_status(pid);
+}
+
+// A builtin stage can run as a thread when it leaves the shell's state alone
+// and its redirections only replace its own stdin or stdout, which the
+// thread can open without touching the shell's descriptors
+bool runs_in_thread(const Command& command) {
+    if (command.body || !command.launch.empty() || shell_functions.count(command.args[0])
+        || !threadable_builtins.contains(command.args[0])) {
+        return false;
+    }
+    for (const auto& redirection : command.redirections) {
+        if (redirection.kind == REDIRECT_DUP || redirection.fd > STDOUT_FILENO) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run a pipeline. Adjacent builtin stages run as threads of the shell joined
+// by ChunkPipes; a real pipe is only created where a stage has to be forked.
+// The pipeline's status is that of its last stage.
+int execute_pipeline(vector<Command>& commands) {
+    size_t count = commands.size();
+    vector<bool> threaded(count);
+    for (size_t i = 0; i < count; ++i) {
+        threaded[i] = runs_in_thread(commands[i]);
+    }
+
+    // Pipe ends per stage, -1 where the stage uses the shell's own stdin or
+    // stdout or an in-process ChunkPipe. chunk_pipes[i] links stage i to i + 1.
+    vector<int> in_fds(count, -1), out_fds(count, -1), pipe_fds;
+    vector<unique_ptr<ChunkPipe>> chunk_pipes(count);
+    for (size_t i = 0; i + 1 < count; ++i) {
+        if (threaded[i] && threaded[i + 1]) {
+            chunk_pipes[i].reset(new ChunkPipe);
+            continue;
+        }
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            perror("pipe");
+            for (int fd : pipe_fds) {
+                close(fd);
+            }
+            return 1;
+        }
+        in_fds[i + 1] = fds[0];
+        out_fds[i] = fds[1];
+        pipe_fds.push_back(fds[0]);
+        pipe_fds.push_back(fds[1]);
+    }
+
+    // Fork every stage that needs a process before any thread starts
+    cout.flush();
+    cerr.flush();
+    vector<int> statuses(count, 1);
+    vector<pair<size_t, pid_t>> children;
+    for (size_t i = 0; i < count; ++i) {
+        if (threaded[i]) {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (in_fds[i] != -1) {
+                dup2(in_fds[i], STDIN_FILENO);
+            }
+            if (out_fds[i] != -1) {
+                dup2(out_fds[i], STDOUT_FILENO);
+            }
+            for (int fd : pipe_fds) {
+                close(fd);
+            }
+            int status = EXIT_FAILURE;
+            if (!commands[i].body) {
+                status = execute_command(commands[i], true);
+            } else if (apply_launch(LaunchSettings())) {
+                status = execute_node(*commands[i].body);
+            }
+            cout.flush();
+            _exit(status);
+        } else if (pid < 0) {
+            cerr << "Failed to fork" << endl;
+        } else {
+            children.emplace_back(i, pid);
+        }
+        // The child holds its own copies of these ends now
+        if (in_fds[i] != -1) {
+            close(in_fds[i]);
+        }
+        if (out_fds[i] != -1) {
+            close(out_fds[i]);
+        }
+    }
+
+    vector<thread> threads;
+    for (size_t i = 0; i < count; ++i) {
+        if (!threaded[i]) {
+            continue;
+        }
+        unique_ptr<streambuf> in_buf, out_buf;
+        if (i > 0 && chunk_pipes[i - 1]) {
+            in_buf.reset(new ChunkPipeReader(*chunk_pipes[i - 1]));
+        } else {
+            bool owned = in_fds[i] != -1;
+            in_buf.reset(new FdStreamBuf(owned ? in_fds[i] : STDIN_FILENO, owned));
+        }
+        if (chunk_pipes[i]) {
+            out_buf.reset(new ChunkPipeWriter(*chunk_pipes[i]));
+        } else {
+            bool owned = out_fds[i] != -1;
+            out_buf.reset(new FdStreamBuf(owned ? out_fds[i] : STDOUT_FILENO, owned));
+        }
+
+        // Replacing a pipe end closes it, so the neighbour sees EOF or EPIPE
+        bool opened = true;
+        for (const auto& redirection : commands[i].redirections) {
+            int fd = open_redirection(redirection);
+            if (fd == -1) {
+                opened = false;
+                break;
+            }
+            (redirection.fd == STDIN_FILENO ? in_buf : out_buf).reset(new FdStreamBuf(fd, true));
+        }
+        if (!opened) {
+            continue;
+        }
+
+        builtin_fn builtin = *command_Map.find(commands[i].args[0]);
+        const vector<string>& args = commands[i].args;
+        int& status = statuses[i];
+        threads.emplace_back([builtin, &args, &status, in_buf = std::move(in_buf), out_buf = std::move(out_buf)]() mutable {
+            {
+                istream input(in_buf.get());
+                ostream output(out_buf.get());
+                BuiltinIO io{input, output};
+                builtin(args, io);
+                output.flush();
+                status = io.status;
+            }
+            // Close both ends as soon as the stage finishes
+            in_buf.reset();
+            out_buf.reset();
+        });
+    }
+
+    for (auto& stage : threads) {
+        stage.join();
+    }
+    for (const auto& child : children) {
+        statuses[child.first] = wait_status(child.second);
+    }
+    return statuses.back();
+}
+
+// The shell's command history, opened on first use. The log lives at
+// $HISTFILE or ~/.custom_shell_history; its index is a cache file.
+History& shell_history() {
+    static History history([] {
+        const char* file = shell_variables.get("HISTFILE");
+        const char* home = shell_variables.get("HOME");
+        if (file && *file) {
+            return string(file);
+        }
+        return home && *home ? string(home) + "/.custom_shell_history" : state_file("history");
+    }(), state_file("history.snap"));
+    return history;
+}
+
+// A command read over several lines, as one history entry. Comments are
+// dropped and each newline becomes "; ", or just a space after something
+// the command continues from (a pipe, &&, &, {, do, then...). Returns ""
+// if a newline is quoted, since an entry cannot hold one.
+string history_entry(const string& source) {
+    auto continues = [](const string& text) {
+        static const char* const openers[] = {"do", "then", "else", "!"};
+        char last = text.back();
+        if (last == '|' || last == '&' || last == ';' || last == '(' || last == '{'
+            || (last == ')' && text.size() >= 2 && text[text.size() - 2] == '(')) {
+            return true;
+        }
+        size_t start = text.find_last_of(" \t;") + 1; // npos + 1 is 0
+        for (const char* opener : openers) {
+            if (text.compare(start, string::npos, opener) == 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    string entry;
+    char quote = 0;
+    for (size_t i = 0; i < source.size(); ++i) {
+        char c = source[i];
+        if (c == '\\' && quote != '\'' && i + 1 < source.size()) {
+            if (source[i + 1] == '\n') {
+                ++i; // A line continuation
+                continue;
+            }
+            entry += c;
+            c = source[++i];
+        } else if (quote != 0) {
+            quote = c == quote ? 0 : quote;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '#' && (entry.empty() || strchr(" \t|&;<>()", entry.back()))) {
+            i = min(source.find('\n', i), source.size()) - 1; // A comment
+            continue;
+        } else if (c == '\n') {
+            while (!entry.empty() && (entry.back() == ' ' || entry.back() == '\t')) {
+                entry.pop_back();
+            }
+            if (!entry.empty()) {
+                entry += continues(entry) ? " " : "; ";
+            }
+            continue;
+        }
+        if (c == '\n') {
+            return "";
+        }
+        entry += c;
+    }
+    while (!entry.empty() && (entry.back() == ' ' || entry.back() == '\t')) {
+        entry.pop_back();
+    }
+    return entry;
+}
+
+// Expand history references at the start of a word: !! (previous command),
+// !n (entry n), !-n (n entries back) and !prefix (latest entry starting with
+// prefix). Returns false if a reference matches nothing.
+bool expand_history(string& line) {
+    string expanded;
+    bool changed = false;
+    size_t i = 0;
+    while (i < line.size()) {
+        bool word_start = i == 0 || line[i - 1] == ' ';
+        if (line[i] != '!' || !word_start || i + 1 >= line.size()
+            || line[i + 1] == ' ' || line[i + 1] == '=') {
+            expanded += line[i++];
+            continue;
+        }
+
+        size_t end = line.find(' ', i);
+        if (end == string::npos) {
+            end = line.size();
+        }
+        string designator = line.substr(i + 1, end - i - 1);
+        History& history = shell_history();
+        uint64_t entry = History::npos;
+        if (designator[0] == '!') {
+            entry = history.last();
+            end = i + 2; // Anything after !! is kept as typed
+        } else if (designator.find_first_not_of("0123456789") == string::npos) {
+            // A number too big for unsigned long matches no entry either
+            errno = 0;
+            unsigned long n = strtoul(designator.c_str(), nullptr, 10);
+            entry = errno == ERANGE ? History::npos : history.nth(n);
+        } else if (designator[0] == '-' && designator.size() > 1
+                   && designator.find_first_not_of("0123456789", 1) == string::npos) {
+            errno = 0;
+            unsigned long n = strtoul(designator.c_str() + 1, nullptr, 10);
+            entry = errno == ERANGE || n == 0 ? History::npos : history.last();
+            for (; n > 1 && entry != History::npos; --n) {
+                entry = history.previous(entry);
+            }
+        } else {
+            entry = history.latest_with_prefix(designator);
+        }
+
+        if (entry == History::npos) {
+            cerr << "!" << designator << ": event not found" << endl;
+            return false;
+        }
+        expanded += history.at(entry);
+        changed = true;
+        i = end;
+    }
+
+    if (changed) {
+        line = std::move(expanded);
+        cout << line << endl; // Show the command that will run
+    }
+    return true;
+}
+
+// Directory listings used by file name completion
+DirectoryCache completion_dirs;
+
+// Tab completion: command names (builtins and the PATH hash) for the first
+// word of a command, file names everywhere else
+void complete_word(const string& line, size_t word_start, size_t cursor, vector<string>& out) {
+    string word = line.substr(word_start, cursor - word_start);
+    size_t previous = line.find_last_not_of(' ', word_start == 0 ? string::npos : word_start - 1);
+    // A new command starts after |, ||, &&, &, ; and (, but not after the
+    // >& of a redirection, and after { when it stands alone as a group
+    char before = previous == string::npos || previous == 0 ? ' ' : line[previous - 1];
+    bool command_position = word_start == 0 || previous == string::npos
+        || line[previous] == '|' || line[previous] == ';' || line[previous] == '('
+        || (line[previous] == '&' && before != '>' && before != '<')
+        || (line[previous] == '{' && strchr(" |&;(", before) != nullptr);
+
+    if (command_position && word.find('/') == string::npos) {
+        for (const auto& builtin : command_Map) {
+            if (builtin.first.compare(0, word.size(), word) == 0) {
+                out.emplace_back(builtin.first);
+            }
+        }
+        load_path_index();
+        for (auto it = path_index.lower_bound(word); it != path_index.end(); ++it) {
+            string_view name = it->first;
+            if (name.compare(0, word.size(), word) != 0) {
+                break;
+            }
+            out.emplace_back(name);
+        }
+        return;
+    }
+
+    size_t slash = word.rfind('/');
+    string dir = slash == string::npos ? "" : word.substr(0, slash + 1);
+    string prefix = slash == string::npos ? word : word.substr(slash + 1);
+    const DirectoryCache::Listing* listing = completion_dirs.get(dir);
+    if (listing == nullptr) {
+        return;
+    }
+    for (auto it = listing->entries.lower_bound(prefix); it != listing->entries.end(); ++it) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0) {
+            break;
+        }
+        if (prefix.empty() && it->first[0] == '.') {
+            continue; // Hidden files only when asked for
+        }
+        out.push_back(dir + it->first + (it->second.directory ? "/" : ""));
+    }
+}
+
+// Read a line of input, with editing when attached to a terminal. Returns
+// false at end of input.
+bool read_line(const string& prompt, string& line) {
+    if (LineEditor::interactive()) {
+        static LineEditor editor(shell_history(), complete_word);
+        return editor.read(prompt, line);
+    }
+    cout << prompt << flush;
+    return static_cast<bool>(getline(cin, line));
+}
+
+// Expand a word for one run of its command and append the fields it makes.
+// Quotes are removed and $ references replaced; where an unquoted glob
+// character is left, the word becomes the sorted paths it matches, if any.
+// An unquoted word that expands to nothing makes no field, and "$@" makes
+// one per positional parameter. Without pathnames there is always exactly
+// one field and no globbing, as for an assignment's value.
+void expand_word(const Word& word, vector<string>& fields, bool pathnames = true) {
+    if (word.literal) {
+        fields.push_back(word.text);
+        return;
+    }
+    const string& text = word.text;
+    if (pathnames && text == "\"$@\"") {
+        const vector<string>& arguments = shell_variables.positional();
+        fields.insert(fields.end(), arguments.begin(), arguments.end());
+        return;
+    }
+
+    // pattern is value with quoted glob characters escaped for Glob
+    string value, pattern, expansion;
+    bool quoted = false, magic = false;
+    auto add = [&](char c, bool in_quotes) {
+        bool special = c == '*' || c == '?' || c == '[';
+        if (in_quotes && (special || c == '\\')) {
+            pattern += '\\';
+        }
+        magic = magic || (special && !in_quotes);
+        pattern += c;
+        value += c;
+    };
+    auto add_reference = [&](size_t& i, bool in_quotes) {
+        expansion.clear();
+        i = shell_variables.expand_at(text, i, expansion);
+        for (char c : expansion) {
+            add(c, in_quotes);
+        }
+    };
+
+    for (size_t i = 0; i < text.size();) {
+        char c = text[i];
+        if (c == '\'') {
+            size_t close = text.find('\'', i + 1);
+            for (size_t j = i + 1; j < close; ++j) {
+                add(text[j], true);
+            }
+            quoted = true;
+            i = close + 1;
+        } else if (c == '"') {
+            quoted = true;
+            for (++i; i < text.size() && text[i] != '"';) {
+                if (text[i] == '\\' && i + 1 < text.size() && string_view("$`\"\\\n").find(text[i + 1]) != string_view::npos) {
+                    if (text[i + 1] != '\n') {
+                        add(text[i + 1], true);
+                    }
+                    i += 2;
+                } else if (text[i] == '$') {
+                    add_reference(i, true);
+                } else {
+                    add(text[i++], true);
+                }
+            }
+            ++i;
+        } else if (c == '\\' && i + 1 < text.size()) {
+            if (text[i + 1] != '\n') {
+                add(text[i + 1], true);
+            }
+            i += 2;
+        } else if (c == '$') {
+            add_reference(i, false);
+        } else {
+            add(text[i++], false);
+        }
+    }
+
+    if (!pathnames) {
+        fields.push_back(std::move(value));
+        return;
+    }
+    if (value.empty() && !quoted) {
+        return;
+    }
+    size_t before = fields.size();
+    if (magic) {
+        Glob(pattern).expand(glob_dirs, fields);
+    }
+    if (fields.size() == before) {
+        fields.push_back(std::move(value));
+    }
+}
+
+// Expand redirection targets; each must make exactly one word
+bool expand_redirections(const vector<RedirectionNode>& nodes, vector<Redirection>& redirections) {
+    for (const auto& node : nodes) {
+        vector<string> fields;
+        expand_word(node.target, fields, node.kind != REDIRECT_HERE_STRING);
+        if (fields.size() != 1) {
+            cerr << node.target.text << ": ambiguous redirect" << endl;
+            return false;
+        }
+        if (node.kind == REDIRECT_DUP && fields[0] != "-"
+            && (fields[0].empty() || fields[0].find_first_not_of("0123456789") != string::npos)) {
+            cerr << fields[0] << ": bad file descriptor" << endl;
+            return false;
+        }
+        redirections.push_back(Redirection{node.fd, node.kind, std::move(fields[0])});
+    }
+    return true;
+}
+
+// Expand a simple command's words, assignments and redirections for a run
+bool expand_command(const Node& node, Command& command) {
+    for (const auto& word : node.words) {
+        expand_word(word, command.args);
+    }
+    for (const auto& assignment : node.assignments) {
+        vector<string> value;
+        expand_word(assignment.second, value, false);
+        command.assignments.emplace_back(assignment.first, std::move(value[0]));
+    }
+    return expand_redirections(node.redirections, command.redirections) && take_prefixes(command);
+}
+
+int execute_simple(const Node& node, bool replace = false) {
+    Command command;
+    if (!expand_command(node, command)) {
+        return 1;
+    }
+    if (!command.args.empty()) {
+        return execute_command(command, replace);
+    }
+
+    // Only assignments, which set shell variables, and redirections, which
+    // are opened and closed again
+    for (const auto& assignment : command.assignments) {
+        shell_variables.set(assignment.first, assignment.second);
+        variable_changed(assignment.first);
+    }
+    vector<pair<int, int>> saved;
+    bool opened = apply_redirections(command.redirections, &saved);
+    restore_redirections(saved);
+    return opened ? 0 : 1;
+}
+
+int execute_pipeline(const Node& node) {
+    vector<Command> commands(node.children.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        const Node& stage = *node.children[i];
+        if (stage.kind != Node::SIMPLE) {
+            commands[i].body = &stage;
+            continue;
+        }
+        if (!expand_command(stage, commands[i])) {
+            return 1;
+        }
+        if (commands[i].args.empty()) {
+            commands[i] = Command();
+            commands[i].body = &stage;
+        }
+    }
+    return execute_pipeline(commands);
+}
+
+// After a loop body or condition: false when break, return or exit ends the
+// loop. A break or continue for an outer loop passes on to it.
+bool loop_continues() {
+    if (unwinding == UNWIND_BREAK || unwinding == UNWIND_CONTINUE) {
+        bool next = unwinding == UNWIND_CONTINUE && unwind_loops == 1;
+        if (--unwind_loops == 0) {
+            unwinding = UNWIND_NONE;
+        }
+        return next;
+    }
+    return unwinding == UNWIND_NONE;
+}
+
+int execute_loop(const Node& node) {
+    int status = 0;
+    ++loop_depth;
+    if (node.kind == Node::FOR) {
+        vector<string> values;
+        for (const auto& word : node.words) {
+            expand_word(word, values);
+        }
+        for (const auto& value : values) {
+            shell_variables.set(node.name, value);
+            variable_changed(node.name);
+            status = execute_node(*node.children[0]);
+            if (!loop_continues()) {
+                break;
+            }
+        }
+    } else {
+        for (;;) {
+            int condition = execute_node(*node.children[0]);
+            if (unwinding != UNWIND_NONE) {
+                if (loop_continues()) {
+                    continue;
+                }
+                break;
+            }
+            if ((condition == 0) != (node.kind == Node::WHILE)) {
+                break;
+            }
+            status = execute_node(*node.children[1]);
+            if (!loop_continues()) {
+                break;
+            }
+        }
+    }
+    --loop_depth;
+    return status;
+}
+
+int execute_compound(const Node& node) {
+    switch (node.kind) {
+    case Node::GROUP:
+        return execute_node(*node.children[0]);
+    case Node::SUBSHELL: {
+        cout.flush();
+        cerr.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            background_jobs.clear();
+            int status = apply_launch(LaunchSettings()) ? execute_node(*node.children[0]) : EXIT_FAILURE;
+            cout.flush();
+            _exit(status);
+        } else if (pid < 0) {
+            cerr << "Failed to fork" << endl;
+            return 1;
+        }
+        return wait_status(pid);
+    }
+    case Node::IF: {
+        size_t i = 0;
+        for (; i + 1 < node.children.size(); i += 2) {
+            int status = execute_node(*node.children[i]);
+            if (unwinding != UNWIND_NONE) {
+                return status;
+            }
+            if (status == 0) {
+                return execute_node(*node.children[i + 1]);
+            }
+        }
+        return i < node.children.size() ? execute_node(*node.children[i]) : 0;
+    }
+    default:
+        return execute_loop(node);
+    }
+}
+
+// Collect the background jobs that have ended, without blocking
+void update_jobs() {
+    for (auto& job : background_jobs) {
+        int status;
+        if (!job.done && waitpid(job.pid, &status, WNOHANG) == job.pid) {
+            job.done = true;
+            job.status = exit_status(status);
+        }
+    }
+}
+
+// Block until one of the running jobs ends; false if none is running
+bool wait_for_job() {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    for (auto& job : background_jobs) {
+        if (job.pid == pid) {
+            job.done = true;
+            job.status = exit_status(status);
+        }
+    }
+    return pid > 0;
+}
+
+string job_state(const Job& job) {
+    if (!job.done) {
+        return "Running";
+    }
+    return job.status == 0 ? "Done" : "Exit " + to_string(job.status);
+}
+
+// Forget the jobs that have ended once they have been reported
+void forget_ended_jobs() {
+    auto ended = remove_if(background_jobs.begin(), background_jobs.end(), [](const Job& job) {
+        return job.done;
+    });
+    background_jobs.erase(ended, background_jobs.end());
+}
+
+// Before a prompt: tell the user which jobs have ended. A script learns of
+// them through wait or jobs instead.
+void report_jobs() {
+    if (!LineEditor::interactive()) {
+        return;
+    }
+    update_jobs();
+    for (const auto& job : background_jobs) {
+        if (job.done) {
+            cerr << "[" << job.id << "]  " << job_state(job) << "  " << job.command << endl;
+        }
+    }
+    forget_ended_jobs();
+}
+
+// Start a command given with &. With jobs.max jobs already running, first
+// wait for one of them to end.
+int execute_background(const Node& node) {
+    update_jobs();
+    for (;;) {
+        size_t running = count_if(background_jobs.begin(), background_jobs.end(), [](const Job& job) { return !job.done; });
+        if (jobs_max == 0 || running < jobs_max || !wait_for_job()) {
+            break;
+        }
+    }
+
+    cout.flush();
+    cerr.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        background_jobs.clear();
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO); // Jobs do not read from the terminal
+            close(null_fd);
+        }
+        int status = EXIT_FAILURE;
+        const Node& job = *node.children[0];
+        if (apply_launch(LaunchSettings())) {
+            status = job.kind == Node::SIMPLE ? execute_simple(job, true) : execute_node(job);
+        }
+        cout.flush();
+        _exit(status);
+    } else if (pid < 0) {
+        cerr << "Failed to fork" << endl;
+        return 1;
+    }
+
+    int id = 1;
+    for (const auto& job : background_jobs) {
+        id = max(id, job.id + 1);
+    }
+    background_jobs.push_back(Job{id, pid, node.name, false, 0});
+    shell_variables.set_background(pid);
+    if (LineEditor::interactive()) {
+        cerr << "[" << id << "] " << pid << endl;
+    }
+    return 0;
+}
+
+// Run a parsed command and return its status, which becomes $?
+int execute_node(const Node& node) {
+    int status = 0;
+    switch (node.kind) {
+    case Node::SIMPLE:
+        status = execute_simple(node);
+        break;
+    case Node::PIPELINE:
+        status = execute_pipeline(node);
+        break;
+    case Node::AND:
+    case Node::OR:
+        status = execute_node(*node.children[0]);
+        if (unwinding == UNWIND_NONE && (status == 0) == (node.kind == Node::AND)) {
+            status = execute_node(*node.children[1]);
+        }
+        break;
+    case Node::NOT:
+        status = execute_node(*node.children[0]) == 0 ? 1 : 0;
+        break;
+    case Node::SEQUENCE:
+        for (const auto& child : node.children) {
+            status = execute_node(*child);
+            if (unwinding != UNWIND_NONE) {
+                break;
+            }
+        }
+        break;
+    case Node::FUNCTION:
+        shell_functions.insert_or_assign(node.name, node.children[0]);
+        break;
+    case Node::BACKGROUND:
+        status = execute_background(node);
+        break;
+    default:
+        if (node.redirections.empty()) {
+            status = execute_compound(node);
+            break;
+        }
+        {
+            vector<Redirection> redirections;
+            vector<pair<int, int>> saved;
+            cout.flush();
+            cerr.flush();
+            status = 1;
+            if (expand_redirections(node.redirections, redirections) && apply_redirections(redirections, &saved)) {
+                status = execute_compound(node);
+            }
+            cout.flush();
+            cerr.flush();
+            restore_redirections(saved);
+        }
+    }
+    shell_variables.set_status(status);
+    return status;
+}
+
+// Command loop for shell input/output. A line that leaves a quote or a
+// construct open is continued on the next one; the whole text is then
+// parsed, or found in the parse cache, and executed. Returns the status
+// the shell exits with.
+int shell_loop() {
+    // Only commands typed at a terminal go into the history or have history
+    // references expanded; a script's lines are run as they are
+    bool interactive = LineEditor::interactive();
+    string line, source;
+    while (unwinding != UNWIND_EXIT) {
+        unwinding = UNWIND_NONE;
+        if (source.empty()) {
+            report_jobs();
+        }
+        if (!read_line(source.empty() ? "> " : "... ", line)) {
+            if (!source.empty()) {
+                cerr << "syntax error: unexpected end of input" << endl;
+            }
+            cout << endl;
+            break;
+        }
+        if (interactive && !expand_history(line)) {
+            continue;
+        }
+        source += line;
+
+        Parser::Result parsed = parse_cache.parse(source, shell_aliases);
+        if (parsed.status == Parser::INCOMPLETE) {
+            source += '\n';
+            continue;
+        }
+        if (interactive) {
+            shell_history().add(history_entry(source));
+        }
+        source.clear();
+        if (parsed.status == Parser::ERROR) {
+            cerr << parsed.error << endl;
+            shell_variables.set_status(2);
+        } else if (parsed.node) {
+            execute_node(*parsed.node);
+            glob_dirs.clear();
+        }
+    }
+    return shell_variables.status();
+}
+
+// Main entry point for the shell
+int main() {
+    signal(SIGPIPE, SIG_IGN); // Pipeline threads see EPIPE instead
+    load_path_index();
+    return shell_loop();
+}
+
+// Implementation of built-in shell commands
+int shell_cd(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() > 2) {
+        cerr << "cd: too many arguments" << endl;
+        io.status = 1;
+        return 1;
+    }
+    const char* home = shell_variables.get("HOME");
+    string dir = args.size() < 2 ? (home ? home : "/") : args[1];
+    if (chdir(dir.c_str()) != 0) {
+        perror("cd");
+        io.status = 1;
+    }
+    return 1;
+}
+
+int shell_ls(const vector<string>& args, BuiltinIO& io) {
+    const char* path = args.size() < 2 ? "." : args[1].c_str();
+    DIR* dir = opendir(path);
+    if (dir == nullptr) {
+        perror("ls");
+        io.status = 1;
+        return 1;
+    }
+    dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] != '.') { // Skip hidden files by default
+            io.out << entry->d_name << ' ';
+        }
+    }
+    io.out << endl;
+    closedir(dir);
+    return 1;
+}
+
+int shell_mkdir(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() < 2) {
+        cerr << "mkdir: missing operand" << endl;
+        io.status = 1;
+        return 1;
+    }
+    FileBatch batch;
+    for (size_t i = 1; i < args.size(); ++i) {
+        batch.add_mkdir(args[i], 0777); // Permission bits are set to allow all actions
+    }
+    batch.run();
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (batch[i].error) {
+            cerr << "mkdir: " << batch[i].path << ": " << strerror(batch[i].error) << endl;
+            io.status = 1;
+        }
+    }
+    return 1;
+}
+
+int shell_touch(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() < 2) {
+        cerr << "touch: missing operand" << endl;
+        io.status = 1;
+        return 1;
+    }
+    FileBatch batch;
+    for (size_t i = 1; i < args.size(); ++i) {
+        batch.add_create(args[i], 0666);
+    }
+    batch.run();
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (batch[i].error) {
+            cerr << "touch: " << batch[i].path << ": " << strerror(batch[i].error) << endl;
+            io.status = 1;
+        }
+    }
+    return 1;
+}
+
+// rm [-r] [-f] file...: -r removes directory trees (in parallel), -f
+// ignores operands that do not exist
+int shell_rm(const vector<string>& args, BuiltinIO& io) {
+    bool recursive = false, force = false;
+    size_t first = 1;
+    for (; first < args.size() && args[first].size() > 1 && args[first][0] == '-'; ++first) {
+        if (args[first] == "--") {
+            ++first;
+            break;
+        }
+        for (char flag : args[first].substr(1)) {
+            if (flag == 'r' || flag == 'R') {
+                recursive = true;
+            } else if (flag == 'f') {
+                force = true;
+            } else {
+                cerr << "rm: invalid option -- '" << flag << "'" << endl;
+                io.status = 1;
+                return 1;
+            }
+        }
+    }
+    if (first == args.size()) {
+        if (!force) {
+            cerr << "rm: missing operand" << endl;
+            io.status = 1;
+        }
+        return 1;
+    }
+
+    // Unlink everything in one batch; what turns out to be a directory is
+    // removed with rmdir, or as a tree with -r
+    FileBatch batch;
+    for (size_t i = first; i < args.size(); ++i) {
+        batch.add_unlink(args[i]);
+    }
+    batch.run();
+
+    vector<int> errors(batch.size());
+    vector<size_t> directories;
+    FileBatch rmdirs;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        errors[i] = batch[i].error;
+        if (errors[i] != EISDIR) {
+            continue;
+        }
+        string base = base_name(batch[i].path);
+        if (!recursive) {
+            rmdirs.add_rmdir(batch[i].path);
+            directories.push_back(i);
+        } else if (base == "/" || base == "." || base == "..") {
+            errors[i] = 0;
+            cerr << "rm: refusing to remove '" << batch[i].path << "'" << endl;
+            io.status = 1;
+        } else {
+            errors[i] = -1; // Handled below
+        }
+    }
+    rmdirs.run();
+    for (size_t j = 0; j < rmdirs.size(); ++j) {
+        errors[directories[j]] = rmdirs[j].error;
+    }
+
+    unique_ptr<RemoveTree> trees;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (errors[i] == -1) {
+            if (!trees) {
+                trees.reset(new RemoveTree);
+            }
+            trees->remove(batch[i].path);
+        } else if (errors[i] && !(force && errors[i] == ENOENT)) {
+            cerr << "rm: " << batch[i].path << ": " << strerror(errors[i]) << endl;
+            io.status = 1;
+        }
+    }
+    if (trees && !trees->finish()) {
+        io.status = 1;
+    }
+    return 1;
+}
+
+// Copy one regular file, keeping its permission bits
+bool copy_file(const string& source, const string& target) {
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        perror(("cp: " + source).c_str());
+        return false;
+    }
+    struct stat st;
+    fstat(in, &st);
+    int out = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (out == -1) {
+        perror(("cp: " + target).c_str());
+        close(in);
+        return false;
+    }
+    uint64_t copied = 0;
+    bool ok = copy_fd_contents(in, out, copied);
+    if (!ok) {
+        perror(("cp: " + target).c_str());
+    }
+    close(in);
+    close(out);
+    return ok;
+}
+
+// cp [-r] source... target: with several sources, or when target is an
+// existing directory, each source is copied into it. -r copies directory
+// trees (in parallel).
+int shell_cp(const vector<string>& args, BuiltinIO& io) {
+    bool recursive = false;
+    size_t first = 1;
+    for (; first < args.size() && args[first].size() > 1 && args[first][0] == '-'; ++first) {
+        if (args[first] == "--") {
+            ++first;
+            break;
+        }
+        for (char flag : args[first].substr(1)) {
+            if (flag == 'r' || flag == 'R') {
+                recursive = true;
+            } else {
+                cerr << "cp: invalid option -- '" << flag << "'" << endl;
+                io.status = 1;
+                return 1;
+            }
+        }
+    }
+    if (args.size() - first < 2) {
+        cerr << "cp: missing source and destination files" << endl;
+        io.status = 1;
+        return 1;
+    }
+
+    const string& target = args.back();
+    struct stat st;
+    bool into_directory = stat(target.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    if (args.size() - first > 2 && !into_directory) {
+        cerr << "cp: target '" << target << "' is not a directory" << endl;
+        io.status = 1;
+        return 1;
+    }
+
+    unique_ptr<CopyTree> trees;
+    for (size_t i = first; i + 1 < args.size(); ++i) {
+        const string& source = args[i];
+        string destination = into_directory
+            ? (target.back() == '/' ? target : target + "/") + base_name(source) : target;
+        if (stat(source.c_str(), &st) != 0) {
+            perror(("cp: " + source).c_str());
+            io.status = 1;
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            if (!copy_file(source, destination)) {
+                io.status = 1;
+            }
+            continue;
+        }
+        if (!recursive) {
+            cerr << "cp: -r not specified; omitting directory '" << source << "'" << endl;
+            io.status = 1;
+            continue;
+        }
+        if (!trees) {
+            trees.reset(new CopyTree);
+        }
+        trees->copy(source, destination);
+    }
+    if (trees && !trees->finish()) {
+        io.status = 1;
+    }
+    return 1;
+}
+
+int shell_mv(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() < 3) {
+        cerr << "mv: missing source and destination files" << endl;
+        io.status = 1;
+        return 1;
+    }
+
+    // With several sources, or a target that is a directory, move into it
+    const string& target = args.back();
+    struct stat st;
+    bool into_directory = stat(target.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    if (args.size() > 3 && !into_directory) {
+        cerr << "mv: target '" << target << "' is not a directory" << endl;
+        io.status = 1;
+        return 1;
+    }
+
+    FileBatch batch;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        batch.add_rename(args[i], into_directory
+            ? (target.back() == '/' ? target : target + "/") + base_name(args[i]) : target);
+    }
+    batch.run();
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (batch[i].error) {
+            cerr << "mv: " << batch[i].path << ": " << strerror(batch[i].error) << endl;
+            io.status = 1;
+        }
+    }
+    return 1;
+}
+
+// du [-a] [-s] [-h] [path...]: disk usage of each directory, in KiB.
+// Hard-linked files are counted once.
+int shell_du(const vector<string>& args, BuiltinIO& io) {
+    DiskUsage::Options options;
+    size_t first = 1;
+    for (; first < args.size() && args[first].size() > 1 && args[first][0] == '-'; ++first) {
+        if (args[first] == "--") {
+            ++first;
+            break;
+        }
+        for (char flag : args[first].substr(1)) {
+            if (flag == 'a') {
+                options.all = true;
+            } else if (flag == 's') {
+                options.summarize = true;
+            } else if (flag == 'h') {
+                options.human = true;
+            } else {
+                cerr << "du: invalid option -- '" << flag << "'" << endl;
+                io.status = 1;
+                return 1;
+            }
+        }
+    }
+    vector<string> paths(args.begin() + first, args.end());
+    if (paths.empty()) {
+        paths.push_back(".");
+    }
+
+    DiskUsage usage(io.out, options);
+    for (const auto& path : paths) {
+        struct statx stx;
+        if (!stat_entry(AT_FDCWD, path, STATX_TYPE | STATX_BLOCKS | STATX_NLINK | STATX_INO, stx)) {
+            perror(("du: " + path).c_str());
+            io.status = 1;
+        } else if (S_ISDIR(stx.stx_mode)) {
+            usage.add(path);
+        } else if (usage.first_link(stx)) {
+            usage.print(stx.stx_blocks * 512, path);
+        }
+    }
+    if (!usage.finish()) {
+        io.status = 1;
+    }
+    io.out.flush();
+    return 1;
+}
+
+// find [path...] [-name pattern] [-type f|d|l|p|s|c|b] [-size [+-]n[cwbkMG]]
+// [-newer file]: print every entry below the paths that passes all tests.
+// Entries are printed as the parallel walk finds them, so sibling order is
+// not fixed.
+int shell_find(const vector<string>& args, BuiltinIO& io) {
+    vector<string> paths;
+    size_t i = 1;
+    for (; i < args.size() && (args[i].empty() || args[i][0] != '-'); ++i) {
+        paths.push_back(args[i]);
+    }
+    if (paths.empty()) {
+        paths.push_back(".");
+    }
+
+    FindFiles::Criteria criteria;
+    for (; i < args.size(); i += 2) {
+        const string& test = args[i];
+        if (i + 1 >= args.size()) {
+            cerr << "find: missing argument to '" << test << "'" << endl;
+            io.status = 1;
+            return 1;
+        }
+        const string& value = args[i + 1];
+        if (test == "-name") {
+            criteria.name = value;
+        } else if (test == "-type") {
+            static const string letters = "fdlpscb";
+            static const unsigned char types[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_CHR, DT_BLK};
+            size_t index = value.size() == 1 ? letters.find(value[0]) : string::npos;
+            if (index == string::npos) {
+                cerr << "find: unknown argument to -type: " << value << endl;
+                io.status = 1;
+                return 1;
+            }
+            criteria.type = types[index];
+        } else if (test == "-size") {
+            criteria.size_sign = value[0] == '+' ? 1 : value[0] == '-' ? -1 : 0;
+            size_t pos = criteria.size_sign != 0;
+            size_t end = min(value.find_first_not_of("0123456789", pos), value.size());
+            string suffix = value.substr(end);
+            static const string unit_letters = "cwbkMG";
+            static const uint64_t unit_sizes[] = {1, 2, 512, 1024, 1024 * 1024, 1024 * 1024 * 1024};
+            size_t unit = suffix.empty() ? 2 : suffix.size() == 1 ? unit_letters.find(suffix[0]) : string::npos;
+            errno = 0;
+            unsigned long long count = strtoull(value.substr(pos, end - pos).c_str(), nullptr, 10);
+            if (end == pos || unit == string::npos || errno == ERANGE) {
+                cerr << "find: invalid -size argument: " << value << endl;
+                io.status = 1;
+                return 1;
+            }
+            criteria.has_size = true;
+            criteria.size_count = count;
+            criteria.size_unit = unit_sizes[unit];
+        } else if (test == "-newer") {
+            struct statx stx;
+            if (statx(AT_FDCWD, value.c_str(), 0, STATX_MTIME, &stx) != 0) {
+                perror(("find: " + value).c_str());
+                io.status = 1;
+                return 1;
+            }
+            criteria.has_newer = true;
+            criteria.newer = stx.stx_mtime;
+        } else {
+            cerr << "find: unknown predicate '" << test << "'" << endl;
+            io.status = 1;
+            return 1;
+        }
+    }
+
+    FindFiles finder(io.out, criteria);
+    for (const auto& path : paths) {
+        struct statx stx;
+        if (statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE, &stx) != 0) {
+            perror(("find: " + path).c_str());
+            io.status = 1;
+        } else if (S_ISDIR(stx.stx_mode)) {
+            finder.add(path);
+        } else {
+            finder.add_file(path, IFTODT(stx.stx_mode));
+        }
+    }
+    if (!finder.finish()) {
+        io.status = 1;
+    }
+    io.out.flush();
+    return 1;
+}
+
+int shell_echo(const vector<string>& args, BuiltinIO& io) {
+    for (size_t i = 1; i < args.size(); ++i) {
+        io.out << args[i] << " ";
+    }
+    io.out << endl;
+    return 1;
+}
+
+int shell_cat(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() < 2) {
+        // No files: copy standard input
+        if (io.in.rdbuf()->sgetc() != char_traits<char>::eof()) {
+            io.out << io.in.rdbuf();
+        }
+        io.out.flush();
+        return 1;
+    }
+    for (size_t i = 1; i < args.size(); ++i) {
+        ifstream file(args[i]);
+        if (!file) {
+            perror(("cat: " + args[i]).c_str());
+            io.status = 1;
+            continue;
+        }
+        if (file.peek() != ifstream::traits_type::eof()) {
+            io.out << file.rdbuf(); // Inserting an empty streambuf would set failbit
+        }
+    }
+    return 1;
+}
+
+// Options of head and tail: -n count (or -count) and, for tail, -f. A
+// count of +n, only accepted by tail, counts from the start instead.
+struct LineOptions {
+    uint64_t count = 10;
+    bool from_start = false;
+    bool follow = false;
+};
+
+// Parse the options of head or tail. Returns the index of the first file
+// operand, or 0 after reporting an error.
+size_t parse_line_options(const vector<string>& args, bool tail, LineOptions& options) {
+    const string& name = args[0];
+    size_t first = 1;
+    for (; first < args.size() && args[first].size() > 1 && args[first][0] == '-'; ++first) {
+        const string& arg = args[first];
+        if (arg == "--") {
+            ++first;
+            break;
+        }
+        bool has_count = isdigit(static_cast<unsigned char>(arg[1]));
+        string count = has_count ? arg.substr(1) : "";
+        for (size_t j = 1; j < arg.size() && !has_count; ++j) {
+            if (arg[j] == 'f' && tail) {
+                options.follow = true;
+            } else if (arg[j] == 'n') {
+                if (j + 1 == arg.size() && first + 1 == args.size()) {
+                    cerr << name << ": option requires an argument -- 'n'" << endl;
+                    return 0;
+                }
+                count = j + 1 < arg.size() ? arg.substr(j + 1) : args[++first];
+                has_count = true;
+            } else {
+                cerr << name << ": invalid option -- '" << arg[j] << "'" << endl;
+                return 0;
+            }
+        }
+        if (!has_count) {
+            continue;
+        }
+        options.from_start = tail && !count.empty() && count[0] == '+';
+        string digits = count.substr(options.from_start);
+        if (digits.empty() || digits.find_first_not_of("0123456789") != string::npos) {
+            cerr << name << ": invalid number of lines: '" << count << "'" << endl;
+            return 0;
+        }
+        errno = 0;
+        options.count = strtoull(digits.c_str(), nullptr, 10);
+        if (errno == ERANGE) {
+            options.count = UINT64_MAX;
+        }
+    }
+    return first;
+}
+
+// "==> name <==" in front of each file when head or tail is given several
+void print_file_header(ostream& out, const string& name, bool& headed) {
+    out << (headed ? "\n" : "") << "==> " << (name == "-" ? "standard input" : name) << " <==\n";
+    headed = true;
 }
 
-// Split the input line into tokens
-vector<string> split_line(const string& line) {
-    vector<string> args;
-    size_t start = 0, end = line.find(' ');
-    while (end != string::npos) {
-        args.push_back(line.substr(start, end - start));
-        start = end + 1;
-        end = line.find(' ', start);
+// head [-n count] [file...]: print the first count (default 10) lines of
+// each file, reading no further than needed. "-" is standard input.
+int shell_head(const vector<string>& args, BuiltinIO& io) {
+    LineOptions options;
+    size_t first = parse_line_options(args, false, options);
+    if (first == 0) {
+        io.status = 1;
+        return 1;
+    }
+    vector<string> files(args.begin() + first, args.end());
+    if (files.empty()) {
+        files.push_back("-");
+    }
+
+    bool headed = false;
+    for (const auto& name : files) {
+        uint64_t remaining = options.count;
+        auto print_lines = [&](const char* data, size_t size) {
+            io.out.write(data, take_lines(data, size, remaining));
+            return remaining > 0 && io.out.good();
+        };
+        int fd = name == "-" ? STDIN_FILENO : open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(("head: " + name).c_str());
+            io.status = 1;
+            continue;
+        }
+        if (files.size() > 1) {
+            print_file_header(io.out, name, headed);
+        }
+        if (remaining == 0) {
+            // Nothing to print, so nothing to read
+        } else if (name == "-") {
+            read_blocks(*io.in.rdbuf(), print_lines);
+        } else if (!read_blocks(fd, print_lines)) {
+            perror(("head: " + name).c_str());
+            io.status = 1;
+        }
+        if (name != "-") {
+            close(fd);
+        }
     }
-    args.push_back(line.substr(start));
-    return args;
+    io.out.flush();
+    return 1;
 }
 
-// Execute shell built-in or external command
-int execute(vector<string> args) {
-    if (args.empty()) {
-        return 1; // No command entered
+// tail [-f] [-n [+]count] [file...]: print the last count (default 10)
+// lines of each file, or everything from line count on with +count. Regular
+// files are read backwards from the end; with -f they are then followed as
+// they grow, until Ctrl-C. "-" is standard input, which is never followed.
+int shell_tail(const vector<string>& args, BuiltinIO& io) {
+    LineOptions options;
+    size_t first = parse_line_options(args, true, options);
+    if (first == 0) {
+        io.status = 1;
+        return 1;
+    }
+    vector<string> files(args.begin() + first, args.end());
+    if (files.empty()) {
+        files.push_back("-");
     }
 
-    string command = args[0];
-    args.erase(args.begin());
+    FileFollower follower(io.out, files.size() > 1);
+    bool headed = false;
+    for (const auto& name : files) {
+        // +count: skip count - 1 lines, then print the rest
+        uint64_t skip = options.count > 0 ? options.count - 1 : 0;
+        off_t offset = 0; // Bytes read so far, where -f carries on
+        auto print_rest = [&](const char* data, size_t size) {
+            size_t skipped = skip > 0 ? take_lines(data, size, skip) : 0;
+            io.out.write(data + skipped, size - skipped);
+            offset += size;
+            return io.out.good();
+        };
+        TailBuffer last(options.count);
+        auto keep_last = [&last](const char* data, size_t size) {
+            last.add(data, size);
+            return true;
+        };
 
-    if (command_Map.count(command)) {
-        return command_Map[command](args);
-    } else {
-        pid_t pid = fork();
-        if (pid == 0) {
-            vector<char*> c_args(args.size() + 2);
-            c_args[0] = strdup(command.c_str());
-            for (size_t i = 0; i < args.size(); i++) {
-                c_args[i + 1] = strdup(args[i].c_str());
+        if (name == "-") {
+            if (files.size() > 1) {
+                print_file_header(io.out, name, headed);
             }
-            c_args[args.size() + 1] = NULL;
+            if (options.from_start) {
+                read_blocks(*io.in.rdbuf(), print_rest);
+            } else {
+                read_blocks(*io.in.rdbuf(), keep_last);
+                last.write(io.out);
+            }
+            continue;
+        }
 
-            execvp(c_args[0], c_args.data());
-            cerr << "Command not found" << endl;
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            cerr << "Failed to fork" << endl;
+        int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            perror(("tail: " + name).c_str());
+            io.status = 1;
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+        if (files.size() > 1) {
+            print_file_header(io.out, name, headed);
+        }
+        bool ok;
+        if (options.from_start) {
+            ok = read_blocks(fd, print_rest);
+        } else if (S_ISREG(st.st_mode)) {
+            off_t start = last_lines_start(fd, st.st_size, options.count);
+            offset = start < 0 ? -1 : copy_to_end(fd, start, io.out);
+            ok = offset >= 0;
+        } else {
+            ok = read_blocks(fd, keep_last);
+            last.write(io.out);
+        }
+        if (!ok) {
+            perror(("tail: " + name).c_str());
+            io.status = 1;
+        }
+        if (ok && options.follow && S_ISREG(st.st_mode)) {
+            follower.add(name, fd, offset);
         } else {
-            int status;
-            waitpid(pid, &status, 0);
+            close(fd);
         }
     }
+    io.out.flush();
+    if (options.follow) {
+        follower.run();
+    }
     return 1;
 }
 
-// Command loop for shell input/output
-void shell_loop() {
-    string line;
-    vector<string> args;
-    int status;
+// wc [-lwc] [file...]: print the line, word and byte counts of each file,
+// all three unless some are picked, and totals when there are several files.
+// "-" is standard input.
+int shell_wc(const vector<string>& args, BuiltinIO& io) {
+    bool lines = false, words = false, bytes = false;
+    size_t first = 1;
+    for (; first < args.size() && args[first].size() > 1 && args[first][0] == '-'; ++first) {
+        if (args[first] == "--") {
+            ++first;
+            break;
+        }
+        for (char flag : args[first].substr(1)) {
+            if (flag == 'l') {
+                lines = true;
+            } else if (flag == 'w') {
+                words = true;
+            } else if (flag == 'c') {
+                bytes = true;
+            } else {
+                cerr << "wc: invalid option -- '" << flag << "'" << endl;
+                io.status = 1;
+                return 1;
+            }
+        }
+    }
+    if (!lines && !words && !bytes) {
+        lines = words = bytes = true;
+    }
+    vector<string> files(args.begin() + first, args.end());
+    bool named = !files.empty();
+    if (!named) {
+        files.push_back("-");
+    }
+
+    vector<pair<TextCounter, string>> counts;
+    TextCounter total(words);
+    uint64_t size_sum = 0;  // Sizes of the regular files, for the column width
+    bool streamed = false; // Some input had no size up front
+    for (const auto& name : files) {
+        TextCounter counter(words);
+        auto count = [&counter](const char* data, size_t size) {
+            counter.add(data, size);
+            return true;
+        };
+        if (name == "-") {
+            streamed = true;
+            read_blocks(*io.in.rdbuf(), count);
+        } else {
+            int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd == -1 || fstat(fd, &st) != 0) {
+                perror(("wc: " + name).c_str());
+                io.status = 1;
+                if (fd != -1) {
+                    close(fd);
+                }
+                continue;
+            }
+            bool ok = true;
+            if (!S_ISREG(st.st_mode)) {
+                streamed = true;
+                ok = read_blocks(fd, count);
+            } else if (lines || words) {
+                size_sum += st.st_size;
+                ok = read_blocks(fd, count);
+            } else {
+                size_sum += st.st_size;
+                counter.bytes = st.st_size; // Bytes alone need no reading
+            }
+            if (!ok) {
+                perror(("wc: " + name).c_str());
+                io.status = 1;
+            }
+            close(fd);
+            if (!ok) {
+                continue;
+            }
+        }
+        total.lines += counter.lines;
+        total.words += counter.words;
+        total.bytes += counter.bytes;
+        counts.emplace_back(counter, named ? name : "");
+    }
+    if (files.size() > 1) {
+        counts.emplace_back(total, "total");
+    }
 
-    do {
-        cout << "> ";
-        line = read_line();
-        args = split_line(line);
-        status = execute(args);
-    } while (status);
+    // Columns as wide as the largest possible count, as GNU wc does
+    int width = to_string(size_sum).size();
+    if (streamed) {
+        width = max(width, 7);
+    }
+    if (lines + words + bytes == 1 && files.size() == 1) {
+        width = 1;
+    }
+    for (const auto& entry : counts) {
+        const TextCounter& counter = entry.first;
+        const char* separator = "";
+        if (lines) {
+            io.out << separator << setw(width) << counter.lines;
+            separator = " ";
+        }
+        if (words) {
+            io.out << separator << setw(width) << counter.words;
+            separator = " ";
+        }
+        if (bytes) {
+            io.out << separator << setw(width) << counter.bytes;
+        }
+        if (!entry.second.empty()) {
+            io.out << ' ' << entry.second;
+        }
+        io.out << '\n';
+    }
+    io.out.flush();
+    return 1;
 }
 
-// Main entry point for the shell
-int main() {
-    shell_loop();
-    return EXIT_SUCCESS;
+// Parse a sort key, F[.C][bnr][,F[.C][bnr]]
+bool parse_sort_key(const string& text, ExternalSort::Key& key) {
+    size_t i = 0;
+    auto number = [&](size_t& value) {
+        size_t start = i;
+        while (i < text.size() && isdigit(static_cast<unsigned char>(text[i]))) {
+            ++i;
+        }
+        if (i == start || i - start > 9) {
+            return false;
+        }
+        value = stoul(text.substr(start, i - start));
+        return true;
+    };
+    auto flags = [&]() {
+        for (; i < text.size() && strchr("bnr", text[i]); ++i) {
+            (text[i] == 'b' ? key.blanks : text[i] == 'n' ? key.numeric : key.reverse) = true;
+            key.own_order = true;
+        }
+    };
+
+    if (!number(key.start_field) || key.start_field == 0) {
+        return false;
+    }
+    if (i < text.size() && text[i] == '.' && (++i, !number(key.start_char) || key.start_char == 0)) {
+        return false;
+    }
+    flags();
+    if (i < text.size() && text[i] == ',') {
+        ++i;
+        if (!number(key.end_field) || key.end_field == 0) {
+            return false;
+        }
+        if (i < text.size() && text[i] == '.' && (++i, !number(key.end_char))) {
+            return false;
+        }
+        flags();
+    }
+    return i == text.size();
 }
 
-// Implementation of built-in shell commands
-int shell_cd(vector<string> args) {
-    if (args.size() > 1) {
-        cerr << "cd: too many arguments" << endl;
-        return 1;
+// Parse a sort -S size: a number with an optional b, K, M, G, T or %
+// (of physical memory) suffix, in KiB without one
+bool parse_sort_memory(const string& text, size_t& bytes) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str() || errno == ERANGE || (*end && end[1])) {
+        return false;
     }
-    string dir = args.empty() ? getenv("HOME") : args[0];
-    if (chdir(dir.c_str()) != 0) {
-        perror("cd");
+    static const string suffixes = "bKMGT";
+    size_t unit = *end ? suffixes.find(toupper(*end) == 'B' ? 'b' : toupper(*end)) : 1;
+    if (*end == '%') {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        bytes = pages > 0 ? static_cast<size_t>(pages) * sysconf(_SC_PAGESIZE) / 100 * min(value, 100ULL) : 0;
+        return bytes > 0;
+    }
+    if (unit == string::npos || value > (SIZE_MAX >> (10 * unit))) {
+        return false;
+    }
+    bytes = value << (10 * unit);
+    return true;
+}
+
+// sort [-bnru] [-k key]... [-t char] [-S size] [-T dir] [--parallel=n]
+// [file...]: write the lines of the files (or standard input) in order.
+// Input beyond the -S budget is sorted in runs spilled to temporary files
+// and merged at the end; comparisons are bytewise, as in the C locale.
+int shell_sort(const vector<string>& args, BuiltinIO& io) {
+    ExternalSort::Options options;
+    size_t first = 1;
+    for (; first < args.size() && args[first].size() > 1 && args[first][0] == '-'; ++first) {
+        const string& arg = args[first];
+        if (arg == "--") {
+            ++first;
+            break;
+        }
+        if (arg.compare(0, 11, "--parallel=") == 0) {
+            options.threads = strtoul(arg.c_str() + 11, nullptr, 10);
+            if (options.threads == 0) {
+                cerr << "sort: invalid number of threads: '" << arg.substr(11) << "'" << endl;
+                io.status = 1;
+                return 1;
+            }
+            continue;
+        }
+        for (size_t j = 1; j < arg.size(); ++j) {
+            char flag = arg[j];
+            if (flag == 'b') {
+                options.blanks = true;
+            } else if (flag == 'n') {
+                options.numeric = true;
+            } else if (flag == 'r') {
+                options.reverse = true;
+            } else if (flag == 'u') {
+                options.unique = true;
+            } else if (flag == 'k' || flag == 't' || flag == 'S' || flag == 'T') {
+                if (j + 1 == arg.size() && first + 1 == args.size()) {
+                    cerr << "sort: option requires an argument -- '" << flag << "'" << endl;
+                    io.status = 1;
+                    return 1;
+                }
+                string value = j + 1 < arg.size() ? arg.substr(j + 1) : args[++first];
+                if (flag == 'k') {
+                    ExternalSort::Key key;
+                    if (!parse_sort_key(value, key)) {
+                        cerr << "sort: invalid key '" << value << "'" << endl;
+                        io.status = 1;
+                        return 1;
+                    }
+                    options.keys.push_back(key);
+                } else if (flag == 't') {
+                    if (value.size() != 1) {
+                        cerr << "sort: multi-character tab '" << value << "'" << endl;
+                        io.status = 1;
+                        return 1;
+                    }
+                    options.separator = value[0];
+                } else if (flag == 'S') {
+                    if (!parse_sort_memory(value, options.memory)) {
+                        cerr << "sort: invalid -S argument '" << value << "'" << endl;
+                        io.status = 1;
+                        return 1;
+                    }
+                } else {
+                    options.temp_dir = value;
+                }
+                break;
+            } else {
+                cerr << "sort: invalid option -- '" << flag << "'" << endl;
+                io.status = 1;
+                return 1;
+            }
+        }
+    }
+
+    // Open every file first, so a bad name fails before any output
+    vector<string> files(args.begin() + first, args.end());
+    vector<int> fds;
+    for (const auto& name : files) {
+        int fd = name == "-" ? STDIN_FILENO : open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(("sort: " + name).c_str());
+            io.status = 1;
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (files[i] != "-") {
+                    close(fds[i]);
+                }
+            }
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+
+    if (options.temp_dir.empty()) {
+        const char* tmpdir = shell_variables.get("TMPDIR");
+        options.temp_dir = tmpdir && *tmpdir ? tmpdir : "/tmp";
+    }
+    ExternalSort sorter(io.out, options);
+    if (files.empty()) {
+        sorter.add(*io.in.rdbuf());
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i] == "-") {
+            sorter.add(*io.in.rdbuf());
+        } else {
+            sorter.add(fds[i]);
+            close(fds[i]);
+        }
+    }
+    // A reader that stopped early (sort | head) is not worth a message
+    if (!sorter.finish()) {
+        if (errno != EPIPE) {
+            cerr << "sort: write failed" << endl;
+        }
+        io.status = 2;
+        io.out.clear(); // Reported here rather than again by the caller
     }
     return 1;
 }
 
-int shell_ls(vector<string> args) {
-    const char* path = args.empty() ? "." : args[0].c_str();
-    DIR* dir = opendir(path);
-    if (dir == nullptr) {
-        perror("ls");
+int shell_grep(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() < 2) {
+        cerr << "grep: missing pattern" << endl;
+        io.status = 2;
         return 1;
     }
-    dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (entry->d_name[0] != '.') { // Skip hidden files by default
-            cout << entry->d_name << ' ';
+    // Status 1 when nothing matched, 2 after an error
+    const string& pattern = args[1];
+    bool matched = false;
+    if (args.size() == 2) {
+        // No files: filter standard input
+        string line;
+        while (getline(io.in, line)) {
+            if (line.find(pattern) != string::npos) {
+                io.out << line << '\n';
+                matched = true;
+            }
         }
+        io.out.flush();
+        io.status = matched ? 0 : 1;
+        return 1;
+    }
+    for (size_t i = 2; i < args.size(); ++i) {
+        ifstream file(args[i]);
+        if (!file) {
+            perror(("grep: " + args[i]).c_str());
+            io.status = 2;
+            continue;
+        }
+        string line;
+        while (getline(file, line)) {
+            if (line.find(pattern) != string::npos) {
+                io.out << line << '\n';
+                matched = true;
+            }
+        }
+    }
+    if (!matched && io.status == 0) {
+        io.status = 1;
     }
-    cout << endl;
-    closedir(dir);
     return 1;
 }
 
-int shell_mkdir(vector<string> args) {
-    if (args.empty()) {
-        cerr << "mkdir: missing operand" << endl;
+int shell_hash(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() > 1 && args[1] == "-r") {
+        rebuild_path_index(path_stamp(), true);
         return 1;
     }
-    for (const auto& dir : args) {
-        if (mkdir(dir.c_str(), 0777) != 0) { // Permission bits are set to allow all actions
-            perror("mkdir");
-        }
+    for (const auto& entry : path_index) {
+        io.out << entry.first << '\t' << entry.second << '\n';
     }
+    io.out.flush();
     return 1;
 }
 
-int shell_touch(vector<string> args) {
-    if (args.empty()) {
-        cerr << "touch: missing operand" << endl;
+int shell_history(const vector<string>& args, BuiltinIO& io) {
+    History& history = shell_history();
+    uint64_t entry = history.last();
+    if (entry == History::npos) {
         return 1;
     }
-    for (const auto& filename : args) {
-        int fd = open(filename.c_str(), O_CREAT | O_WRONLY, 0666);
-        if (fd == -1) {
-            perror("touch");
-        } else {
-            close(fd);
+
+    // `history n` lists the last n entries, plain `history` lists them all
+    if (args.size() > 1) {
+        unsigned long count = strtoul(args[1].c_str(), nullptr, 10);
+        if (count == 0) {
+            return 1;
         }
+        for (; count > 1 && history.previous(entry) != History::npos; --count) {
+            entry = history.previous(entry);
+        }
+    } else {
+        entry = 0;
     }
+
+    for (size_t number = history.number(entry); entry != History::npos; entry = history.next(entry), ++number) {
+        io.out << setw(5) << number << "  " << history.at(entry) << '\n';
+    }
+    io.out.flush();
     return 1;
 }
 
-int shell_rm(vector<string> args) {
-    if (args.empty()) {
-        cerr << "rm: missing operand" << endl;
-        return 1;
+int shell_help(const vector<string>& args, BuiltinIO& io) {
+    io.out << "Custom Shell Help\n"
+         << "Supported commands:\n";
+    for (const auto& cmd : command_Map) {
+        io.out << "  " << cmd.first << endl;
+    }
+    return 1;
+}
+
+// exit [n]: leave the shell with status n, or that of the last command
+int shell_exit(const vector<string>& args, BuiltinIO& io) {
+    io.status = args.size() > 1 ? atoi(args[1].c_str()) & 0xff : shell_variables.status();
+    return 0;
+}
+
+// alias [name[=value]]...: define aliases, or print them
+int shell_alias(const vector<string>& args, BuiltinIO& io) {
+    auto print = [&io](const string& name, const string& value) {
+        string quoted;
+        for (char c : value) {
+            quoted += c == '\'' ? "'\\''" : string(1, c);
+        }
+        io.out << "alias " << name << "='" << quoted << "'\n";
+    };
+    if (args.size() < 2) {
+        for (const auto& alias : shell_aliases) {
+            print(alias.first, alias.second);
+        }
     }
-    for (const auto& filename : args) {
-        if (remove(filename.c_str()) != 0) {
-            perror("rm");
+    for (size_t i = 1; i < args.size(); ++i) {
+        size_t equals = args[i].find('=');
+        if (equals == 0) {
+            cerr << "alias: '" << args[i] << "': invalid alias name" << endl;
+            io.status = 1;
+        } else if (equals != string::npos) {
+            shell_aliases.insert_or_assign(args[i].substr(0, equals), args[i].substr(equals + 1));
+            parse_cache.clear(); // Cached trees have the old aliases in them
+        } else if (auto alias = shell_aliases.find(args[i]); alias != shell_aliases.end()) {
+            print(alias->first, alias->second);
+        } else {
+            cerr << "alias: " << args[i] << ": not found" << endl;
+            io.status = 1;
         }
     }
+    io.out.flush();
     return 1;
 }
 
-int shell_cp(vector<string> args) {
+// unalias -a | name...: remove all aliases or the ones named
+int shell_unalias(const vector<string>& args, BuiltinIO& io) {
     if (args.size() < 2) {
-        cerr << "cp: missing source and destination files" << endl;
+        cerr << "unalias: usage: unalias [-a] name [name ...]" << endl;
+        io.status = 1;
         return 1;
     }
-    ifstream src(args[0], ios::binary);
-    ofstream dst(args[1], ios::binary);
-    
-    if (!src) {
-        perror("cp: source file");
-        return 1;
+    if (args[1] == "-a") {
+        shell_aliases.clear();
     }
-    if (!dst) {
-        perror("cp: destination file");
-        return 1;
+    for (size_t i = args[1] == "-a" ? 2 : 1; i < args.size(); ++i) {
+        if (shell_aliases.erase(args[i]) == 0) {
+            cerr << "unalias: " << args[i] << ": not found" << endl;
+            io.status = 1;
+        }
     }
-    
-    dst << src.rdbuf();
+    parse_cache.clear();
     return 1;
 }
 
-int shell_mv(vector<string> args) {
-    if (args.size() < 2) {
-        cerr << "mv: missing source and destination files" << endl;
+// break [n] and continue [n]: leave or restart the nth enclosing loop
+int shell_break(const vector<string>& args, BuiltinIO& io) {
+    unsigned long count = 1;
+    if (args.size() > 1) {
+        char* end;
+        count = strtoul(args[1].c_str(), &end, 10);
+        if (*end != '\0' || count == 0) {
+            cerr << args[0] << ": " << args[1] << ": loop count out of range" << endl;
+            io.status = 1;
+            return 1;
+        }
+    }
+    if (loop_depth == 0) {
+        cerr << args[0] << ": only meaningful in a loop" << endl;
         return 1;
     }
-    if (rename(args[0].c_str(), args[1].c_str()) != 0) {
-        perror("mv");
+    unwinding = args[0] == "break" ? UNWIND_BREAK : UNWIND_CONTINUE;
+    unwind_loops = min(count, loop_depth);
+    return 1;
+}
+
+// return [n]: leave the running function with status n, or that of the
+// last command
+int shell_return(const vector<string>& args, BuiltinIO& io) {
+    if (function_depth == 0) {
+        cerr << "return: can only return from a function" << endl;
+        io.status = 1;
+        return 1;
     }
+    io.status = args.size() > 1 ? atoi(args[1].c_str()) & 0xff : shell_variables.status();
+    unwinding = UNWIND_RETURN;
+    return 1;
+}
+
+int shell_true(const vector<string>& args, BuiltinIO& io) {
+    return 1;
+}
+
+int shell_false(const vector<string>& args, BuiltinIO& io) {
+    io.status = 1;
     return 1;
 }
 
-int shell_echo(vector<string> args) {
-    for (const auto& arg : args) {
-        cout << arg << " ";
+// cachestats: how often command lines were found already parsed, and how
+// often the functions, each parsed once where it is defined, were called
+int shell_cachestats(const vector<string>& args, BuiltinIO& io) {
+    size_t lookups = parse_cache.hits() + parse_cache.misses();
+    io.out << "parse cache: " << parse_cache.size() << " entries, " << parse_cache.hits() << " hits, "
+           << parse_cache.misses() << " misses";
+    if (lookups > 0) {
+        char rate[32];
+        snprintf(rate, sizeof rate, " (%.1f%% hit rate)", 100.0 * parse_cache.hits() / lookups);
+        io.out << rate;
     }
-    cout << endl;
+    io.out << '\n'
+           << "functions: " << shell_functions.size() << " defined, " << function_calls << " calls\n";
+    io.out.flush();
     return 1;
 }
 
-int shell_cat(vector<string> args) {
-    if (args.empty()) {
-        cerr << "cat: missing operand" << endl;
+int shell_set(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() < 2 || (args.size() == 2 && args[1] == "-o")) {
+        for (const auto& option : shell_options) {
+            io.out << option.first << '\t' << (option.second ? "on" : "off") << '\n';
+        }
+        io.out << "jobs.max\t" << (jobs_max ? to_string(jobs_max) : "unlimited") << '\n';
+        io.out.flush();
         return 1;
     }
-    for (const auto& filename : args) {
-        ifstream file(filename);
-        if (!file) {
-            perror(("cat: " + filename).c_str());
-            continue;
+    for (size_t i = 1; i < args.size(); ++i) {
+        bool enable = args[i][0] == '-';
+        if (args[i] == "-C" || args[i] == "+C") {
+            shell_options["noclobber"] = enable;
+        } else if ((args[i] == "-o" || args[i] == "+o") && i + 1 < args.size()) {
+            auto option = shell_options.find(args[++i]);
+            if (option == shell_options.end()) {
+                cerr << "set: " << args[i] << ": invalid option name" << endl;
+                io.status = 1;
+                return 1;
+            }
+            option->second = enable;
+        } else if (args[i].compare(0, 9, "jobs.max=") == 0) {
+            // Background jobs allowed at once; & waits for a slot past it
+            string value = args[i].substr(9);
+            if (value == "unlimited") {
+                jobs_max = 0;
+            } else if (!value.empty() && value.size() < 10 && value.find_first_not_of("0123456789") == string::npos) {
+                jobs_max = stoul(value);
+            } else {
+                cerr << "set: jobs.max: invalid number '" << value << "'" << endl;
+                io.status = 1;
+                return 1;
+            }
+        } else {
+            cerr << "set: usage: set [-C|+C] [-o|+o option] [jobs.max=N]" << endl;
+            io.status = 1;
+            return 1;
         }
-        cout << file.rdbuf();
     }
     return 1;
 }
 
-int shell_grep(vector<string> args) {
+// export [name[=value]]...: put variables in the environment of commands,
+// or list the exported ones
+int shell_export(const vector<string>& args, BuiltinIO& io) {
     if (args.size() < 2) {
-        cerr << "grep: missing pattern and file" << endl;
+        shell_variables.for_each([&io](const string& name, const string& value, bool exported) {
+            if (exported) {
+                io.out << "export " << name << '=' << value << '\n';
+            }
+        });
+        io.out.flush();
         return 1;
     }
-    string pattern = args[0];
     for (size_t i = 1; i < args.size(); ++i) {
-        ifstream file(args[i]);
-        if (!file) {
-            perror(("grep: " + args[i]).c_str());
+        size_t equals = args[i].find('=');
+        string name = args[i].substr(0, equals);
+        if (!Variables::valid_name(name)) {
+            cerr << "export: '" << args[i] << "': not a valid identifier" << endl;
+            io.status = 1;
             continue;
         }
-        string line;
-        while (getline(file, line)) {
-            if (line.find(pattern) != string::npos) {
-                cout << line << endl;
-            }
+        if (equals == string::npos) {
+            shell_variables.export_name(name);
+        } else {
+            shell_variables.set(name, args[i].substr(equals + 1), true);
         }
+        variable_changed(name);
     }
     return 1;
 }
 
-int shell_help(vector<string> args) {
-    cout << "Custom Shell Help\n"
-         << "Supported commands:\n";
-    for (const auto& cmd : command_Map) {
-        cout << "  " << cmd.first << endl;
+int shell_unset(const vector<string>& args, BuiltinIO& io) {
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (!Variables::valid_name(args[i])) {
+            cerr << "unset: '" << args[i] << "': not a valid identifier" << endl;
+            io.status = 1;
+            continue;
+        }
+        shell_variables.unset(args[i]);
+        variable_changed(args[i]);
     }
     return 1;
 }
 
-int shell_exit(vector<string> args) {
-    return 0;
+// env [name=value]...: print the environment commands get, with the given
+// changes. With a command after the assignments, env never gets here:
+// take_prefixes() makes them assignments of the command instead.
+int shell_env(const vector<string>& args, BuiltinIO& io) {
+    vector<pair<string, string>> environment;
+    shell_variables.for_each([&environment](const string& name, const string& value, bool exported) {
+        if (exported) {
+            environment.emplace_back(name, value);
+        }
+    });
+    for (size_t i = 1; i < args.size(); ++i) {
+        size_t equals = args[i].find('=');
+        string name = args[i].substr(0, equals);
+        if (equals == string::npos || !Variables::valid_name(name)) {
+            cerr << "env: '" << args[i] << "': not an assignment" << endl;
+            io.status = 1;
+            return 1;
+        }
+        auto it = find_if(environment.begin(), environment.end(), [&name](const pair<string, string>& entry) {
+            return entry.first == name;
+        });
+        if (it == environment.end()) {
+            environment.emplace_back(name, args[i].substr(equals + 1));
+        } else {
+            it->second = args[i].substr(equals + 1);
+        }
+    }
+    sort(environment.begin(), environment.end());
+    for (const auto& entry : environment) {
+        io.out << entry.first << '=' << entry.second << '\n';
+    }
+    io.out.flush();
+    return 1;
 }
 
-int shell_wait(vector<string> args) {
-    int status;
-    while (wait(&status) > 0);
+// wait [%job | pid]...: wait for the given background jobs, or all of them.
+// The status is that of the last one waited for.
+int shell_wait(const vector<string>& args, BuiltinIO& io) {
+    vector<pid_t> pids;
+    for (size_t i = 1; i < args.size(); ++i) {
+        const string& target = args[i];
+        auto job = find_if(background_jobs.begin(), background_jobs.end(), [&target](const Job& job) {
+            return target[0] == '%' ? target.substr(1) == to_string(job.id) : target == to_string(job.pid);
+        });
+        if (job == background_jobs.end()) {
+            cerr << "wait: " << target << ": no such job" << endl;
+            io.status = 127;
+            continue;
+        }
+        // A job named twice is waited for once; it is gone after that
+        if (find(pids.begin(), pids.end(), job->pid) == pids.end()) {
+            pids.push_back(job->pid);
+        }
+    }
+    if (args.size() < 2) {
+        for (const auto& job : background_jobs) {
+            pids.push_back(job.pid);
+        }
+    }
+
+    for (pid_t pid : pids) {
+        auto job = find_if(background_jobs.begin(), background_jobs.end(), [pid](const Job& job) {
+            return job.pid == pid;
+        });
+        if (!job->done) {
+            job->status = wait_status(pid);
+            job->done = true;
+        }
+        io.status = job->status;
+        background_jobs.erase(job);
+    }
+    return 1;
+}
+
+// How a job's process differs from the shell in niceness, CPUs and limits,
+// read from the process itself
+string describe_launch(pid_t pid) {
+    string text;
+    errno = 0;
+    int niceness = getpriority(PRIO_PROCESS, pid);
+    if (errno == 0 && niceness != getpriority(PRIO_PROCESS, 0)) {
+        text += "nice " + to_string(niceness) + " ";
+    }
+    cpu_set_t cpus, own_cpus;
+    if (sched_getaffinity(pid, sizeof cpus, &cpus) == 0 && sched_getaffinity(0, sizeof own_cpus, &own_cpus) == 0
+        && !CPU_EQUAL(&cpus, &own_cpus)) {
+        text += "cpus " + LaunchSettings::format_cpus(cpus) + " ";
+    }
+    for (const auto& resource : LaunchSettings::resources) {
+        struct rlimit limit, own;
+        if (prlimit(pid, static_cast<__rlimit_resource>(resource.resource), nullptr, &limit) == 0
+            && getrlimit(resource.resource, &own) == 0 && limit.rlim_cur != own.rlim_cur) {
+            text += string("ulimit -") + resource.option + " "
+                    + (limit.rlim_cur == RLIM_INFINITY ? "unlimited" : to_string(limit.rlim_cur / resource.unit)) + " ";
+        }
+    }
+    if (!text.empty()) {
+        text.back() = ']';
+        text = "[" + text + "  ";
+    }
+    return text;
+}
+
+// jobs: list the background jobs, with the niceness, CPUs and limits the
+// running ones were launched with where they differ from the shell's
+int shell_jobs(const vector<string>& args, BuiltinIO& io) {
+    update_jobs();
+    for (const auto& job : background_jobs) {
+        string state = job_state(job);
+        io.out << "[" << job.id << "]  " << state << string(state.size() < 10 ? 10 - state.size() : 1, ' ')
+               << job.pid << "  " << (job.done ? "" : describe_launch(job.pid)) << job.command << '\n';
+    }
+    io.out.flush();
+    forget_ended_jobs();
+    return 1;
+}
+
+// nice [-n N]: with N, launch commands N nicer than the shell from now on;
+// without, print the niceness they get. `nice [-n N] command` runs one
+// command nicer (by 10 if N is not given).
+int shell_nice(const vector<string>& args, BuiltinIO& io) {
+    int adjustment;
+    bool given;
+    if (parse_nice(args, 0, adjustment, given) == 0) {
+        io.status = 1;
+    } else if (given) {
+        launch_defaults.set_niceness(adjustment);
+    } else {
+        io.out << getpriority(PRIO_PROCESS, 0) + launch_defaults.nice_increment() << endl;
+    }
+    return 1;
+}
+
+// affinity [CPUS]: pin launched commands to a CPU list such as 0-3,6, or
+// print the CPUs they run on. `affinity CPUS command` pins one command.
+int shell_affinity(const vector<string>& args, BuiltinIO& io) {
+    cpu_set_t cpus;
+    if (args.size() > 1) {
+        if (parse_affinity(args, 0, cpus) == 0) {
+            io.status = 1;
+        } else {
+            launch_defaults.set_affinity(cpus);
+        }
+        return 1;
+    }
+    if (const cpu_set_t* pinned = launch_defaults.affinity()) {
+        cpus = *pinned;
+    } else if (sched_getaffinity(0, sizeof cpus, &cpus) != 0) {
+        perror("affinity");
+        io.status = 1;
+        return 1;
+    }
+    io.out << LaunchSettings::format_cpus(cpus) << endl;
+    return 1;
+}
+
+// ulimit [-H|-S] [-a | -c|-d|-f|-l|-n|-s|-t|-u|-v] [limit]: set a limit for
+// the commands the shell launches, or print the limits they get. Sizes are
+// in kilobytes. `ulimit -X LIMIT command` limits one command.
+int shell_ulimit(const vector<string>& args, BuiltinIO& io) {
+    UlimitRequest request;
+    if (parse_ulimit(args, 0, request) == 0) {
+        io.status = 1;
+        return 1;
+    }
+    bool both = request.soft == request.hard;
+    if (request.has_value) {
+        launch_defaults.set_limit(request.resource->resource, request.value, request.soft || both,
+                                  request.hard || both);
+        return 1;
+    }
+
+    auto print = [&](const LaunchSettings::Resource& resource) {
+        struct rlimit current;
+        if (getrlimit(resource.resource, &current) != 0) {
+            perror("ulimit");
+            io.status = 1;
+            return;
+        }
+        if (const LaunchSettings::Limit* limit = launch_defaults.limit(resource.resource)) {
+            current.rlim_cur = limit->soft_set ? limit->soft : current.rlim_cur;
+            current.rlim_max = limit->hard_set ? limit->hard : current.rlim_max;
+        }
+        rlim_t value = request.hard && !request.soft ? current.rlim_max : current.rlim_cur;
+        if (request.all) {
+            char label[48];
+            snprintf(label, sizeof label, "%-28s(-%c) ", resource.description, resource.option);
+            io.out << label;
+        }
+        if (value == RLIM_INFINITY) {
+            io.out << "unlimited\n";
+        } else {
+            io.out << value / resource.unit << '\n';
+        }
+    };
+    if (request.all) {
+        for (const auto& resource : LaunchSettings::resources) {
+            print(resource);
+        }
+    } else {
+        print(*request.resource);
+    }
+    io.out.flush();
     return 1;
 }
 
-int shell_clear(vector<string> args) {
-    cout << "\033[2J\033[1;1H"; // ANSI escape codes to clear screen and move cursor
+int shell_clear(const vector<string>& args, BuiltinIO& io) {
+    io.out << "\033[2J\033[1;1H"; // ANSI escape codes to clear screen and move cursor
     return 1;
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+// Immutable string-keyed table whose perfect hash is computed at compile time.
+// Every key maps to its own slot, so a lookup is one hash, one probe and one
+// key comparison, with no allocation.
+template<typename Value, size_t N>
+class StaticMap {
+public:
+    struct Entry {
+        std::string_view first;
+        Value second;
+    };
+    typedef const Entry* const_iterator;
+
+private:
+    // Four slots per key keeps the seed search short even for a few dozen keys
+    static constexpr size_t tableSize() {
+        size_t size = 1;
+        while (size < N * 4) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    static constexpr size_t table_size = tableSize();
+    static constexpr uint32_t max_seed = 1u << 20;
+
+    Entry entries[N];                 // Keys in declaration order
+    unsigned short slots[table_size]; // Entry index + 1, 0 marks an empty slot
+    uint32_t seed;
+
+    // Seeded FNV-1a
+    static constexpr uint32_t hash(std::string_view key, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;
+        for (char c : key) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    constexpr bool placeAll(uint32_t candidate) {
+        for (size_t i = 0; i < table_size; ++i) {
+            slots[i] = 0;
+        }
+        for (size_t i = 0; i < N; ++i) {
+            size_t slot = hash(entries[i].first, candidate) & (table_size - 1);
+            if (slots[slot] != 0) {
+                return false;
+            }
+            slots[slot] = static_cast<unsigned short>(i + 1);
+        }
+        return true;
+    }
+
+public:
+    constexpr StaticMap(const std::pair<std::string_view, Value> (&init)[N])
+        : entries{}, slots{}, seed(0) {
+        static_assert(N < 0xFFFF, "StaticMap: too many keys");
+        for (size_t i = 0; i < N; ++i) {
+            entries[i].first = init[i].first;
+            entries[i].second = init[i].second;
+        }
+        // Duplicate keys collide under every seed, so the search is bounded
+        while (!placeAll(seed)) {
+            if (++seed == max_seed) {
+                throw std::logic_error("StaticMap: no perfect hash (duplicate key?)");
+            }
+        }
+    }
+
+    // Returns the value stored for key, or nullptr if it is absent
+    constexpr const Value* find(std::string_view key) const {
+        unsigned short slot = slots[hash(key, seed) & (table_size - 1)];
+        if (slot == 0 || entries[slot - 1].first != key) {
+            return nullptr;
+        }
+        return &entries[slot - 1].second;
+    }
+
+    constexpr bool contains(std::string_view key) const {
+        return find(key) != nullptr;
+    }
+
+    constexpr size_t size() const {
+        return N;
+    }
+
+    constexpr const_iterator begin() const {
+        return entries;
+    }
+
+    constexpr const_iterator end() const {
+        return entries + N;
+    }
+};
+
+template<typename Value, size_t N>
+constexpr StaticMap<Value, N> make_static_map(const std::pair<std::string_view, Value> (&init)[N]) {
+    return StaticMap<Value, N>(init);
+}
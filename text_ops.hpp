@@ -0,0 +1,430 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vector.hpp"
+
+// Bytes read per block from input that is not mapped
+constexpr size_t text_block_size = 128 * 1024;
+
+// Number of '\n' bytes in data
+inline size_t count_newlines(const char* data, size_t size) {
+    return vector_count(data, size, '\n');
+}
+
+// Length of the prefix of data that holds its next `lines` lines, lowering
+// lines by the number of complete lines in that prefix
+inline size_t take_lines(const char* data, size_t size, uint64_t& lines) {
+    size_t offset = 0;
+    while (lines > 0 && offset < size) {
+        const void* newline = memchr(data + offset, '\n', size - offset);
+        if (!newline) {
+            return size;
+        }
+        offset = static_cast<const char*>(newline) - data + 1;
+        --lines;
+    }
+    return offset;
+}
+
+// Scan data backwards for the newline in front of its last `lines` lines
+// (lines > 0). Returns true with offset just past that newline, or false
+// after lowering lines by the newlines data holds. Blocks with too few
+// newlines are skipped on a vectorized count alone.
+inline bool find_line_start(const char* data, size_t size, uint64_t& lines, size_t& offset) {
+    uint64_t count = count_newlines(data, size);
+    if (count < lines) {
+        lines -= count;
+        return false;
+    }
+    while (const void* newline = memrchr(data, '\n', size)) {
+        size = static_cast<const char*>(newline) - data;
+        if (--lines == 0) {
+            offset = size + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Offset where the last `lines` lines of data start. A final line without
+// a newline counts as a line.
+inline size_t last_lines_start(const char* data, size_t size, uint64_t lines) {
+    if (lines == 0) {
+        return size;
+    }
+    size_t scan = size > 0 && data[size - 1] == '\n' ? size - 1 : size;
+    size_t offset;
+    return find_line_start(data, scan, lines, offset) ? offset : 0;
+}
+
+// pread exactly size bytes at offset. Returns false with errno set if that
+// fails, including when the file has shrunk below offset + size.
+inline bool read_at(int fd, char* data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pread(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            errno = n == 0 ? ENODATA : errno;
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Offset where the last `lines` lines of a file of the given size start.
+// Reads backwards from the end in blocks, so the cost follows the amount
+// printed rather than the size of the file. Returns -1 with errno set if
+// reading fails.
+inline off_t last_lines_start(int fd, off_t size, uint64_t lines) {
+    if (lines == 0) {
+        return size;
+    }
+    std::unique_ptr<char[]> buffer(new char[text_block_size]);
+    for (off_t end = size; end > 0;) {
+        size_t length = std::min<off_t>(end, text_block_size);
+        off_t start = end - length;
+        if (!read_at(fd, buffer.get(), length, start)) {
+            return -1;
+        }
+        size_t scan = end == size && buffer[length - 1] == '\n' ? length - 1 : length;
+        size_t offset;
+        if (find_line_start(buffer.get(), scan, lines, offset)) {
+            return start + offset;
+        }
+        end = start;
+    }
+    return 0;
+}
+
+// Write everything from offset up to the current end of fd to out. Returns
+// the offset reached, or -1 with errno set if reading fails.
+inline off_t copy_to_end(int fd, off_t offset, std::ostream& out) {
+    std::unique_ptr<char[]> buffer(new char[text_block_size]);
+    for (;;) {
+        ssize_t n = pread(fd, buffer.get(), text_block_size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0 || !out.write(buffer.get(), n)) {
+            return offset + n;
+        }
+        offset += n;
+    }
+}
+
+// Feed a file to consume(data, size) in blocks until the end, or until
+// consume returns false. Large regular files are mapped and scanned in
+// place; anything else is read through a buffer. Returns false with errno
+// set if reading fails.
+template<typename Consume>
+bool read_blocks(int fd, Consume consume) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= static_cast<off_t>(text_block_size)) {
+        size_t size = st.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            consume(static_cast<const char*>(mapped), size);
+            munmap(mapped, size);
+            return true;
+        }
+    }
+    std::unique_ptr<char[]> buffer(new char[text_block_size]);
+    for (;;) {
+        ssize_t n = ::read(fd, buffer.get(), text_block_size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0 || !consume(buffer.get(), static_cast<size_t>(n))) {
+            return true;
+        }
+    }
+}
+
+// read_blocks over a stream, such as a builtin's standard input. Hands on
+// whatever the stream has buffered rather than waiting for a full block, so
+// `head` on a slow pipe prints as soon as its lines arrive.
+template<typename Consume>
+void read_blocks(std::streambuf& in, Consume consume) {
+    std::unique_ptr<char[]> buffer(new char[text_block_size]);
+    while (in.sgetc() != std::char_traits<char>::eof()) {
+        std::streamsize available = std::min<std::streamsize>(in.in_avail(), text_block_size);
+        std::streamsize n = in.sgetn(buffer.get(), std::max<std::streamsize>(available, 1));
+        if (n <= 0 || !consume(buffer.get(), static_cast<size_t>(n))) {
+            return;
+        }
+    }
+}
+
+// Line, word and byte counts of a stream of blocks. Words are runs of bytes
+// other than ASCII whitespace; one split across two blocks counts once.
+// Without words, lines come from the vectorized newline count alone.
+class TextCounter {
+private:
+    bool count_words;
+    bool in_word;
+
+public:
+    uint64_t lines;
+    uint64_t words;
+    uint64_t bytes;
+
+    explicit TextCounter(bool count_words) : count_words(count_words), in_word(false), lines(0), words(0), bytes(0) {}
+
+    void add(const char* data, size_t size) {
+        bytes += size;
+        if (!count_words) {
+            lines += count_newlines(data, size);
+            return;
+        }
+        for (size_t i = 0; i < size; ++i) {
+            unsigned char c = data[i];
+            bool space = c == ' ' || (c >= '\t' && c <= '\r');
+            lines += c == '\n';
+            words += !space && !in_word;
+            in_word = !space;
+        }
+    }
+};
+
+// The last `lines` lines of a stream that cannot be read backwards, such as
+// a pipe. Whole blocks are kept, dropping the oldest once the newer ones
+// hold enough lines by themselves.
+class TailBuffer {
+private:
+    struct Block {
+        std::string data;
+        uint64_t newlines;
+    };
+
+    uint64_t lines;
+    uint64_t newlines; // Total over blocks
+    std::deque<Block> blocks;
+
+public:
+    explicit TailBuffer(uint64_t lines) : lines(lines), newlines(0) {}
+
+    void add(const char* data, size_t size) {
+        uint64_t count = count_newlines(data, size);
+        blocks.push_back(Block{std::string(data, size), count});
+        newlines += count;
+        // More than `lines` newlines after the first block: its start is not needed
+        while (blocks.size() > 1 && newlines - blocks.front().newlines > lines) {
+            newlines -= blocks.front().newlines;
+            blocks.pop_front();
+        }
+    }
+
+    void write(std::ostream& out) const {
+        std::string text;
+        for (const Block& block : blocks) {
+            text += block.data;
+        }
+        size_t start = last_lines_start(text.data(), text.size(), lines);
+        out.write(text.data() + start, text.size() - start);
+    }
+};
+
+// While any instance exists, SIGINT sets a flag and makes wait_fd()
+// readable instead of killing the shell, so a builtin that waits
+// indefinitely can be stopped with Ctrl-C. The previous disposition comes
+// back with the last instance; pipeline threads may each hold one.
+class InterruptGuard {
+private:
+    static inline std::mutex lock;
+    static inline size_t users = 0;
+    static inline int pipe_fds[2] = {-1, -1};
+    static inline volatile sig_atomic_t interrupted = 0;
+    static inline struct sigaction previous;
+
+    static void handle(int) {
+        int saved_errno = errno;
+        interrupted = 1;
+        if (pipe_fds[1] != -1) {
+            ssize_t ignored = ::write(pipe_fds[1], "", 1);
+            (void)ignored;
+        }
+        errno = saved_errno;
+    }
+
+public:
+    InterruptGuard() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (users++ > 0) {
+            return;
+        }
+        interrupted = 0;
+        if (pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+            pipe_fds[0] = pipe_fds[1] = -1;
+        }
+        struct sigaction action = {};
+        action.sa_handler = handle;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &previous);
+    }
+
+    ~InterruptGuard() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (--users > 0) {
+            return;
+        }
+        sigaction(SIGINT, &previous, nullptr);
+        for (int& fd : pipe_fds) {
+            if (fd != -1) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+    int wait_fd() const {
+        return pipe_fds[0];
+    }
+
+    bool raised() const {
+        return interrupted;
+    }
+};
+
+// `tail -f`: prints what is appended to files after their end has been
+// shown. Sleeps on inotify rather than polling the files, and follows the
+// open descriptor, so a renamed file is still followed. Stops on Ctrl-C or
+// once writing fails because the reading end of a pipe has gone.
+class FileFollower {
+private:
+    struct Followed {
+        std::string name;
+        int fd;
+        off_t offset;
+        int watch;
+    };
+
+    std::ostream& out;
+    bool headers;   // Name the file before output that switches files
+    size_t current; // File the last output came from
+    int notify_fd;
+    std::vector<Followed> files;
+
+    void drain(Followed& file, size_t index) {
+        struct stat st;
+        if (fstat(file.fd, &st) != 0) {
+            return;
+        }
+        if (st.st_size < file.offset) {
+            std::cerr << "tail: " << file.name << ": file truncated" << std::endl;
+            file.offset = 0;
+        }
+        if (st.st_size == file.offset) {
+            return;
+        }
+        if (headers && index != current) {
+            out << "\n==> " << file.name << " <==\n";
+        }
+        current = index;
+        off_t reached = copy_to_end(file.fd, file.offset, out);
+        if (reached < 0) {
+            std::cerr << "tail: " << file.name << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        file.offset = reached;
+        out.flush();
+    }
+
+public:
+    FileFollower(std::ostream& out, bool headers) : out(out), headers(headers), current(0), notify_fd(-1) {}
+
+    ~FileFollower() {
+        for (const Followed& file : files) {
+            ::close(file.fd);
+        }
+        if (notify_fd != -1) {
+            ::close(notify_fd);
+        }
+    }
+
+    FileFollower(const FileFollower&) = delete;
+    FileFollower& operator=(const FileFollower&) = delete;
+
+    // Follow fd (taken over) from offset. The last file added is taken to
+    // be the one output came from most recently.
+    bool add(const std::string& name, int fd, off_t offset) {
+        if (notify_fd == -1) {
+            notify_fd = inotify_init1(IN_CLOEXEC);
+        }
+        // The watch is on the inode, so it too survives a rename
+        int watch = notify_fd == -1 ? -1 : inotify_add_watch(notify_fd, name.c_str(), IN_MODIFY);
+        if (watch == -1) {
+            std::cerr << "tail: " << name << ": cannot follow: " << strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+        current = files.size();
+        files.push_back(Followed{name, fd, offset, watch});
+        return true;
+    }
+
+    void run() {
+        if (files.empty()) {
+            return;
+        }
+        InterruptGuard interrupt;
+        // Anything appended between the initial output and the watch
+        for (size_t i = 0; i < files.size(); ++i) {
+            drain(files[i], i);
+        }
+        alignas(struct inotify_event) char buffer[4096];
+        while (!interrupt.raised() && out) {
+            struct pollfd fds[2] = {{notify_fd, POLLIN, 0}, {interrupt.wait_fd(), POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[1].revents != 0) {
+                break;
+            }
+            ssize_t n = ::read(notify_fd, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < n;) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+                offset += sizeof(struct inotify_event) + event->len;
+                for (size_t i = 0; i < files.size(); ++i) {
+                    if (files[i].watch == event->wd) {
+                        drain(files[i], i);
+                    }
+                }
+            }
+        }
+    }
+};
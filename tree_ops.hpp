@@ -0,0 +1,837 @@
+#pragma once
+#include "map.hpp"
+#include "work_pool.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// One directory entry as reported by the kernel
+struct DirEntry {
+    std::string name;
+    ino_t inode;
+    unsigned char type; // DT_* value; DT_UNKNOWN if the filesystem did not say
+};
+
+// Read every entry of the open directory fd except "." and "..". Uses
+// getdents64 directly so no DIR stream, and none of its buffer, is kept per
+// open directory. Returns false with errno set on failure.
+inline bool read_directory(int fd, std::vector<DirEntry>& entries) {
+    alignas(struct dirent64) char buffer[32 * 1024];
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0;
+        }
+        // struct dirent64 has the kernel's linux_dirent64 layout
+        for (long offset = 0; offset < n;) {
+            const struct dirent64* entry = reinterpret_cast<const struct dirent64*>(buffer + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            entries.push_back(DirEntry{name, static_cast<ino_t>(entry->d_ino), entry->d_type});
+        }
+    }
+}
+
+// Last component of a path, ignoring trailing slashes
+inline std::string base_name(const std::string& path) {
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string::npos) {
+        return "/";
+    }
+    size_t start = path.rfind('/', end) + 1; // npos + 1 == 0
+    return path.substr(start, end + 1 - start);
+}
+
+// statx of name relative to dir_fd, without following a final symbolic
+// link, asking only for the fields in mask. An empty name means dir_fd itself.
+inline bool stat_entry(int dir_fd, const std::string& name, unsigned mask, struct statx& stx) {
+    int flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC | (name.empty() ? AT_EMPTY_PATH : 0);
+    return statx(dir_fd, name.c_str(), flags, mask, &stx) == 0;
+}
+
+// Thread-safe set of (device, inode) pairs, used to count each hard-linked
+// file once. Inode numbers are scrambled before being used as Map keys:
+// filesystems often hand them out in order, which would degenerate the tree.
+class InodeSet {
+private:
+    static constexpr size_t shard_count = 64;
+
+    struct Shard {
+        std::mutex lock;
+        Map<std::pair<uint64_t, uint64_t>, bool> seen;
+    };
+
+    Shard shards[shard_count];
+
+public:
+    // True the first time a given file is inserted
+    bool insert(uint64_t device, uint64_t inode) {
+        uint64_t key = inode * 0x9E3779B97F4A7C15ull; // Odd multiplier, so still one-to-one
+        Shard& shard = shards[key >> 58];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.seen.try_emplace(std::make_pair(key, device), true).second;
+    }
+};
+
+// Copy everything from in to out, starting at both current offsets. Uses
+// copy_file_range so the data stays in the kernel (and can be reflinked or
+// copied server-side), falling back to read/write where it is unsupported.
+inline bool copy_fd_contents(int in, int out, uint64_t& copied) {
+    bool kernel_copy = true;
+    for (;;) {
+        ssize_t n = kernel_copy ? copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0) : -1;
+        if (n > 0) {
+            copied += n;
+            continue;
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (kernel_copy && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                            || errno == EOPNOTSUPP || errno == EBADF)) {
+            kernel_copy = false;
+            break;
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    static constexpr size_t buffer_size = 128 * 1024;
+    std::unique_ptr<char[]> buffer(new char[buffer_size]);
+    for (;;) {
+        ssize_t n = ::read(in, buffer.get(), buffer_size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = ::write(out, buffer.get() + done, n - done);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += written;
+        }
+        copied += n;
+    }
+}
+
+// Counters updated while a tree operation runs
+struct TreeProgress {
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> directories{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+};
+
+// Parallel walk over directory trees using only fd-relative system calls
+// (openat, fstatat, unlinkat, ...), so no path is resolved twice and nothing
+// above the directory being worked on is looked up again.
+//
+// Each directory becomes a task on a WorkStealingPool. Files are handed out
+// in batches, so one huge directory is also spread across threads. A
+// directory stays open until its own listing and every task spawned for its
+// entries have finished; then close() runs, which is where post-order work
+// such as removing the directory happens.
+//
+// Open descriptors are bounded: once fd_budget directories are open, further
+// subdirectories are walked synchronously by the thread that found them,
+// which adds at most one descriptor per level of depth.
+class TreeOperation {
+protected:
+    // A directory of the walk. For operations with a destination (copy),
+    // target is the matching destination directory.
+    struct Directory {
+        Directory* parent;       // nullptr for an operand
+        int parent_fd;           // AT_FDCWD for an operand
+        int parent_target;
+        std::string name;        // Relative to parent_fd
+        std::string target_name; // Relative to parent_target
+        std::string path;        // Source path, for messages and output
+        int fd;
+        int target;
+        mode_t mode;
+        mutable std::atomic<uint64_t> total; // Free for subclasses that sum over a subtree
+
+        Directory(const std::string& operand, const std::string& target_operand)
+            : parent(nullptr), parent_fd(AT_FDCWD), parent_target(AT_FDCWD), name(operand),
+              target_name(target_operand), path(operand), fd(-1), target(-1), mode(0), total(0) {}
+
+        Directory(Directory* parent, const std::string& name)
+            : parent(parent), parent_fd(parent->fd), parent_target(parent->target), name(name),
+              target_name(name), path(child_path(*parent, name)), fd(-1), target(-1), mode(0), total(0) {}
+    };
+
+    const char* command;
+    TreeProgress progress;
+
+    // Open dir.fd (and dir.target). Returns false, having reported why, if
+    // the directory should be skipped.
+    virtual bool open(Directory& dir) = 0;
+    // Act on a non-directory entry of dir
+    virtual void visit(const Directory& dir, const DirEntry& entry) = 0;
+    // Called once everything below dir is done; must close dir's descriptors
+    virtual void close(Directory& dir) = 0;
+
+    // Stop the walk early: directories not yet listed are skipped
+    void cancel() {
+        cancelled.store(true);
+    }
+
+    bool is_cancelled() const {
+        return cancelled.load();
+    }
+
+    // For output shared by the walking threads
+    std::mutex output_lock;
+
+    // Print "command: what 'path': error" (no error text if error is 0)
+    void report(const std::string& what, const std::string& path, int error) {
+        progress.errors.fetch_add(1);
+        std::string message = std::string(command) + ": " + what + " '" + path + "'"
+            + (error ? std::string(": ") + strerror(error) : std::string()) + "\n";
+        std::lock_guard<std::mutex> guard(output_lock);
+        std::cerr << message << std::flush;
+    }
+
+    static std::string child_path(const Directory& dir, const std::string& name) {
+        return dir.path.back() == '/' ? dir.path + name : dir.path + "/" + name;
+    }
+
+private:
+    static constexpr size_t batch_size = 256;
+
+    struct Node : Directory {
+        std::atomic<size_t> pending; // The listing plus each unfinished child task
+
+        Node(const std::string& operand, const std::string& target_operand)
+            : Directory(operand, target_operand), pending(1) {}
+
+        Node(Node* parent, const std::string& name) : Directory(parent, name), pending(1) {}
+    };
+
+    WorkStealingPool pool;
+    std::atomic<long> fd_budget;
+    long fd_cost; // Descriptors one open directory holds
+    bool show_progress;
+    std::atomic<bool> cancelled;
+
+    bool acquireFds() {
+        long available = fd_budget.load();
+        while (available >= fd_cost) {
+            if (fd_budget.compare_exchange_weak(available, available - fd_cost)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Fill in DT_UNKNOWN from fstatat; true if the entry is a directory
+    static bool isDirectory(int dir_fd, DirEntry& entry) {
+        if (entry.type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dir_fd, entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                entry.type = IFTODT(st.st_mode);
+            }
+        }
+        return entry.type == DT_DIR;
+    }
+
+    // A task or a child has finished; close the directory after the last one
+    void release(Node* node) {
+        if (node->pending.fetch_sub(1) != 1) {
+            return;
+        }
+        close(*node);
+        fd_budget.fetch_add(fd_cost);
+        Node* parent = static_cast<Node*>(node->parent); // Nodes only have Node parents
+        delete node;
+        if (parent) {
+            release(parent);
+        }
+    }
+
+    // List an open directory, spawning tasks for its subdirectories and for
+    // all but the last batch of its other entries
+    void list(Node* node) {
+        progress.directories.fetch_add(1);
+        std::vector<DirEntry> entries;
+        if (!is_cancelled() && !read_directory(node->fd, entries)) {
+            report("cannot read directory", node->path, errno);
+        }
+
+        std::vector<DirEntry> batch;
+        for (auto& entry : entries) {
+            if (isDirectory(node->fd, entry)) {
+                if (acquireFds()) {
+                    Node* child = new Node(node, entry.name);
+                    node->pending.fetch_add(1);
+                    pool.submit([this, child] {
+                        if (!is_cancelled() && open(*child)) {
+                            list(child);
+                        } else {
+                            fd_budget.fetch_add(fd_cost);
+                            Node* parent = static_cast<Node*>(child->parent);
+                            delete child;
+                            release(parent);
+                        }
+                    });
+                } else {
+                    Directory child(node, entry.name);
+                    walkInline(child);
+                }
+                continue;
+            }
+            batch.push_back(std::move(entry));
+            if (batch.size() == batch_size) {
+                node->pending.fetch_add(1);
+                pool.submit([this, node, batch = std::move(batch)] {
+                    for (size_t i = 0; i < batch.size() && !is_cancelled(); ++i) {
+                        visit(*node, batch[i]);
+                    }
+                    release(node);
+                });
+                batch.clear();
+            }
+        }
+        for (size_t i = 0; i < batch.size() && !is_cancelled(); ++i) {
+            visit(*node, batch[i]);
+        }
+        release(node);
+    }
+
+    // Depth-first walk on the calling thread, used when the fd budget is spent
+    void walkInline(Directory& dir) {
+        if (is_cancelled() || !open(dir)) {
+            return;
+        }
+        progress.directories.fetch_add(1);
+        std::vector<DirEntry> entries;
+        if (!read_directory(dir.fd, entries)) {
+            report("cannot read directory", dir.path, errno);
+        }
+        for (auto& entry : entries) {
+            if (is_cancelled()) {
+                break;
+            }
+            if (isDirectory(dir.fd, entry)) {
+                Directory child(&dir, entry.name);
+                walkInline(child);
+            } else {
+                visit(dir, entry);
+            }
+        }
+        close(dir);
+    }
+
+    static long defaultBudget() {
+        struct rlimit limit;
+        long budget = 256;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            budget = std::min<long>(1024, limit.rlim_cur / 4);
+        }
+        return std::max<long>(16, budget);
+    }
+
+    static std::string describeBytes(uint64_t bytes) {
+        static const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+        double value = bytes;
+        size_t unit = 0;
+        while (value >= 1024 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+            value /= 1024;
+            ++unit;
+        }
+        char text[32];
+        snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+        return text;
+    }
+
+protected:
+    TreeOperation(const char* command, long fds_per_directory, bool show_progress = true)
+        : command(command), fd_budget(defaultBudget()), fd_cost(fds_per_directory),
+          show_progress(show_progress), cancelled(false) {}
+
+    // Start walking the directory tree at operand (mirrored at
+    // target_operand, for operations with a destination). The operand is
+    // opened on the calling thread; everything below it runs on the pool.
+    void walk(const std::string& operand, const std::string& target_operand) {
+        Node* node = new Node(operand, target_operand);
+        if (!open(*node)) {
+            delete node;
+            return;
+        }
+        fd_budget.fetch_sub(fd_cost); // The operand always gets its descriptors
+        pool.submit([this, node] { list(node); });
+    }
+
+public:
+    // Subclass destructors must call finish(), since queued tasks call back
+    // into their overrides
+    virtual ~TreeOperation() {}
+
+    // Wait for every walk to complete. While waiting, a progress line is
+    // kept on standard error if it is a terminal and the work takes a while.
+    // Returns true if nothing failed.
+    bool finish() {
+        using namespace std::chrono;
+        bool terminal = show_progress && isatty(STDERR_FILENO);
+        bool shown = false;
+        auto started = steady_clock::now();
+        while (!pool.wait_for(milliseconds(250))) {
+            if (!terminal || steady_clock::now() - started < seconds(1)) {
+                continue;
+            }
+            std::string line = "\r" + std::string(command) + ": "
+                + std::to_string(progress.files.load()) + " files, "
+                + std::to_string(progress.directories.load()) + " directories";
+            if (progress.bytes.load() > 0) {
+                line += ", " + describeBytes(progress.bytes.load());
+            }
+            std::lock_guard<std::mutex> guard(output_lock);
+            std::cerr << line << "\x1b[K" << std::flush;
+            shown = true;
+        }
+        if (shown) {
+            std::cerr << "\r\x1b[K" << std::flush;
+        }
+        return progress.errors.load() == 0;
+    }
+
+    const TreeProgress& counters() const {
+        return progress;
+    }
+};
+
+// rm -r: files are unlinked as the walk finds them, each directory once
+// everything inside it is gone
+class RemoveTree : public TreeOperation {
+protected:
+    bool open(Directory& dir) override {
+        dir.fd = openat(dir.parent_fd, dir.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir.fd != -1) {
+            return true;
+        }
+        int error = errno;
+        // An unreadable directory can still be removed if it is empty
+        if (unlinkat(dir.parent_fd, dir.name.c_str(), AT_REMOVEDIR) != 0) {
+            report("cannot remove", dir.path, error);
+        }
+        return false;
+    }
+
+    void visit(const Directory& dir, const DirEntry& entry) override {
+        if (unlinkat(dir.fd, entry.name.c_str(), 0) == 0) {
+            progress.files.fetch_add(1);
+        } else {
+            report("cannot remove", child_path(dir, entry.name), errno);
+        }
+    }
+
+    void close(Directory& dir) override {
+        ::close(dir.fd);
+        if (unlinkat(dir.parent_fd, dir.name.c_str(), AT_REMOVEDIR) != 0) {
+            report("cannot remove", dir.path, errno);
+        }
+    }
+
+public:
+    RemoveTree() : TreeOperation("rm", 1) {}
+
+    ~RemoveTree() override {
+        finish(); // Before the overrides above go away
+    }
+
+    // Queue removal of the directory tree at path
+    void remove(const std::string& path) {
+        walk(path, path);
+    }
+};
+
+// cp -r: directories are created as the walk enters them (owner-writable,
+// so they can be filled) and get their real permissions once complete
+class CopyTree : public TreeOperation {
+private:
+    // Destination roots, skipped if met in a source (copying a tree into itself)
+    std::mutex roots_lock;
+    std::vector<std::pair<dev_t, ino_t>> roots;
+
+    bool isRoot(const struct stat& st) {
+        std::lock_guard<std::mutex> guard(roots_lock);
+        for (const auto& root : roots) {
+            if (root.first == st.st_dev && root.second == st.st_ino) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void copyFile(const Directory& dir, const DirEntry& entry) {
+        std::string path = child_path(dir, entry.name);
+        int in = openat(dir.fd, entry.name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+        if (in == -1 || fstat(in, &st) != 0) {
+            report("cannot open", path, errno);
+            if (in != -1) {
+                ::close(in);
+            }
+            return;
+        }
+        int out = openat(dir.target, entry.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+        if (out == -1) {
+            report("cannot create", path, errno);
+            ::close(in);
+            return;
+        }
+        uint64_t copied = 0;
+        if (!copy_fd_contents(in, out, copied)) {
+            report("error copying", path, errno);
+        } else {
+            progress.files.fetch_add(1);
+        }
+        progress.bytes.fetch_add(copied);
+        ::close(in);
+        ::close(out);
+    }
+
+    void copyLink(const Directory& dir, const DirEntry& entry) {
+        std::vector<char> link(256);
+        ssize_t length;
+        while ((length = readlinkat(dir.fd, entry.name.c_str(), link.data(), link.size()))
+               == static_cast<ssize_t>(link.size())) {
+            link.resize(link.size() * 2);
+        }
+        if (length < 0) {
+            report("cannot read link", child_path(dir, entry.name), errno);
+            return;
+        }
+        link[length] = '\0';
+        if (symlinkat(link.data(), dir.target, entry.name.c_str()) != 0
+            && !(errno == EEXIST && unlinkat(dir.target, entry.name.c_str(), 0) == 0
+                 && symlinkat(link.data(), dir.target, entry.name.c_str()) == 0)) {
+            report("cannot create link", child_path(dir, entry.name), errno);
+            return;
+        }
+        progress.files.fetch_add(1);
+    }
+
+protected:
+    bool open(Directory& dir) override {
+        // Symbolic links are copied as links, except for the operand itself
+        int follow = dir.parent_fd == AT_FDCWD ? 0 : O_NOFOLLOW;
+        dir.fd = openat(dir.parent_fd, dir.name.c_str(), O_RDONLY | O_DIRECTORY | follow | O_CLOEXEC);
+        struct stat st;
+        if (dir.fd == -1 || fstat(dir.fd, &st) != 0) {
+            report("cannot open directory", dir.path, errno);
+            if (dir.fd != -1) {
+                ::close(dir.fd);
+            }
+            return false;
+        }
+        if (isRoot(st)) {
+            report("cannot copy a directory into itself", dir.path, 0);
+            ::close(dir.fd);
+            return false;
+        }
+        dir.mode = st.st_mode & 07777;
+
+        if (mkdirat(dir.parent_target, dir.target_name.c_str(), 0700) != 0 && errno != EEXIST) {
+            report("cannot create directory", dir.path, errno);
+            ::close(dir.fd);
+            return false;
+        }
+        dir.target = openat(dir.parent_target, dir.target_name.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir.target == -1 || fstat(dir.target, &st) != 0) {
+            report("cannot open directory", dir.path, errno);
+            ::close(dir.fd);
+            if (dir.target != -1) {
+                ::close(dir.target);
+            }
+            return false;
+        }
+        if (dir.parent_target == AT_FDCWD) {
+            std::lock_guard<std::mutex> guard(roots_lock);
+            roots.emplace_back(st.st_dev, st.st_ino);
+        }
+        return true;
+    }
+
+    void visit(const Directory& dir, const DirEntry& entry) override {
+        if (entry.type == DT_LNK) {
+            copyLink(dir, entry);
+        } else if (entry.type == DT_REG) {
+            copyFile(dir, entry);
+        } else {
+            report("skipping special file", child_path(dir, entry.name), 0);
+        }
+    }
+
+    void close(Directory& dir) override {
+        if (fchmod(dir.target, dir.mode) != 0) {
+            report("cannot set permissions of", dir.path, errno);
+        }
+        ::close(dir.target);
+        ::close(dir.fd);
+    }
+
+public:
+    CopyTree() : TreeOperation("cp", 2) {}
+
+    ~CopyTree() override {
+        finish();
+    }
+
+    // Queue a copy of the directory tree at source to target, which is
+    // created if it does not exist
+    void copy(const std::string& source, const std::string& target) {
+        walk(source, target);
+    }
+};
+
+// du: each directory's total is summed bottom-up as its subtree completes,
+// and printed as soon as it is final
+class DiskUsage : public TreeOperation {
+public:
+    struct Options {
+        bool all = false;       // -a: also list files
+        bool summarize = false; // -s: only list the operands
+        bool human = false;     // -h: sizes like 1.5M instead of KiB blocks
+    };
+
+private:
+    std::ostream& out;
+    Options options;
+    InodeSet hard_links;
+
+    static constexpr unsigned file_mask = STATX_BLOCKS | STATX_NLINK | STATX_INO;
+
+protected:
+    bool open(Directory& dir) override {
+        int follow = dir.parent ? O_NOFOLLOW : 0;
+        dir.fd = openat(dir.parent_fd, dir.name.c_str(), O_RDONLY | O_DIRECTORY | follow | O_CLOEXEC);
+        if (dir.fd == -1) {
+            report("cannot read directory", dir.path, errno);
+            return false;
+        }
+        struct statx stx;
+        dir.total = stat_entry(dir.fd, "", STATX_BLOCKS, stx) ? stx.stx_blocks * 512 : 0;
+        return true;
+    }
+
+    void visit(const Directory& dir, const DirEntry& entry) override {
+        struct statx stx;
+        if (!stat_entry(dir.fd, entry.name, file_mask, stx)) {
+            report("cannot access", child_path(dir, entry.name), errno);
+            return;
+        }
+        if (stx.stx_nlink > 1 && !hard_links.insert(makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino)) {
+            return;
+        }
+        uint64_t bytes = stx.stx_blocks * 512;
+        dir.total.fetch_add(bytes);
+        progress.files.fetch_add(1);
+        if (options.all && !options.summarize) {
+            print(bytes, child_path(dir, entry.name));
+        }
+    }
+
+    void close(Directory& dir) override {
+        ::close(dir.fd);
+        if (!options.summarize || !dir.parent) {
+            print(dir.total, dir.path);
+        }
+        if (dir.parent) {
+            dir.parent->total.fetch_add(dir.total);
+        }
+    }
+
+public:
+    DiskUsage(std::ostream& out, Options options)
+        : TreeOperation("du", 1, false), out(out), options(options) {}
+
+    ~DiskUsage() override {
+        finish();
+    }
+
+    // Write "size<TAB>path"; stops the walk once the output is closed
+    void print(uint64_t bytes, const std::string& path) {
+        std::string line = format(bytes, options.human) + "\t" + path + "\n";
+        std::lock_guard<std::mutex> guard(output_lock);
+        if (!(out << line)) {
+            cancel();
+        }
+    }
+
+    // Sizes are shown in KiB rounded up, or with -h in the largest unit that
+    // keeps the number below 1024 (one decimal below 10)
+    static std::string format(uint64_t bytes, bool human) {
+        if (!human) {
+            return std::to_string((bytes + 1023) / 1024);
+        }
+        static const char units[] = "KMGTPE";
+        if (bytes < 1024) {
+            return std::to_string(bytes);
+        }
+        double value = bytes / 1024.0;
+        size_t unit = 0;
+        while (value >= 1024 && unit + 1 < sizeof(units) - 1) {
+            value /= 1024;
+            ++unit;
+        }
+        char text[32];
+        if (value < 10) {
+            snprintf(text, sizeof(text), "%.1f%c", std::ceil(value * 10) / 10, units[unit]);
+        } else {
+            snprintf(text, sizeof(text), "%.0f%c", std::ceil(value), units[unit]);
+        }
+        return text;
+    }
+
+    // Queue the tree at path
+    void add(const std::string& path) {
+        walk(path, path);
+    }
+
+    // Account for a hard-linked operand that is not a directory; false if
+    // it was already counted
+    bool first_link(const struct statx& stx) {
+        return stx.stx_nlink <= 1 || hard_links.insert(makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino);
+    }
+};
+
+// find: every entry is tested as soon as the walk reaches it and printed at
+// once, so output streams while the walk is still running
+class FindFiles : public TreeOperation {
+public:
+    // Tests that must all hold for an entry to be printed
+    struct Criteria {
+        std::string name;            // -name: glob matched against the last component
+        unsigned char type = 0;      // -type: DT_* value, 0 for any
+        bool has_size = false;       // -size [+-]n[cwbkMG]
+        int size_sign = 0;           // +1 more than, -1 less than, 0 exactly
+        uint64_t size_count = 0;
+        uint64_t size_unit = 512;
+        bool has_newer = false;      // -newer file
+        struct statx_timestamp newer = {};
+    };
+
+private:
+    std::ostream& out;
+    Criteria criteria;
+
+    bool matches(int dir_fd, const std::string& name, const std::string& last_component, unsigned char type) {
+        if (!criteria.name.empty() && fnmatch(criteria.name.c_str(), last_component.c_str(), 0) != 0) {
+            return false;
+        }
+        if (criteria.type != 0 && type != criteria.type) {
+            return false;
+        }
+        if (!criteria.has_size && !criteria.has_newer) {
+            return true;
+        }
+
+        struct statx stx;
+        if (!stat_entry(dir_fd, name, STATX_SIZE | STATX_MTIME, stx)) {
+            return false;
+        }
+        if (criteria.has_size) {
+            // Sizes round up to whole units, as GNU find does
+            uint64_t units = (stx.stx_size + criteria.size_unit - 1) / criteria.size_unit;
+            if (criteria.size_sign > 0 ? units <= criteria.size_count
+                : criteria.size_sign < 0 ? units >= criteria.size_count
+                : units != criteria.size_count) {
+                return false;
+            }
+        }
+        if (criteria.has_newer) {
+            const struct statx_timestamp& mtime = stx.stx_mtime;
+            if (mtime.tv_sec < criteria.newer.tv_sec
+                || (mtime.tv_sec == criteria.newer.tv_sec && mtime.tv_nsec <= criteria.newer.tv_nsec)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void print(const std::string& path) {
+        std::string line = path + "\n";
+        std::lock_guard<std::mutex> guard(output_lock);
+        if (!(out << line)) {
+            cancel();
+        }
+    }
+
+protected:
+    bool open(Directory& dir) override {
+        if (matches(dir.parent_fd, dir.name, dir.parent ? dir.name : base_name(dir.name), DT_DIR)) {
+            print(dir.path);
+        }
+        int follow = dir.parent ? O_NOFOLLOW : 0;
+        dir.fd = openat(dir.parent_fd, dir.name.c_str(), O_RDONLY | O_DIRECTORY | follow | O_CLOEXEC);
+        if (dir.fd == -1) {
+            report("cannot open directory", dir.path, errno);
+            return false;
+        }
+        return true;
+    }
+
+    void visit(const Directory& dir, const DirEntry& entry) override {
+        progress.files.fetch_add(1);
+        if (matches(dir.fd, entry.name, entry.name, entry.type)) {
+            print(child_path(dir, entry.name));
+        }
+    }
+
+    void close(Directory& dir) override {
+        ::close(dir.fd);
+    }
+
+public:
+    FindFiles(std::ostream& out, Criteria criteria)
+        : TreeOperation("find", 1, false), out(out), criteria(std::move(criteria)) {}
+
+    ~FindFiles() override {
+        finish();
+    }
+
+    // Queue the tree at path
+    void add(const std::string& path) {
+        walk(path, path);
+    }
+
+    // Test and print an operand that is not a directory
+    void add_file(const std::string& path, unsigned char type) {
+        if (matches(AT_FDCWD, path, base_name(path), type)) {
+            print(path);
+        }
+    }
+};
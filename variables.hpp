@@ -0,0 +1,233 @@
+#pragma once
+#include "map.hpp"
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+
+// The shell's variables, seeded from the environment it was started with.
+// Exported variables make up the environment of spawned commands; the envp
+// array for them is built on first use and kept until an exported variable
+// changes, so starting a command does not serialize the environment again.
+class Variables {
+private:
+    struct Variable {
+        std::string value;
+        bool exported;
+        bool defined; // False after `export NAME` on an unset name
+    };
+
+    Map<std::string, Variable> variables;
+    std::vector<std::string> entries; // "NAME=value" for each exported variable
+    std::vector<char*> pointers;      // entries as envp, null-terminated
+    bool stale;
+    std::vector<std::string> arguments;
+    int last_status = 0;
+    pid_t last_background = 0;
+
+    void appendSpecial(char c, std::string& out) const {
+        switch (c) {
+        case '$':
+            out += std::to_string(getpid());
+            break;
+        case '?':
+            out += std::to_string(last_status);
+            break;
+        case '!':
+            out += last_background ? std::to_string(last_background) : "";
+            break;
+        case '#':
+            out += std::to_string(arguments.size());
+            break;
+        case '@':
+        case '*':
+            for (size_t n = 0; n < arguments.size(); ++n) {
+                out += n ? " " : "";
+                out += arguments[n];
+            }
+            break;
+        case '0':
+            out += "shell";
+            break;
+        default:
+            if (static_cast<size_t>(c - '0') <= arguments.size()) {
+                out += arguments[c - '1'];
+            }
+        }
+    }
+
+public:
+    explicit Variables(char** environment) : stale(true) {
+        for (char** entry = environment; entry && *entry; ++entry) {
+            if (const char* equals = strchr(*entry, '=')) {
+                variables.try_emplace(std::string(*entry, equals - *entry), Variable{equals + 1, true, true});
+            }
+        }
+    }
+
+    Variables(const Variables&) = delete;
+    Variables& operator=(const Variables&) = delete;
+
+    // NAME: a letter or underscore, then letters, digits and underscores
+    static bool valid_name(std::string_view name) {
+        if (name.empty() || isdigit(static_cast<unsigned char>(name[0]))) {
+            return false;
+        }
+        for (char c : name) {
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '_') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The value of name, or nullptr if it is not set
+    const char* get(const std::string& name) const {
+        auto it = variables.find(name);
+        return it != variables.end() && it->second.defined ? it->second.value.c_str() : nullptr;
+    }
+
+    // Set name, keeping whether it is exported unless export_it is given
+    void set(const std::string& name, const std::string& value, bool export_it = false) {
+        auto result = variables.try_emplace(name, Variable{value, export_it, true});
+        Variable& variable = result.first->second;
+        if (!result.second) {
+            bool changed = !variable.defined || variable.value != value || (export_it && !variable.exported);
+            variable.value = value;
+            variable.defined = true;
+            variable.exported = variable.exported || export_it;
+            stale = stale || (changed && variable.exported);
+        } else {
+            stale = stale || export_it;
+        }
+    }
+
+    // Mark name exported; an unset name is exported once it gets a value
+    void export_name(const std::string& name) {
+        auto result = variables.try_emplace(name, Variable{std::string(), true, false});
+        Variable& variable = result.first->second;
+        stale = stale || (!variable.exported && variable.defined);
+        variable.exported = true;
+    }
+
+    void unset(const std::string& name) {
+        auto it = variables.find(name);
+        if (it != variables.end()) {
+            stale = stale || (it->second.exported && it->second.defined);
+            variables.erase(it);
+        }
+    }
+
+    // Environment for execve, rebuilt only after an exported variable changed
+    char* const* envp() {
+        if (stale) {
+            entries.clear();
+            for (const auto& variable : variables) {
+                if (variable.second.exported && variable.second.defined) {
+                    entries.push_back(variable.first + "=" + variable.second.value);
+                }
+            }
+            pointers.clear();
+            for (auto& entry : entries) {
+                pointers.push_back(&entry[0]);
+            }
+            pointers.push_back(nullptr);
+            stale = false;
+        }
+        return pointers.data();
+    }
+
+    // Calls visit(name, value, exported) for every set variable, by name
+    template<typename Visit>
+    void for_each(Visit visit) const {
+        for (const auto& variable : variables) {
+            if (variable.second.defined) {
+                visit(variable.first, variable.second.value, variable.second.exported);
+            }
+        }
+    }
+
+    // $?: the status of the last command
+    void set_status(int status) {
+        last_status = status;
+    }
+
+    int status() const {
+        return last_status;
+    }
+
+    // $!: the process started for the last background job
+    void set_background(pid_t pid) {
+        last_background = pid;
+    }
+
+    // Replace the positional parameters $1, $2... and return the old ones;
+    // functions swap their arguments in and back out
+    std::vector<std::string> swap_arguments(std::vector<std::string> replacement) {
+        arguments.swap(replacement);
+        return replacement;
+    }
+
+    const std::vector<std::string>& positional() const {
+        return arguments;
+    }
+
+    // Expand the $ reference starting at word[i] onto out and return the
+    // index just past it: $NAME, ${NAME}, $1 or ${10}, $?, $!, $$, $# and $@ or
+    // $* (the arguments joined by spaces). Unset names expand to nothing; a $
+    // not starting a reference is copied as it is.
+    size_t expand_at(const std::string& word, size_t i, std::string& out) const {
+        size_t start = i + 1;
+        if (start == word.size()) {
+            out += '$';
+            return start;
+        }
+        char c = word[start];
+        if (strchr("$?!#@*", c) || isdigit(static_cast<unsigned char>(c))) {
+            appendSpecial(c, out);
+            return start + 1;
+        }
+        size_t end = start;
+        bool braced = c == '{';
+        if (braced) {
+            end = word.find('}', ++start);
+            if (end == std::string::npos || end == start) {
+                out += '$';
+                return i + 1;
+            }
+            std::string_view name = std::string_view(word).substr(start, end - start);
+            if (name.find_first_not_of("0123456789") == std::string_view::npos) {
+                size_t n = name.size() < 10 ? std::stoul(std::string(name)) : SIZE_MAX;
+                if (n == 0) {
+                    out += "shell";
+                } else if (n <= arguments.size()) {
+                    out += arguments[n - 1];
+                }
+                return end + 1;
+            }
+            if (name.size() == 1 && strchr("$?!#@*", name[0])) {
+                appendSpecial(name[0], out);
+                return end + 1;
+            }
+            if (!valid_name(name)) {
+                out += '$';
+                return i + 1;
+            }
+        } else {
+            while (end < word.size() && (isalnum(static_cast<unsigned char>(word[end])) || word[end] == '_')) {
+                ++end;
+            }
+            if (end == start) {
+                out += '$';
+                return i + 1;
+            }
+        }
+        if (const char* value = get(word.substr(start, end - start))) {
+            out += value;
+        }
+        return braced ? end + 1 : end;
+    }
+};
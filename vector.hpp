@@ -1,6 +1,298 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <initializer_list>
+#include <type_traits>
 #include <utility>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// Element types whose == is equality of their bytes, so that they can be
+// searched and compared as raw memory. Floating point is left out: NaN is
+// unequal to itself and -0.0 equals 0.0.
+template<typename T>
+struct BitwiseComparable : std::integral_constant<bool,
+    (std::is_integral<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value)
+    && (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8)> {};
+
+// Element types that can be filled by storing a repeated byte pattern
+template<typename T>
+struct PatternFillable : std::integral_constant<bool, std::is_trivially_copyable<T>::value
+    && (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8)> {};
+
+#ifdef __SSE2__
+// SSE2 is part of x86-64, AVX2 is used when the CPU running us has it. The
+// kernels below work on whole 16 or 32 byte blocks of Width-byte lanes and
+// leave what is left over to the scalar loops of their callers.
+
+inline bool cpu_has_avx2() {
+    static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    return supported;
+}
+
+// value's bytes repeated over a whole AVX2 register
+template<typename T>
+inline void fill_pattern(const T& value, unsigned char (&pattern)[32]) {
+    for (size_t i = 0; i < sizeof(pattern); i += sizeof(T)) {
+        memcpy(pattern + i, &value, sizeof(T));
+    }
+}
+
+// All ones in the lanes where a and b are equal
+template<size_t Width>
+inline __m128i sse2_lanes_equal(__m128i a, __m128i b) {
+    if constexpr (Width == 1) {
+        return _mm_cmpeq_epi8(a, b);
+    } else if constexpr (Width == 2) {
+        return _mm_cmpeq_epi16(a, b);
+    } else if constexpr (Width == 4) {
+        return _mm_cmpeq_epi32(a, b);
+    } else {
+        // No 64-bit compare before SSE4.1: both 32-bit halves must match
+        __m128i halves = _mm_cmpeq_epi32(a, b);
+        return _mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+}
+
+template<size_t Width>
+__attribute__((target("avx2"))) inline __m256i avx2_lanes_equal(__m256i a, __m256i b) {
+    if constexpr (Width == 1) {
+        return _mm256_cmpeq_epi8(a, b);
+    } else if constexpr (Width == 2) {
+        return _mm256_cmpeq_epi16(a, b);
+    } else if constexpr (Width == 4) {
+        return _mm256_cmpeq_epi32(a, b);
+    } else {
+        return _mm256_cmpeq_epi64(a, b);
+    }
+}
+
+// Offset of the first lane equal to the pattern's, or of the end of the
+// whole blocks if there is none. A matching lane sets all its mask bits, so
+// the lowest one is where the lane starts.
+template<size_t Width>
+inline size_t sse2_find(const unsigned char* data, size_t size, const unsigned char* pattern) {
+    const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+    size_t i = 0;
+    for (; size - i >= 16; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        unsigned mask = _mm_movemask_epi8(sse2_lanes_equal<Width>(block, value));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+
+template<size_t Width>
+__attribute__((target("avx2"))) inline size_t avx2_find(const unsigned char* data, size_t size,
+                                                        const unsigned char* pattern) {
+    const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern));
+    size_t i = 0;
+    for (; size - i >= 32; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned mask = _mm256_movemask_epi8(avx2_lanes_equal<Width>(block, value));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + sse2_find<Width>(data + i, size - i, pattern);
+}
+
+// Number of lanes equal to the pattern's, leaving i at the end of the whole
+// blocks. Each byte of a matching lane adds one to its byte counter, so the
+// total is divided by Width; the counters are summed every 255 blocks,
+// before one can wrap.
+template<size_t Width>
+inline size_t sse2_count(const unsigned char* data, size_t size, const unsigned char* pattern, size_t& i) {
+    const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+    size_t bytes = 0;
+    while (size - i >= 16) {
+        size_t blocks = std::min<size_t>((size - i) / 16, 255);
+        __m128i lanes = _mm_setzero_si128();
+        for (size_t end = i + blocks * 16; i < end; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            lanes = _mm_sub_epi8(lanes, sse2_lanes_equal<Width>(block, value)); // A match is -1
+        }
+        __m128i sums = _mm_sad_epu8(lanes, _mm_setzero_si128()); // Two 64-bit sums
+        bytes += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return bytes / Width;
+}
+
+template<size_t Width>
+__attribute__((target("avx2"))) inline size_t avx2_count(const unsigned char* data, size_t size,
+                                                         const unsigned char* pattern, size_t& i) {
+    const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern));
+    size_t bytes = 0;
+    while (size - i >= 32) {
+        size_t blocks = std::min<size_t>((size - i) / 32, 255);
+        __m256i lanes = _mm256_setzero_si256();
+        for (size_t end = i + blocks * 32; i < end; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            lanes = _mm256_sub_epi8(lanes, avx2_lanes_equal<Width>(block, value));
+        }
+        __m256i quads = _mm256_sad_epu8(lanes, _mm256_setzero_si256()); // Four 64-bit sums
+        __m128i sums = _mm_add_epi64(_mm256_castsi256_si128(quads), _mm256_extracti128_si256(quads, 1));
+        bytes += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return bytes / Width + sse2_count<Width>(data, size, pattern, i);
+}
+
+// Offset of the first byte where a and b differ, or of the end of the whole
+// blocks if they agree that far
+inline size_t sse2_mismatch(const unsigned char* a, const unsigned char* b, size_t size) {
+    size_t i = 0;
+    for (; size - i >= 16; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFFu;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) inline size_t avx2_mismatch(const unsigned char* a, const unsigned char* b,
+                                                            size_t size) {
+    size_t i = 0;
+    for (; size - i >= 32; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + sse2_mismatch(a + i, b + i, size - i);
+}
+
+// Store the pattern over the whole blocks of data, leaving i past them
+inline void sse2_fill(unsigned char* data, size_t size, const unsigned char* pattern, size_t& i) {
+    const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+    for (; size - i >= 16; i += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), value);
+    }
+}
+
+__attribute__((target("avx2"))) inline void avx2_fill(unsigned char* data, size_t size,
+                                                      const unsigned char* pattern, size_t& i) {
+    const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern));
+    for (; size - i >= 32; i += 32) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), value);
+    }
+    sse2_fill(data, size, pattern, i);
+}
+#endif
+
+// Index of the first of size elements equal to value, or size
+template<typename T>
+inline size_t vector_find(const T* data, size_t size, const T& value) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if constexpr (BitwiseComparable<T>::value) {
+        if (size * sizeof(T) >= 16) {
+            unsigned char pattern[32];
+            fill_pattern(value, pattern);
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+            i = (cpu_has_avx2() ? avx2_find<sizeof(T)>(bytes, size * sizeof(T), pattern)
+                                : sse2_find<sizeof(T)>(bytes, size * sizeof(T), pattern)) / sizeof(T);
+        }
+    }
+#endif
+    while (i < size && !(data[i] == value)) {
+        ++i;
+    }
+    return i;
+}
+
+// Number of the size elements equal to value
+template<typename T>
+inline size_t vector_count(const T* data, size_t size, const T& value) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    if constexpr (BitwiseComparable<T>::value) {
+        if (size * sizeof(T) >= 16) {
+            unsigned char pattern[32];
+            fill_pattern(value, pattern);
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+            count = cpu_has_avx2() ? avx2_count<sizeof(T)>(bytes, size * sizeof(T), pattern, i)
+                                   : sse2_count<sizeof(T)>(bytes, size * sizeof(T), pattern, i);
+            i /= sizeof(T);
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        count += data[i] == value;
+    }
+    return count;
+}
+
+// Index of the first of size elements where a and b differ, or size
+template<typename T>
+inline size_t vector_mismatch(const T* a, const T* b, size_t size) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if constexpr (BitwiseComparable<T>::value) {
+        if (size * sizeof(T) >= 16) {
+            const unsigned char* x = reinterpret_cast<const unsigned char*>(a);
+            const unsigned char* y = reinterpret_cast<const unsigned char*>(b);
+            i = (cpu_has_avx2() ? avx2_mismatch(x, y, size * sizeof(T))
+                                : sse2_mismatch(x, y, size * sizeof(T))) / sizeof(T);
+        }
+    }
+#endif
+    while (i < size && a[i] == b[i]) {
+        ++i;
+    }
+    return i;
+}
+
+// Whether the size elements of a and b are all equal
+template<typename T>
+inline bool vector_equal(const T* a, const T* b, size_t size) {
+    if constexpr (BitwiseComparable<T>::value) {
+        return size == 0 || memcmp(a, b, size * sizeof(T)) == 0;
+    } else {
+        return vector_mismatch(a, b, size) == size;
+    }
+}
+
+// Assign value to the size elements of data
+template<typename T>
+inline void vector_fill(T* data, size_t size, const T& value) {
+    size_t i = 0;
+    if constexpr (PatternFillable<T>::value && sizeof(T) == 1) {
+        if (size > 0) {
+            unsigned char byte;
+            memcpy(&byte, &value, 1);
+            memset(data, byte, size);
+        }
+        return;
+    }
+#ifdef __SSE2__
+    if constexpr (PatternFillable<T>::value) {
+        if (size * sizeof(T) >= 16) {
+            unsigned char pattern[32];
+            fill_pattern(value, pattern);
+            unsigned char* bytes = reinterpret_cast<unsigned char*>(data);
+            if (cpu_has_avx2()) {
+                avx2_fill(bytes, size * sizeof(T), pattern, i);
+            } else {
+                sse2_fill(bytes, size * sizeof(T), pattern, i);
+            }
+            i /= sizeof(T);
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        data[i] = value;
+    }
+}
 
 template<typename T>
 class Vector {
@@ -34,9 +326,8 @@ public:
     
     explicit Vector(size_t count, const T& value = T()) : data(nullptr), capacity_(0), size_(0) {
         reserve(count);
-        for (size_t i = 0; i < count; ++i) {
-            push_back(value);
-        }
+        vector_fill(data, count, value);
+        size_ = count;
     }
     
     Vector(std::initializer_list<T> init) : data(nullptr), capacity_(0), size_(0) {
@@ -346,13 +637,39 @@ public:
             }
             
             // Construct new elements
-            for (size_t i = size_; i < count; ++i) {
-                data[i] = value;
-            }
+            vector_fill(data + size_, count - size_, value);
         }
         size_ = count;
     }
     
+    // Search and comparison. Integer, enum and pointer elements are scanned
+    // with SIMD, the rest compared one by one with ==.
+    iterator find(const T& value) {
+        return data + vector_find(data, size_, value);
+    }
+
+    const_iterator find(const T& value) const {
+        return data + vector_find(data, size_, value);
+    }
+
+    size_t count(const T& value) const {
+        return vector_count(data, size_, value);
+    }
+
+    bool contains(const T& value) const {
+        return find(value) != end();
+    }
+
+    // Index of the first element that differs from other's, or the size of
+    // the shorter one if it is a prefix of the other
+    size_t mismatch(const Vector& other) const {
+        return vector_mismatch(data, other.data, std::min(size_, other.size_));
+    }
+
+    void fill(const T& value) {
+        vector_fill(data, size_, value);
+    }
+
     void swap(Vector& other) noexcept {
         std::swap(data, other.data);
         std::swap(size_, other.size_);
@@ -363,17 +680,7 @@ public:
 // Non-member functions
 template<typename T>
 bool operator==(const Vector<T>& lhs, const Vector<T>& rhs) {
-    if (lhs.size() != rhs.size()) {
-        return false;
-    }
-    
-    for (size_t i = 0; i < lhs.size(); ++i) {
-        if (!(lhs[i] == rhs[i])) {
-            return false;
-        }
-    }
-    
-    return true;
+    return lhs.size() == rhs.size() && vector_equal(lhs.data_ptr(), rhs.data_ptr(), lhs.size());
 }
 
 template<typename T>
@@ -0,0 +1,158 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own task deque. A worker runs
+// its newest task first (depth-first, so a tree walk keeps few directories
+// open) and, when its deque is empty, steals the oldest task from another
+// worker (breadth-first, so a thief takes the biggest pending piece of work).
+//
+// Tasks may submit more tasks; wait() returns once every submitted task,
+// including those, has finished.
+class WorkStealingPool {
+public:
+    typedef std::function<void()> Task;
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex sleep_lock;
+    std::condition_variable wake;     // Idle workers wait here for tasks
+    std::condition_variable finished; // wait() waits here for pending to reach 0
+    std::atomic<size_t> queued;       // Tasks sitting in some deque
+    std::atomic<size_t> pending;      // Tasks submitted and not yet finished
+    std::atomic<size_t> next_queue;   // Round robin for submissions from outside
+    bool stopping;
+
+    // Which pool and deque the calling thread works for, if any
+    static inline thread_local WorkStealingPool* current_pool = nullptr;
+    static inline thread_local size_t current_index = 0;
+
+    bool popLocal(size_t index, Task& task) {
+        Queue& queue = *queues[index];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        queued.fetch_sub(1);
+        return true;
+    }
+
+    bool steal(size_t index, Task& task) {
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue& queue = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                queued.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t index) {
+        current_pool = this;
+        current_index = index;
+        for (;;) {
+            Task task;
+            if (popLocal(index, task) || steal(index, task)) {
+                task();
+                task = nullptr; // Release captures before reporting completion
+                if (pending.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> guard(sleep_lock);
+                    finished.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            wake.wait(guard, [this] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    // Filesystem work blocks in system calls, so use more threads than cores
+    static size_t default_threads() {
+        return std::max<size_t>(4, std::thread::hardware_concurrency());
+    }
+
+    explicit WorkStealingPool(size_t threads = default_threads())
+        : queued(0), pending(0), next_queue(0), stopping(false) {
+        threads = std::max<size_t>(1, threads);
+        for (size_t i = 0; i < threads; ++i) {
+            queues.emplace_back(new Queue);
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back(&WorkStealingPool::work, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        wait();
+        {
+            std::lock_guard<std::mutex> guard(sleep_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Queue a task. From a worker it goes on that worker's own deque.
+    void submit(Task task) {
+        size_t index = current_pool == this ? current_index : next_queue.fetch_add(1) % queues.size();
+        pending.fetch_add(1);
+        {
+            Queue& queue = *queues[index];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.tasks.push_back(std::move(task));
+            queued.fetch_add(1);
+        }
+        {
+            // Pairs with the predicate check in work() so the wakeup is not lost
+            std::lock_guard<std::mutex> guard(sleep_lock);
+        }
+        wake.notify_one();
+    }
+
+    // Block until every submitted task has finished. Must not be called from
+    // a worker.
+    void wait() {
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        finished.wait(guard, [this] { return pending.load() == 0; });
+    }
+
+    // wait() with a timeout; returns true if everything has finished
+    bool wait_for(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        return finished.wait_for(guard, timeout, [this] { return pending.load() == 0; });
+    }
+};